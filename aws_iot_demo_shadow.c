@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
 
 /* Set up logging for this demo. */
 #include "iot_demo_logging.h"
@@ -30,6 +31,10 @@
 /*Uart headers */
 #include "FreeRTOS.h"
 #include "task.h"
+#include "queue.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_system.h"
 #include "driver/uart.h"
 #include "aws_iot_shadow_blem.h"
 /*
@@ -47,6 +52,22 @@
 
 #define BUF_SIZE (1024)
 
+/**
+ * @brief Longest command written to the mesh.
+ */
+#define BRIDGE_UART_COMMAND_MAX (BUF_SIZE)
+
+/**
+ * @brief Size of the pieces a command is written to the uart tx buffer in.
+ */
+#define BRIDGE_UART_WRITE_CHUNK (256)
+
+/**
+ * @brief Silence on the uart after which the bytes of a packet shorter than
+ * a frame are ingested as they are.
+ */
+#define BRIDGE_UART_FRAME_GAP_MS (50)
+
 /**
  * Provide default values for undefined configuration settings.
  */
@@ -74,6 +95,275 @@
  */
 #define TIMEOUT_MS (10000)
 
+/**
+ * @brief Keep the MQTT session on the broker between connections.
+ *
+ * With a persistent session the broker keeps the delta subscription and the
+ * QoS 1 deltas published while the gateway was away. After a software restart
+ * the delta subscription is taken over when connecting, so the queued deltas
+ * are forwarded before the delta topics are subscribed again.
+ */
+#define BRIDGE_MQTT_PERSISTENT_SESSION (1)
+
+/**
+ * @brief Wait before the first retry of a failed connect, doubled after every
+ * further failure up to the maximum.
+ */
+#define BRIDGE_CONNECT_BACKOFF_MIN_MS (500)
+#define BRIDGE_CONNECT_BACKOFF_MAX_MS (32000)
+
+/**
+ * @brief Marks a valid SessionCache_t in rtc memory.
+ */
+#define BRIDGE_SESSION_CACHE_MAGIC (0x5e551011)
+
+/**
+ * @brief Cores the bridge pipeline is pinned to.
+ *
+ * UART parsing runs on BRIDGE_UART_CORE, MQTT and TLS work runs on
+ * BRIDGE_NETWORK_CORE together with the wifi stack.
+ */
+#define BRIDGE_NETWORK_CORE (0)
+#define BRIDGE_UART_CORE (1)
+
+/**
+ * @brief Stack sizes in bytes and priority of the pipeline tasks.
+ */
+#define BRIDGE_UART_TASK_STACK (4096)
+#define BRIDGE_PUBLISHER_TASK_STACK (6144)
+#define BRIDGE_TASK_PRIORITY (tskIDLE_PRIORITY + 5)
+
+/**
+ * @brief Depth of the rings and mailboxes between the pipeline stages.
+ */
+#define BRIDGE_FRAME_RING_CAPACITY (16)
+#define BRIDGE_DELTA_SLOT_COUNT (4)
+
+#if (BRIDGE_FRAME_RING_CAPACITY & (BRIDGE_FRAME_RING_CAPACITY - 1)) != 0
+#error "BRIDGE_FRAME_RING_CAPACITY must be a power of two."
+#endif
+
+/**
+ * @brief How many times in a row a lower priority lane may be passed over
+ * before it is served ahead of the higher priority lanes.
+ */
+#define BRIDGE_LANE_STARVATION_LIMIT (8)
+
+/**
+ * @brief Longest time a collapsed command waits for the mesh to ack the
+ * previous one before it is released anyway.
+ */
+#define BRIDGE_MESH_RELEASE_MS (300)
+
+/**
+ * @brief How long after an own shadow update its deltas are recognized as
+ * echoes and not sent back to the mesh.
+ */
+#define BRIDGE_ECHO_WINDOW_MS (5000)
+
+/* The BRIDGE_RATE_* limits are in aws_iot_shadow_limiter.h */
+
+/**
+ * @brief Push the desired state that changed while the gateway was down to
+ * the mesh after connecting.
+ */
+#define BRIDGE_BOOT_SYNC (1)
+
+/**
+ * @brief Record the uart and shadow traffic, or replay a recorded trace.
+ *
+ * BRIDGE_TRACE_RECORD logs the trace as hex lines, BRIDGE_TRACE_REPLAY needs
+ * the trace file linked in as bridge_trace.bin (COMPONENT_EMBED_FILES) and
+ * feeds it to the pipeline instead of the uart.
+ */
+#define BRIDGE_TRACE_MODE (BRIDGE_TRACE_OFF)
+
+/**
+ * @brief Size of each of the two ram buffers of the recorder.
+ */
+#define BRIDGE_TRACE_BUFFER_SIZE (8192)
+
+/**
+ * @brief Replay at the recorded pace (1), N times faster, or as fast as the
+ * pipeline takes the frames (0).
+ */
+#define BRIDGE_TRACE_REPLAY_SPEED (1)
+
+/**
+ * @brief Replace the uart by a simulated provisioner with virtual nodes, for
+ * load tests without a mesh.
+ */
+#define BRIDGE_MESH_SIMULATOR (0)
+
+/**
+ * @brief Virtual nodes of the simulator and the traffic they generate.
+ */
+#define BRIDGE_MESH_SIM_NODES (100)
+#define BRIDGE_MESH_SIM_PATTERN (MESH_SIM_POISSON)
+
+/**
+ * @brief Mean time between two reports of one node with MESH_SIM_POISSON.
+ */
+#define BRIDGE_MESH_SIM_NODE_INTERVAL_MS (10000)
+
+/**
+ * @brief Time between two bursts or scenes, and between two slider steps.
+ */
+#define BRIDGE_MESH_SIM_BURST_PERIOD_MS (5000)
+#define BRIDGE_MESH_SIM_SLIDER_STEP_MS (20)
+
+/**
+ * @brief Time the simulated mesh takes to apply a command and ack it.
+ */
+#define BRIDGE_MESH_SIM_ACK_MS (50)
+
+/**
+ * @brief Keep the thing shadow in process instead of connecting to AWS IoT,
+ * so throughput and latency can be measured offline and repeatably.
+ */
+#define BRIDGE_SHADOW_EMULATOR (0)
+
+/**
+ * @brief Run the SCHEMA_RULE automations on the gateway (1), or leave them to
+ * the cloud (0).
+ */
+#define BRIDGE_LOCAL_RULES (1)
+
+/**
+ * @brief How long the result of a rule waits for the ack of the mesh before
+ * it is given up and not reported.
+ */
+#define BRIDGE_RULE_ACK_MS (2000)
+
+/**
+ * @brief Round trip added to every emulated shadow operation.
+ */
+#define BRIDGE_SHADOW_EMU_LATENCY_MS (40)
+
+/**
+ * @brief Updates per second the emulated shadow accepts before it throttles,
+ * 0 never throttles.
+ */
+#define BRIDGE_SHADOW_EMU_RATE_PER_SEC (20)
+
+/**
+ * @brief Largest update document the emulated shadow accepts.
+ */
+#define BRIDGE_SHADOW_EMU_DOCUMENT_MAX (8192)
+
+/**
+ * @brief How often the emulated app changes a desired value, 0 never.
+ */
+#define BRIDGE_SHADOW_EMU_APP_PERIOD_MS (1000)
+
+/**
+ * @brief How often the uart ingress task checks the rx buffer.
+ */
+#define BRIDGE_UART_POLL_MS (10)
+
+/**
+ * @brief How often the utilization of the pipeline stages is logged.
+ */
+#define BRIDGE_STATS_PERIOD_MS (10000)
+
+/**
+ * @brief State shared by the pipeline tasks.
+ */
+static BridgeContext_t _bridgeContext;
+
+/**
+ * @brief Subscription state of the previous session, survives esp_restart().
+ */
+static RTC_NOINIT_ATTR SessionCache_t _sessionCache;
+
+/**
+ * @brief Trace of the traffic, written from every task that touches it.
+ */
+static TraceRecorder_t _traceRecorder;
+
+/**
+ * @brief Simulated provisioner, used when BRIDGE_MESH_SIMULATOR is set.
+ */
+static MeshSimulator_t _meshSimulator;
+
+/**
+ * @brief Emulated thing shadow, used when BRIDGE_SHADOW_EMULATOR is set.
+ */
+static ShadowEmulator_t _shadowEmulator;
+
+#if ( BRIDGE_TRACE_MODE == BRIDGE_TRACE_REPLAY )
+extern const uint8_t _traceStart[] asm("_binary_bridge_trace_bin_start");
+extern const uint8_t _traceEnd[] asm("_binary_bridge_trace_bin_end");
+#endif
+
+/**
+ * @brief Names of the traffic classes for the logs.
+ */
+static const char * const _trafficClassNames[CLASS_COUNT] = { "security", "control", "telemetry" };
+
+/**
+ * @brief Names of the start-up milestones for the logs.
+ */
+static const char * const _bootMilestoneNames[BOOT_MILESTONE_COUNT] = { "uart ready", "pipeline started", "connected", "subscribed", "synced", "first command" };
+
+/**
+ * @brief The shadow schema, every device attribute the bridge encodes,
+ * decodes and syncs, grouped by device. Generated from
+ * aws_iot_shadow_schema.def.
+ */
+#define SCHEMA_CHOICES(...) .pChoices = { __VA_ARGS__ }
+#define SCHEMA_RANGE(min, max, decimals_) .minimum = (min), .maximum = (max), .decimals = (decimals_)
+
+static const SchemaAttribute_t _schemaAttributes[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = {
+#define SCHEMA_FIELD(device_, attribute_, deviceKey, attributeKey, valueType_, trafficClass_, accepted) \
+    [SCHEMA_##device_##_##attribute_] = { .device = device_, .attribute = attribute_,              \
+                                          .pDevice = deviceKey, .pAttribute = attributeKey,        \
+                                          .valueType = valueType_, .trafficClass = trafficClass_,  \
+                                          accepted },
+#include "aws_iot_shadow_schema.def"
+};
+
+/**
+ * @brief Names of the device types and attributes in the uart frames.
+ */
+static const DeviceName_t _deviceNames[] = {
+#define SCHEMA_DEVICE(device, value, name) { device, name },
+#include "aws_iot_shadow_schema.def"
+};
+
+static const AttributeName_t _attributeNames[] = {
+#define SCHEMA_ATTRIBUTE(attribute, value, name) { attribute, name },
+#include "aws_iot_shadow_schema.def"
+};
+
+/**
+ * @brief Mesh groups the scenes of the desired state are multicast to.
+ */
+static const MeshGroup_t _meshGroups[] = {
+#define SCHEMA_GROUP(key, address) { key, address },
+#include "aws_iot_shadow_schema.def"
+};
+
+static const LocalRule_t _localRules[] = {
+#define SCHEMA_RULE(triggerDevice, triggerAttribute, triggerValue, targetDevice, targetAttribute, targetValue) \
+    { SCHEMA_##triggerDevice##_##triggerAttribute, triggerValue, SCHEMA_##targetDevice##_##targetAttribute, targetValue },
+#include "aws_iot_shadow_schema.def"
+    { BRIDGE_SCHEMA_ATTRIBUTE_COUNT, NULL, BRIDGE_SCHEMA_ATTRIBUTE_COUNT, NULL }//no rule, keeps the table from being empty
+};
+
+/* The names have to fit their blocks of the uart frame and the keys the
+ * bound of SHADOW_UPDATE_DOCUMENT_SIZE. */
+#define SCHEMA_DEVICE(device, value, name) \
+    _Static_assert(sizeof(name) <= deviceNameLength, "device name " name " does not fit the uart frame");
+#define SCHEMA_ATTRIBUTE(attribute, value, name) \
+    _Static_assert(sizeof(name) <= attributeNameLength, "attribute name " name " does not fit the uart frame");
+#define SCHEMA_FIELD(device, attribute, deviceKey, attributeKey, ...)                                   \
+    _Static_assert(sizeof(deviceKey) <= SHADOW_DEVICE_KEY_MAX, "shadow key " deviceKey " is too long"); \
+    _Static_assert(sizeof(attributeKey) <= SHADOW_ATTRIBUTE_KEY_MAX, "shadow key " attributeKey " is too long");
+#define SCHEMA_GROUP(key, address) \
+    _Static_assert((address) >= 0xC000 && (address) <= 0xFEFF, "group " key " is not a mesh group address");
+#include "aws_iot_shadow_schema.def"
+
 
 /*-----------------------------------------------------------*/
 static void uart_init()
@@ -181,6 +471,8 @@ static void _cleanupDemo(void)
  * @param[in] pNetworkCredentialInfo Passed to the MQTT connect function when
  * establishing the MQTT connection.
  * @param[in] pNetworkInterface The network interface to use for this demo.
+ * @param[in] pBridge The bridge the delta subscription of a resumed session
+ * is delivered to.
  * @param[out] pMqttConnection Set to the handle to the new MQTT connection.
  *
  * @return `EXIT_SUCCESS` if the connection is successfully established; `EXIT_FAILURE`
@@ -190,12 +482,14 @@ static int _establishMqttConnection(const char *pIdentifier,
                                     void *pNetworkServerInfo,
                                     void *pNetworkCredentialInfo,
                                     const IotNetworkInterface_t *pNetworkInterface,
+                                    BridgeContext_t *pBridge,
                                     IotMqttConnection_t *pMqttConnection)
 {
     int status = EXIT_SUCCESS;
     IotMqttError_t connectStatus = IOT_MQTT_STATUS_PENDING;
     IotMqttNetworkInfo_t networkInfo = IOT_MQTT_NETWORK_INFO_INITIALIZER;
     IotMqttConnectInfo_t connectInfo = IOT_MQTT_CONNECT_INFO_INITIALIZER;
+    IotMqttSubscription_t deltaSubscriptions[BRIDGE_THING_COUNT];
 
     if (pIdentifier == NULL)
     {
@@ -208,10 +502,9 @@ static int _establishMqttConnection(const char *pIdentifier,
     {
         /* Set the members of the network info not set by the initializer. This
          * struct provided information on the transport layer to the MQTT connection. */
-        networkInfo.createNetworkConnection = true;
-        networkInfo.u.setup.pNetworkServerInfo = pNetworkServerInfo;
-        networkInfo.u.setup.pNetworkCredentialInfo = pNetworkCredentialInfo;
+        networkInfo.createNetworkConnection = false;
         networkInfo.pNetworkInterface = pNetworkInterface;
+        pBridge->pNetworkInterface = pNetworkInterface;
 
 #if (IOT_MQTT_ENABLE_SERIALIZER_OVERRIDES == 1) && defined(IOT_DEMO_MQTT_SERIALIZER)
         networkInfo.pMqttSerializer = IOT_DEMO_MQTT_SERIALIZER;
@@ -219,9 +512,35 @@ static int _establishMqttConnection(const char *pIdentifier,
 
         /* Set the members of the connection info not set by the initializer. */
         connectInfo.awsIotMqttMode = true;
-        connectInfo.cleanSession = true;
+        connectInfo.cleanSession = (BRIDGE_MQTT_PERSISTENT_SESSION == 0);
         connectInfo.keepAliveSeconds = KEEP_ALIVE_SECONDS;
 
+        /* Take over the delta subscriptions the broker kept for the previous
+         * session, so deltas it queued are forwarded as soon as the
+         * connection is up. The MQTT library does not tell whether the broker
+         * really kept the session, the topics are subscribed again anyway. */
+        pBridge->sessionResumed = (BRIDGE_MQTT_PERSISTENT_SESSION == 1) &&
+                                  _sessionCacheValid(pIdentifier, strlen(pIdentifier));
+
+        if (pBridge->sessionResumed == true)
+        {
+            for (size_t i = 0; i < BRIDGE_THING_COUNT; i++)
+            {
+                Thing_t *pThing = &pBridge->things[i];
+
+                deltaSubscriptions[i].qos = IOT_MQTT_QOS_1;
+                deltaSubscriptions[i].pTopicFilter = pThing->deltaTopic;
+                deltaSubscriptions[i].topicFilterLength = (uint16_t)strlen(pThing->deltaTopic);
+                deltaSubscriptions[i].callback.pCallbackContext = pThing;
+                deltaSubscriptions[i].callback.function = _mqttDeltaCallback;
+            }
+
+            connectInfo.pPreviousSubscriptions = deltaSubscriptions;
+            connectInfo.previousSubscriptionCount = BRIDGE_THING_COUNT;
+
+            IotLogInfo("Resuming the previous session of %d things", BRIDGE_THING_COUNT);
+        }
+
         /* AWS IoT recommends the use of the Thing Name as the MQTT client ID. */
         connectInfo.pClientIdentifier = pIdentifier;
         connectInfo.clientIdentifierLength = (uint16_t)strlen(pIdentifier);
@@ -232,9 +551,20 @@ static int _establishMqttConnection(const char *pIdentifier,
                    connectInfo.clientIdentifierLength);
 
         size_t connectNum = 0;
-        /* Establish the MQTT connection. */
+        uint32_t backoffMs = BRIDGE_CONNECT_BACKOFF_MIN_MS;
+        pBridge->connectStartMs = IotClock_GetTimeMs();
+        /* Establish the MQTT connection. The TLS connection is created here
+         * rather than by the MQTT library so its handshake can be timed. */
         while(connectStatus != IOT_MQTT_SUCCESS)
         {
+            if (_openNetworkConnection(pBridge, pNetworkServerInfo, pNetworkCredentialInfo) != IOT_NETWORK_SUCCESS)
+            {
+                connectNum++;
+                _connectBackoff(&backoffMs);
+                continue;
+            }
+
+            networkInfo.u.pNetworkConnection = pBridge->pNetworkConnection;
             connectStatus = IotMqtt_Connect(&networkInfo,
                                         &connectInfo,
                                         10000,
@@ -244,8 +574,19 @@ static int _establishMqttConnection(const char *pIdentifier,
                 connectNum++;
                 IotLogError("MQTT CONNECT returned error %s. connect number %d",
                             IotMqtt_strerror(connectStatus),connectNum);
+
+                /* A second CONNECT on a connection is a protocol violation,
+                 * and the receive callback of the connection still points at
+                 * the mqtt connection that failed, so every retry starts over
+                 * with a new connection. */
+                _closeNetworkConnection(pBridge);
+                _connectBackoff(&backoffMs);
             }
         }   
+
+        IotLogInfo("Connected after %u TLS handshakes (last %u ms)",
+                   pBridge->connectStats.fullHandshakes,
+                   pBridge->connectStats.lastHandshakeMs);
     }
 
     return status;
@@ -254,192 +595,196 @@ static int _establishMqttConnection(const char *pIdentifier,
 /*-----------------------------------------------------------*/
 
 /**
- * @brief Parses the "state" key from the "previous" or "current" sections of a
- * Shadow updated document.
+ * @brief Shadow updated callback, invoked when the Shadow document changes.
  *
- * @param[in] pUpdatedDocument The Shadow updated document to parse.
- * @param[in] updatedDocumentLength The length of `pUpdatedDocument`.
- * @param[in] pSectionKey Either "previous" or "current". Must be NULL-terminated.
- * @param[out] pState Set to the first character in "state".
- * @param[out] pStateLength Length of the "state" section.
+ * The current state of the document replaces the mirrored one, so desired
+ * values that no delta reports, like a value set equal to the reported one
+ * or a removed key, reach the mirror too.
  *
- * @return `true` if the "state" was found; `false` otherwise.
+ * @param[in] pCallbackContext The thing whose shadow was updated.
+ * @param[in] pCallbackParam The received Shadow updated document.
  */
-// static bool _getUpdatedState( const char * pUpdatedDocument,
-//                               size_t updatedDocumentLength,
-//                               const char * pSectionKey,
-//                               const char ** pState,
-//                               size_t * pStateLength )
-// {
-//     bool sectionFound = false, stateFound = false;
-//     const size_t sectionKeyLength = strlen( pSectionKey );
-//     const char * pSection = NULL;
-//     size_t sectionLength = 0;
-
-//     /* Find the given section in the updated document. */
-//     sectionFound = IotJsonUtils_FindJsonValue( pUpdatedDocument,
-//                                                updatedDocumentLength,
-//                                                pSectionKey,
-//                                                sectionKeyLength,
-//                                                &pSection,
-//                                                &sectionLength );
-
-//     if( sectionFound == true )
-//     {
-//         /* Find the "state" key within the "previous" or "current" section. */
-//         stateFound = IotJsonUtils_FindJsonValue( pSection,
-//                                                  sectionLength,
-//                                                  "state",
-//                                                  5,
-//                                                  pState,
-//                                                  pStateLength );
-//     }
-//     else
-//     {
-//         IotLogWarn( "Failed to find section %s in Shadow updated document.",
-//                     pSectionKey );
-//     }
+static void _shadowUpdatedCallback( void * pCallbackContext,
+                                    AwsIotShadowCallbackParam_t * pCallbackParam )
+{
+    Thing_t * pThing = pCallbackContext;
 
-//     return stateFound;
-// }
+    _mirrorApplyDocuments( &pThing->pBridge->shadowMirror,
+                           pThing->index,
+                           pCallbackParam->u.callback.pDocument,
+                           pCallbackParam->u.callback.documentLength );
+}
 
+/**
+ * copy a delta into the mailbox of the mesh tx task, whichever callback
+ * received it
+ */
+static void _postDelta( BridgeContext_t * pBridge,
+                        uint8_t thing,
+                        const char * pDocument,
+                        size_t documentLength )
+{
+    uint32_t startUs = (uint32_t) esp_timer_get_time();
 
-/*-----------------------------------------------------------*/
+    _traceRecord( TRACE_SHADOW_DELTA, thing, pDocument, documentLength );
+
+    if( _mailboxPost( &pBridge->deltaMailbox,
+                      thing,
+                      pDocument,
+                      documentLength,
+                      startUs,
+                      SLOT_KIND_DELTA ) == false )
+    {
+        /* The delta is kept in the mirror only, the mesh tx task writes
+         * whatever the mesh is missing once it has drained the mailbox. */
+        _mirrorApplyDelta( &pBridge->shadowMirror, thing, pDocument, documentLength );
+        __atomic_store_n( &pBridge->deltaMailbox.resync, true, __ATOMIC_RELEASE );
+        if( pBridge->deltaMailbox.consumer != NULL )
+        {
+            xTaskNotifyGive( pBridge->deltaMailbox.consumer );
+        }
+    }
+
+    _stageRecord( &pBridge->stats[STAGE_SHADOW_DELTA], startUs );
+}
 
-// /**
-//  * @brief Shadow updated callback, invoked when the Shadow document changes.
-//  *
-//  * This function reports when a Shadow has been updated.
-//  *
-//  * @param[in] pCallbackContext Not used.
-//  * @param[in] pCallbackParam The received Shadow updated document.
-//  */
-// static void _shadowUpdatedCallback( void * pCallbackContext,
-//                                     AwsIotShadowCallbackParam_t * pCallbackParam )
-// {
-//     bool previousFound = false, currentFound = false;
-//     const char * pPrevious = NULL, * pCurrent = NULL;
-//     size_t previousLength = 0, currentLength = 0;
-
-//     /* Silence warnings about unused parameters. */
-//     ( void ) pCallbackContext;
-
-//     /* Find the previous Shadow document. */
-//     previousFound = _getUpdatedState( pCallbackParam->u.callback.pDocument,
-//                                       pCallbackParam->u.callback.documentLength,
-//                                       "previous",
-//                                       &pPrevious,
-//                                       &previousLength );
-
-//     /* Find the current Shadow document. */
-//     currentFound = _getUpdatedState( pCallbackParam->u.callback.pDocument,
-//                                      pCallbackParam->u.callback.documentLength,
-//                                      "current",
-//                                      &pCurrent,
-//                                      &currentLength );
-
-//     /* Log the previous and current states. */
-//     if( ( previousFound == true ) && ( currentFound == true ) )
-//     {
-//         IotLogInfo( "Shadow was updated!\r\n"
-//                     "Previous: {\"state\":%.*s}\r\n"
-//                     "Current:  {\"state\":%.*s}",
-//                     30,
-//                     pPrevious,
-//                     30,
-//                     pCurrent );
-//     }
-//     else
-//     {
-//         if( previousFound == false )
-//         {
-//             IotLogWarn( "Previous state not found in Shadow updated document." );
-//         }
-
-//         if( currentFound == false )
-//         {
-//             IotLogWarn( "Current state not found in Shadow updated document." );
-//         }
-//     }
-// }
 /**
  * @brief Shadow delta callback, invoked when the desired and updates Shadow
  * states differ.
  *
- * This function simulates a device updating its state in response to a Shadow.
+ * This runs on the mqtt task pool, so it only copies the delta into the
+ * mailbox of the mesh tx task and returns; parsing, logging and the uart write
+ * happen on the mesh tx task.
  *
- * @param[in] pCallbackContext Not used.
+ * @param[in] pCallbackContext The thing whose shadow sent the delta.
  * @param[in] pCallbackParam The received Shadow delta document.
  */
 static void _shadowDeltaCallback( void * pCallbackContext,
                                   AwsIotShadowCallbackParam_t * pCallbackParam )
 {
-    bool deltaFound = false;
-    IotSemaphore_t * pDeltaSemaphore = pCallbackContext;
+    Thing_t * pThing = pCallbackContext;
+
+    _postDelta( pThing->pBridge,
+                pThing->index,
+                pCallbackParam->u.callback.pDocument,
+                pCallbackParam->u.callback.documentLength );
+}
+
+/**
+ * The payload of the delta topic is the document the Shadow library would
+ * pass to _shadowDeltaCallback.
+ */
+static void _mqttDeltaCallback( void * pCallbackContext,
+                                IotMqttCallbackParam_t * pCallbackParam )
+{
+    Thing_t * pThing = pCallbackContext;
 
+    /* Once the delta topic is subscribed again the shadow library delivers
+     * the same publish to _shadowDeltaCallback. */
+    if( __atomic_load_n( &pThing->deltaSubscribed, __ATOMIC_ACQUIRE ) == true )
+    {
+        return;
+    }
+
+    _postDelta( pThing->pBridge,
+                pThing->index,
+                pCallbackParam->u.message.info.pPayload,
+                pCallbackParam->u.message.info.payloadLength );
+}
+
+/**
+ * find the "state" of a delta document and write it into the uart port
+ */
+static size_t _forwardDelta(uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    bool deltaFound = false;
     const char * pDelta = NULL;
     size_t deltaLength = 0;
-    IotLogInfo("Received Document is:\r\n%.*s",pCallbackParam->u.callback.documentLength,
-                                               pCallbackParam->u.callback.pDocument);
+
+    IotLogDebug("Received Document is:\r\n%.*s",documentLength,pDocument);
     /* Check if there is a different "ON_OFF" state in the Shadow. */
-    deltaFound = IotJsonUtils_FindJsonValue( pCallbackParam->u.callback.pDocument,
-                                            pCallbackParam->u.callback.documentLength,
+    deltaFound = IotJsonUtils_FindJsonValue( pDocument,
+                                            documentLength,
                                             "state",
                                             5,
                                             &pDelta,
                                             &deltaLength );
 
-    IotLogInfo("pDelta is %.*s\r\n",deltaLength,pDelta);
+    IotLogDebug("pDelta is %.*s\r\n",deltaLength,pDelta);
     if( deltaFound == true )
     {   
         //write extracted command to uart
-        _write_command_into_uart(pDelta,deltaLength);
-    /* Post to the delta semaphore to unblock the thread sending Shadow updates. */
-    IotSemaphore_Post( pDeltaSemaphore );
+        return _write_command_into_uart(thing,pDelta,deltaLength);
     }
+    return 0;
 }
 
-static int _setShadowCallbacks( IotSemaphore_t * pDeltaSemaphore,
-                                IotMqttConnection_t mqttConnection,
-                                const char * pThingName,
-                                size_t thingNameLength )
+static int _setShadowCallbacks( BridgeContext_t * pBridge,
+                                IotMqttConnection_t mqttConnection )
 {
     int status = EXIT_SUCCESS;
     AwsIotShadowError_t callbackStatus = AWS_IOT_SHADOW_STATUS_PENDING;
-    AwsIotShadowCallbackInfo_t deltaCallback = AWS_IOT_SHADOW_CALLBACK_INFO_INITIALIZER;
-                            //    updatedCallback = AWS_IOT_SHADOW_CALLBACK_INFO_INITIALIZER;
+    AwsIotShadowCallbackInfo_t deltaCallback = AWS_IOT_SHADOW_CALLBACK_INFO_INITIALIZER,
+                               updatedCallback = AWS_IOT_SHADOW_CALLBACK_INFO_INITIALIZER;
 
     /* Set the functions for callbacks. */
-    deltaCallback.pCallbackContext = pDeltaSemaphore;
     deltaCallback.function = _shadowDeltaCallback;
-    // updatedCallback.function = _shadowUpdatedCallback;
-
-    /* Set the delta callback, which notifies of different desired and reported
-     * Shadow states. */
-    callbackStatus = AwsIotShadow_SetDeltaCallback( mqttConnection,
-                                                    pThingName,
-                                                    thingNameLength,
-                                                    0,
-                                                    &deltaCallback );
-
-    // if( callbackStatus == AWS_IOT_SHADOW_SUCCESS )
-    // {
-    //     /* Set the updated callback, which notifies when a Shadow document is
-    //      * changed. */
-    //     callbackStatus = AwsIotShadow_SetUpdatedCallback( mqttConnection,
-    //                                                       pThingName,
-    //                                                       thingNameLength,
-    //                                                       0,
-    //                                                       &updatedCallback );
-    // }
+    updatedCallback.function = _shadowUpdatedCallback;
+
+    /* Set the delta callback of every thing, which notifies of different
+     * desired and reported Shadow states. */
+    for( size_t i = 0; i < BRIDGE_THING_COUNT; i++ )
+    {
+        Thing_t * pThing = &pBridge->things[ i ];
+
+        deltaCallback.pCallbackContext = pThing;
+        callbackStatus = AwsIotShadow_SetDeltaCallback( mqttConnection,
+                                                        pThing->pName,
+                                                        pThing->nameLength,
+                                                        0,
+                                                        &deltaCallback );
+        if( callbackStatus != AWS_IOT_SHADOW_SUCCESS )
+        {
+            break;
+        }
+
+        __atomic_store_n( &pThing->deltaSubscribed, true, __ATOMIC_RELEASE );
+    }
+
+    if( ( callbackStatus == AWS_IOT_SHADOW_SUCCESS ) && ( pBridge->sessionResumed == true ) )
+    {
+        IotLogInfo( "Delta topics subscribed again %llu ms after resuming the session.",
+                    IotClock_GetTimeMs() - pBridge->connectStartMs );
+    }
+
+    /* Set the updated callback of every thing, which notifies when a Shadow
+     * document is changed and keeps the shadow mirror current. Documents the
+     * broker queued for a resumed session are not taken over, the mirror gets
+     * the whole shadow after connecting anyway. */
+    for( size_t i = 0; ( i < BRIDGE_THING_COUNT ) && ( callbackStatus == AWS_IOT_SHADOW_SUCCESS ); i++ )
+    {
+        Thing_t * pThing = &pBridge->things[ i ];
+
+        updatedCallback.pCallbackContext = pThing;
+        callbackStatus = AwsIotShadow_SetUpdatedCallback( mqttConnection,
+                                                          pThing->pName,
+                                                          pThing->nameLength,
+                                                          0,
+                                                          &updatedCallback );
+    }
 
     if( callbackStatus != AWS_IOT_SHADOW_SUCCESS )
     {
         IotLogError( "Failed to set demo shadow callback, error %s.",
                      AwsIotShadow_strerror( callbackStatus ) );
 
+        _sessionCacheClear();
         status = EXIT_FAILURE;
     }
+    else if( BRIDGE_MQTT_PERSISTENT_SESSION == 1 )
+    {
+        _sessionCacheStore( pBridge->things[ 0 ].pName, pBridge->things[ 0 ].nameLength );
+    }
 
     return status;
 }
@@ -580,75 +925,92 @@ static bool _getSpecificValue(const char* receivedDocument,
  * write value to the uart port 
  * @param command  the value to be written into uart port
  *  */
-static void _write_command_into_uart(const char* command, size_t commandLength)
+static size_t _write_command_into_uart(uint8_t thing, const char* command, size_t commandLength)
 {
-    IotLogInfo(" command is :%.*s ",commandLength,command);
+    size_t written = 0, skipped = 0;
+    char prefix[sizeof("{\"thing\":99,")];
+    int prefixLength = 0;
 
-    char value[commandLength+1];
-    //clear buffer but left the last one 
-    memset(value,'\0',commandLength*sizeof(char));
+    if(commandLength > BRIDGE_UART_COMMAND_MAX)
+    {
+        IotLogError("command of %d bytes is longer than %d, dropped",(int)commandLength,BRIDGE_UART_COMMAND_MAX);
+        return 0;
+    }
 
-    strncpy(value,command,commandLength);
-    int result = 0;
+    _traceRecord(TRACE_UART_OUT, thing, command, commandLength);
 
-    //set the last bit of the buffer as '\n' to trigger the bg13
-    value[commandLength]='\n';
+    if(BRIDGE_MESH_SIMULATOR == 1)
+    {
+        _meshSimCommand(&_meshSimulator, thing, command, commandLength);
+        return commandLength + 1;
+    }
 
-    //write the data to uart
-    result = uart_write_bytes(UART_NUM_1, (const char*)value, sizeof(value));
+    //a command for another thing starts with its index instead of '{'
+    //only the mesh tx task writes, so the pieces of two commands never mix
+    if(thing > 0 && commandLength > 0 && command[0] == '{')
+    {
+        prefixLength = snprintf(prefix, sizeof(prefix), "{\"thing\":%u,", thing);
+        if(uart_write_bytes(UART_NUM_1, prefix, prefixLength) != prefixLength)
+        {
+            IotLogError("Write of a command of %u bytes failed", (uint32_t)commandLength);
+            return 0;
+        }
+        skipped = 1;
+        written = skipped;
+    }
 
-    if(result == -1)
+    //straight from the buffer of the caller into the uart tx buffer, in
+    //pieces so a long document does not wait for the whole tx buffer
+    while(written < commandLength)
     {
-        IotLogInfo("Write command %s failed",value);
+        size_t chunk = commandLength - written;
+        if(chunk > BRIDGE_UART_WRITE_CHUNK)
+        {
+            chunk = BRIDGE_UART_WRITE_CHUNK;
+        }
+
+        int result = uart_write_bytes(UART_NUM_1, command + written, chunk);
+        if(result < 0)
+        {
+            IotLogError("Write of a command of %u bytes failed", (uint32_t)commandLength);
+            return 0;
+        }
+        written += (size_t)result;
     }
-    else
+
+    //'\n' as the last byte triggers the bg13
+    if(uart_write_bytes(UART_NUM_1, "\n", 1) != 1)
     {
-        IotLogInfo("Write command to uart port successful! the data is :%.*s\n",commandLength,value);
+        IotLogError("Write of a command of %u bytes failed", (uint32_t)commandLength);
+        return 0;
     }
-        //clear buffer but left the last one 
-    memset(value,'\0',commandLength*sizeof(value[0]));
-    
-    return;
+
+    IotLogDebug("Wrote a command of %u bytes to the uart", (uint32_t)commandLength);
+    return written - skipped + (size_t)prefixLength + 1;
 }
 
 
 /*Get thing shadow from iot */
-static int _thingShadowOperation( IotSemaphore_t * pDeltaSemaphore,
-                                IotMqttConnection_t mqttConnection,
-                                const char * pThingName,
-                                size_t thingNameLength
-                            )
+static int _thingShadowOperation( BridgeContext_t * pBridge )
 {
     int status = EXIT_SUCCESS;
+    uint64_t lastReportMs = IotClock_GetTimeMs();
+
+    /* The uart and shadow work runs on the pipeline tasks, this task only
+     * supervises them. */
     /*using a while loop to continuously running the program */
-    while(1)
+    while(status == EXIT_SUCCESS)
     {
-        //check if local has command to send to update the shadow document
-        uint32_t length = uart_get_buffered_data_len(UART_NUM_1, (size_t*)&length);
-        ESP_ERROR_CHECK(uart_get_buffered_data_len(UART_NUM_1, (size_t*)&length));          
-        
-        if( IotSemaphore_TimedWait( pDeltaSemaphore,1000) == false )
-        {
-            IotLogInfo( "No changes at %06d s",( long unsigned ) ( IotClock_GetTimeMs()/1000) );
-            
-        }
+        vTaskDelay( pdMS_TO_TICKS( 1000 ) );
 
-        if(length!=0)
-        {  
-            status = reportLocalChange( length,
-                                        mqttConnection,
-                                        pThingName,
-                                        thingNameLength,
-                                        status);
-            if(status != EXIT_SUCCESS)
-            {
-                IotLogInfo("Report local change failed");
-                printf("Restarting now...\n");
-                esp_restart();
-                break;
-            }  
+        _traceDump(&_traceRecorder);
+
+        uint64_t nowMs = IotClock_GetTimeMs();
+        if(nowMs - lastReportMs >= BRIDGE_STATS_PERIOD_MS)
+        {
+            _reportStageUtilization(pBridge, (uint32_t)((nowMs - lastReportMs) * 1000));
+            lastReportMs = nowMs;
         }
-        
     }
     IotLogInfo("left getThingshadow function, the status now is %d",status);
     return status;
@@ -659,114 +1021,236 @@ static int _thingShadowOperation( IotSemaphore_t * pDeltaSemaphore,
  * report the local changes to cloud, if the button on the switch is pressed,
  * then update the shadow document on the cloud
  */
-static int reportLocalChange(   uint32_t length,
-                                IotMqttConnection_t mqttConnection,
-                                const char * pThingName,
-                                size_t thingNameLength,
-                                int status)
+static AwsIotShadowError_t reportLocalChange(   const FrameBatch_t *pBatch,
+                                                IotMqttConnection_t mqttConnection,
+                                                const Thing_t *pThing,
+                                                EncodeArena_t *pArena,
+                                                EchoFilter_t *pEchoFilter)
 {
-    /** check if there is message in the rx buffer. if there is, analysis the data and update thing shadow */
-
- 
-    uint8_t *data = (uint8_t *) malloc(length);
-    length = uart_read_bytes(UART_NUM_1, data, length, 100/portTICK_PERIOD_MS);
-    IotLogInfo("Read from rx buffer:%.*s, length is %d",length,data,length);
-
-    //analysis the operation type represented by the data received from uart
-    //extract information from the data packet sent from bg13
-
-    /*get the update operation type */
-    UpdateOperation_t operation = analysisOperation(data);
-    /*get the deviceType */
-    Device_t deviceType = analysisDeviceType(data);
-    /*get the attribute */
-    Attribute_t attributeType = analysisAttribute(data);
-
-    /**get device name from data*/
-    //TODO increase the packet length 
-    // char *deviceName = getDeviceNameFromPacket(data);
-    // IotLogInfo("device name is %s: ",deviceName);
+    char* pUpdateDocument = pArena->updateDocument;
 
-     /**get device attribute name from data*/
-    // char *attributeName = getAttributeNameFromPacket(data);
-    // IotLogInfo("attribute name is %s: ",deviceName);
-
-    /*get the attribute value from data */
-    char *attributeValue = _getAttributeValue(attributeType, data);
-    char* pUpdateDocument = NULL;
 
+    //generate the shadow document to send into the arena of the calling task
+    int length = generateBatchShadowDocument(pBatch, pThing->index, pUpdateDocument, sizeof(pArena->updateDocument));
 
-    //generate the shadow document to send plus 20 to avoid data overflow
-    pUpdateDocument = generateControlShadowDocument(operation, 
-                                                    deviceType,
-                                                    attributeType,
-                                                    attributeValue
-                                                    );
+    if(length == 0)
+    {
+        IotLogWarn("Nothing to report for %.*s", pThing->nameLength, pThing->pName);
+        return AWS_IOT_SHADOW_BAD_PARAMETER;
+    }
 
+    //the delta can come back before the update is accepted
+    _echoRecord(pEchoFilter, pThing->index, pUpdateDocument, length);
+    _traceRecord(TRACE_SHADOW_UPDATE, pThing->index, pUpdateDocument, length);
     
     AwsIotShadowError_t updateResult = AWS_IOT_SHADOW_STATUS_PENDING;
     updateResult = wrapUpdateThingShadow(   pUpdateDocument,
                                             mqttConnection,
-                                            pThingName,
-                                            thingNameLength );
+                                            pThing );
     
-    if( updateResult != AWS_IOT_SHADOW_SUCCESS )
+    if( updateResult == AWS_IOT_SHADOW_THROTTLED )
+    {
+        IotLogWarn( "thing shadow update of %.*s throttled, frames kept for the next update",
+                    pThing->nameLength, pThing->pName );
+    }
+    else if( updateResult != AWS_IOT_SHADOW_SUCCESS )
     {
         IotLogError( "thing shadow update error %s.", AwsIotShadow_strerror( updateResult ) );
-        status = EXIT_FAILURE;
     }
     else
     {
-        IotLogInfo( "Successfully sent Shadow update ");
-        esp_err_t success = uart_flush_input(UART_NUM_1);
-        if(success != ESP_OK)
-        {
-            IotLogWarn("UART clear failed");
-        }
-
+        IotLogInfo( "Successfully sent Shadow update of %.*s", pThing->nameLength, pThing->pName );
     }
-    free(data);
-    return status;
+    return updateResult;
 }
 
 /**
- * the length of each block should be showed as packet defined   
+ * a later value of the same device attribute replaces the earlier one, the
+ * earlier receive time is kept so the latency covers the whole wait. Once any
+ * of the merged frames is a local change the desired state is written as well.
+ * A frame without a shadow field is not batched, so every thing in the batch
+ * has something to publish when it takes a token.
  */
-static char* _getAttributeValue(Attribute_t attributeType, uint8_t *data)
+static bool _batchAdd(FrameBatch_t *pBatch, const BridgeFrame_t *pFrame)
 {
-    static char attributeValue[attributeValueLength] ={ '\0' };
-    memset(attributeValue,'\0',attributeValueLength*sizeof(char));
-    int length = 0;
-    
-    if(attributeType==ON_OFF)
+    if(_schemaIndex(pFrame->deviceType, pFrame->attributeType) < 0)
     {
-        //decide is "ON" or "OFF"
-        if(data[31] =='O' && data[32]=='N'  )
-            length = 2;
-        else
-            length = 3;
+        IotLogWarn("no shadow field for device %d attribute %d, not batched",pFrame->deviceType,pFrame->attributeType);
+        return false;
     }
-    if(attributeType == LOCK_UNLOCK)
+
+    for(uint32_t i = 0; i < pBatch->count; i++)
     {
-        if(data[31] == 'L' && data[32]=='O')
-        {
-            length = 4;
-        } 
-        else
+        BridgeFrame_t *pQueued = &pBatch->frames[i];
+
+        if(pQueued->thing == pFrame->thing &&
+           pQueued->deviceType == pFrame->deviceType && pQueued->attributeType == pFrame->attributeType)
         {
-            length = 6;
-        }
+            pQueued->value = pFrame->value;
+            if(pFrame->operation == LOCALLY_CHANGE_ENDPOINT_STATE)
+            {
+                pQueued->operation = LOCALLY_CHANGE_ENDPOINT_STATE;
+            }
+            return true;
+        }
+    }
+
+    if(pBatch->count == BRIDGE_BATCH_MAX)
+    {
+        return false;
+    }
+
+    pBatch->frames[pBatch->count++] = *pFrame;
+    return true;
+}
+
+static void _batchRemoveThing(FrameBatch_t *pBatch, uint8_t thing)
+{
+    uint32_t kept = 0;
+
+    for(uint32_t i = 0; i < pBatch->count; i++)
+    {
+        if(pBatch->frames[i].thing != thing)
+        {
+            pBatch->frames[kept++] = pBatch->frames[i];
+        }
+    }
+    pBatch->count = kept;
+}
+
+/**
+ * analysis the packet received from local, the packet layout is described by DataLength_t
+ */
+static bool _decodeFrame(uint8_t *data, size_t length, BridgeFrame_t *pFrame)
+{
+    if(length <= operationTypeLength + deviceNameLength + attributeNameLength)
+    {
+        IotLogWarn("packet of %d bytes is too short, dropped",(int)length);
+        return false;
+    }
+
+    //analysis the operation type represented by the data received from uart
+    //extract information from the data packet sent from bg13
+
+    /*get the update operation type */
+    pFrame->operation = analysisOperation(data);
+    /*get the thing the device belongs to */
+    pFrame->thing = _frameThing(data);
+    if(pFrame->thing >= BRIDGE_THING_COUNT)
+    {
+        IotLogWarn("packet of unknown thing %u, dropped",pFrame->thing);
+        return false;
+    }
+    /*get the deviceType */
+    pFrame->deviceType = analysisDeviceType(data);
+    /*get the attribute */
+    pFrame->attributeType = analysisAttribute(data);
+    /*get the attribute value from data */
+    if(_getAttributeValue(pFrame->deviceType, pFrame->attributeType, data, length, &pFrame->value) == false)
+    {
+        IotLogWarn("value of device %d attribute %d not accepted, dropped",pFrame->deviceType,pFrame->attributeType);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * the value is parsed straight from the frame into its binary form, enums by
+ * their choices and numbers digit by digit
+ */
+static bool _getAttributeValue(Device_t deviceType, Attribute_t attributeType, const uint8_t *data, size_t length, AttributeValue_t *pValue)
+{
+    //third block of the data packet, as much of it as was received
+    size_t offset = operationTypeLength + deviceNameLength + attributeNameLength;
+    const char *pField = (const char*)(data + offset);
+    size_t fieldLength = _blockTextLength(data + offset,
+                                          length - offset < attributeValueLength ? length - offset : attributeValueLength);
+    int index = _schemaIndex(deviceType, attributeType);
+
+    if(index < 0 || fieldLength == 0)
+    {
+        return false;
+    }
+
+    const SchemaAttribute_t *pSchema = &_schemaAttributes[index];
+    pValue->type = pSchema->valueType;
+
+    if(pSchema->valueType == VALUE_ENUM)
+    {
+        //exactly one of the accepted values
+        for(int i = 0; i < SCHEMA_CHOICES_MAX && pSchema->pChoices[i] != NULL; i++)
+        {
+            if(strlen(pSchema->pChoices[i]) == fieldLength &&
+               strncmp(pField, pSchema->pChoices[i], fieldLength) == 0)
+            {
+                pValue->value = i;
+                IotLogDebug("attribute value is %s", pSchema->pChoices[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //at most 9 digits, so the number always fits 32 bits
+    size_t position = 0, digits = 0;
+    bool negative = false, point = false;
+    uint8_t decimals = 0;
+    int32_t number = 0;
+
+    if(pField[0] == '-')
+    {
+        negative = true;
+        position++;
+    }
+    for(; position < fieldLength; position++)
+    {
+        char c = pField[position];
+
+        if(c == '.' && point == false && pSchema->decimals > 0)
+        {
+            point = true;
+        }
+        else if(c >= '0' && c <= '9' && digits < 9 && (point == false || decimals < pSchema->decimals))
+        {
+            number = number * 10 + (c - '0');
+            digits++;
+            decimals += point ? 1 : 0;
+        }
+        else
+        {
+            break;
+        }
     }
+    for(; decimals < pSchema->decimals; decimals++)
+    {
+        number *= 10;
+    }
+    if(negative)
+    {
+        number = -number;
+    }
+
+    //the whole value has to be a number
+    if(digits == 0 || position != fieldLength || number < pSchema->minimum || number > pSchema->maximum)
+    {
+        return false;
+    }
+    pValue->value = number;
+    IotLogDebug("attribute value is %.*s", (int)position, pField);
+
+    return true;
+}
 
-    //get third block of the data packet into attributeValue
-    strncpy(  attributeValue,(const char*)(data                        \
-                                +operationTypeLength                   \
-                                +deviceNameLength                      \
-                                +attributeNameLength),                 \
-                                length);
-    IotLogInfo("attribute value is %s", attributeValue);
+static size_t _blockTextLength(const uint8_t *pBlock, size_t blockLength)
+{
+    size_t length = 0;
 
-    return attributeValue;
+    while(length < blockLength && pBlock[length] != 'x' && pBlock[length] != '\0')
+    {
+        length++;
+    }
+    return length;
 }
 
 // static char* getDeviceNameFromPacket(uint8_t* data)
@@ -809,12 +1293,17 @@ static UpdateOperation_t analysisOperation(uint8_t* data)
     if(data[0]=='1')
     {
         type = CLOULD_CHANGE_ENDPOINT_STATE; 
-        IotLogInfo("the type is CLOULD_CHANGE_ENDPOINT_STATE");  
+        IotLogDebug("the type is CLOULD_CHANGE_ENDPOINT_STATE");  
     }
     if (data[0]=='2')
     {
         type = LOCALLY_CHANGE_ENDPOINT_STATE;
-        IotLogInfo("the type is LOCALLY_CHANGE_ENDPOINT_STATE");  
+        IotLogDebug("the type is LOCALLY_CHANGE_ENDPOINT_STATE");  
+    }
+    if (data[0]=='3')
+    {
+        type = QUERY_DESIRED_STATE;
+        IotLogDebug("the type is QUERY_DESIRED_STATE");  
     }
 
     return type;
@@ -828,38 +1317,73 @@ static UpdateOperation_t analysisOperation(uint8_t* data)
 /**Analysis device type that the data sent from esp32 has */
 static Device_t analysisDeviceType(uint8_t* data)
 {
-    char deviceType[deviceNameLength]={'\0'};
+    char deviceType[deviceNameLength + 1]={'\0'};
     Device_t type = UNKNOWN_TYPE;
     
-    //copy the first 10 characters
-    int i =1;
-    while(data[i]!='x')
+    //copy at most the 10 characters of the block, without the thing
+    size_t length = _blockTextLength(data + operationTypeLength, deviceNameLength);
+    memcpy(deviceType, data + operationTypeLength, length);
+    char *pThing = strchr(deviceType, ':');
+    if(pThing != NULL)
     {
-        deviceType[i-1]=data[i];
-        i++;
+        *pThing = '\0';
     }
 
-    if(strcmp((const char*)deviceType,"Lights")==0)
-        {
-            type = LIGHT;
-            IotLogInfo("the device type is LIGHT"); 
-        }
-    else if (strcmp((const char*)deviceType,"Switch")==0)
+    for(size_t n = 0; n < sizeof(_deviceNames) / sizeof(_deviceNames[0]); n++)
+    {
+        if(strcmp((const char*)deviceType,_deviceNames[n].pName)==0)
         {
-            type = SWITCH;
-            IotLogInfo("the device type is SWITCH");
+            type = _deviceNames[n].device;
+            break;
         }
-    else if (strcmp((const char*)deviceType,"Lock")==0)
+    }
+    IotLogDebug("the device type is %s (%d)",deviceType,type);
+
+    return type;
+}
+
+/**
+ * "Lights:2" in the device block is the light of thing 2, a device block
+ * without ':' belongs to thing 0. An index that is not a number is returned
+ * as 255 so the packet is dropped.
+ */
+static uint8_t _frameThing(const uint8_t *data)
+{
+    const char *pBlock = (const char *)(data + operationTypeLength);
+    size_t length = _blockTextLength(data + operationTypeLength, deviceNameLength);
+    size_t position = 0;
+    uint32_t thing = 0;
+
+    while(position < length && pBlock[position] != ':')
+    {
+        position++;
+    }
+    if(position == length)
+    {
+        return 0;
+    }
+    if(++position == length)
+    {
+        return UINT8_MAX;
+    }
+    for(; position < length; position++)
+    {
+        if(pBlock[position] < '0' || pBlock[position] > '9' || thing >= UINT8_MAX)
         {
-            type = LOCK;
-            IotLogInfo("the device type is LOCK");
-           
-        }
-    else{
-            type = UNKNOWN_TYPE;
+            return UINT8_MAX;
         }
+        thing = thing * 10 + (uint32_t)(pBlock[position] - '0');
+    }
+    return (thing < UINT8_MAX) ? (uint8_t)thing : UINT8_MAX;
+}
 
-    return type;
+static uint8_t _packetThing(const uint8_t *data, size_t length)
+{
+    if(length < operationTypeLength + deviceNameLength)
+    {
+        return 0;
+    }
+    return _frameThing(data);
 }
 /**
  * Analysis what attribute the endpoint want to update 
@@ -870,104 +1394,238 @@ static Device_t analysisDeviceType(uint8_t* data)
  */
 static Attribute_t analysisAttribute(uint8_t* data)
 {
-    char attribute[15] ={'\0'};
+    char attribute[attributeNameLength + 1] ={'\0'};
     Attribute_t att = UNKNOWN_ATT;
-    //
-    int i = operationTypeLength + deviceNameLength;
-    int j = 0;
-    while(data[i]!='x')
+    //copy at most the 20 characters of the block
+    size_t length = _blockTextLength(data + operationTypeLength + deviceNameLength, attributeNameLength);
+    memcpy(attribute, data + operationTypeLength + deviceNameLength, length);
+    IotLogDebug("the device attribute is %s",attribute); 
+    for(size_t n = 0; n < sizeof(_attributeNames) / sizeof(_attributeNames[0]); n++)
     {
-        attribute[j]=data[i];
-        i++;
-        j++;
+        if(strcmp((const char*)attribute,_attributeNames[n].pName)==0)
+        {
+            att = _attributeNames[n].attribute;
+            break;
+        }
     }
-    IotLogInfo("the device attribute is %s",attribute); 
-    if (strcmp((const char*)attribute,"ON_OFF")==0)
+
+    return att;
+}
+
+/**
+ * frames of several devices and attributes of a thing are merged into one
+ * document, which goes into desired as soon as one of them was a local change
+ */
+static int generateBatchShadowDocument( const FrameBatch_t *pBatch,
+                                        uint8_t thing,
+                                        char* pUpdateDocument,
+                                        size_t documentSize)
+{
+    const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { NULL };
+    bool desired = false, found = false;
+
+    for(uint32_t i = 0; i < pBatch->count; i++)
     {
-        att = ON_OFF;
-        IotLogInfo("the attribute type is ON_OFF");
+        const BridgeFrame_t *pFrame = &pBatch->frames[i];
+        if(pFrame->thing != thing)
+        {
+            continue;
+        }
+        int index = _schemaIndex(pFrame->deviceType, pFrame->attributeType);
+
+        if(index < 0)
+        {
+            IotLogWarn("no shadow document for device %d attribute %d",pFrame->deviceType,pFrame->attributeType);
+            continue;
+        }
+        values[index] = &pFrame->value;
+        desired = desired || pFrame->operation == LOCALLY_CHANGE_ENDPOINT_STATE;
+        found = true;
     }
-    else if (strcmp((const char*)attribute,"LOCK_UNLOCK")==0)
+
+    pUpdateDocument[0] = '\0';
+    if(found == false)
     {
-        /* code */
-        att = LOCK_UNLOCK;
-        IotLogInfo("the attribute type is LOCK_UNLOCK");
+        return 0;
     }
-    else if (strcmp((const char*)attribute,"POWER_LEVEL") == 0)
+
+    int length = _encodeShadowDocument(values, desired, pUpdateDocument, documentSize);
+
+    IotLogDebug("batch document generated is %.*s: ",length,pUpdateDocument);
+    return length;
+}
+
+static int _schemaIndex(Device_t deviceType, Attribute_t attributeType)
+{
+    for(int i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
     {
-        /* code */
-        att = POWER_LEVEL;
-        IotLogInfo("the attribute type is POWER_LEVEL");
+        if(_schemaAttributes[i].device == deviceType && _schemaAttributes[i].attribute == attributeType)
+        {
+            return i;
+        }
     }
-
-    return att;
+    return -1;
 }
 
 /**
- * generate shadow document if the data analysis result is a change state directive
- * everytime a specific attribute value changes but the rest are not, then the rest attributes
- * should be remain in their default value
+ * append a piece of text to a document, nothing is written once it is full
  */
-static char* generateControlShadowDocument( UpdateOperation_t operation,
-                                            Device_t deviceType, 
-                                            Attribute_t attributeType,
-                                            char *attributeValue
-                                        )
+static void _append(char *pBuffer, size_t bufferSize, size_t *pLength, const char *pText, size_t textLength)
 {
-    int length = 0;
+    if(*pLength + textLength >= bufferSize)
+    {
+        *pLength = bufferSize;
+        return;
+    }
+    memcpy(pBuffer + *pLength, pText, textLength);
+    *pLength += textLength;
+    pBuffer[*pLength] = '\0';
+}
 
-    static char pUpdateDocument[ SHADOW_REPORTED_JSON_SIZE + SHADOW_DESIRED_JSON_SIZE +20 ] = { 0 };
-    if(operation == LOCALLY_CHANGE_ENDPOINT_STATE){
-        if(deviceType == LIGHT && attributeType == ON_OFF)
-        {
-            length = sprintf(   pUpdateDocument,
-                                SHADOW_LIGHT_JSON,
-                                attributeValue,
-                                (int)D_Temperature,
-                                attributeValue,
-                                (int)D_Temperature,
-                                ( long unsigned ) ( IotClock_GetTimeMs() % 1000000 ) ); //the clienToken
+static void _appendKey(char *pBuffer, size_t bufferSize, size_t *pLength, bool first, const char *pKey)
+{
+    if(first == false)
+    {
+        _append(pBuffer, bufferSize, pLength, ",", 1);
+    }
+    _append(pBuffer, bufferSize, pLength, "\"", 1);
+    _append(pBuffer, bufferSize, pLength, pKey, strlen(pKey));
+    _append(pBuffer, bufferSize, pLength, "\":", 2);
+}
 
-            IotLogInfo("document generated is %.*s: ",length,pUpdateDocument);
-        }
-        if(deviceType == LIGHT && attributeType == TEMPERATURE)
-        {
-            length = sprintf(   pUpdateDocument,
-                                SHADOW_LIGHT_JSON,
-                                "ON",
-                                atoi(attributeValue),
-                                "ON",
-                                atoi(attributeValue),
-                                ( long unsigned ) ( IotClock_GetTimeMs() % 1000000 ) ); //the clienToken
+static size_t _formatNumber(int32_t value, uint8_t decimals, char *pText)
+{
+    char digits[BRIDGE_NUMBER_TEXT_MAX];
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    size_t count = 0, length = 0;
+
+    if(decimals > 9)
+    {
+        decimals = 9;
+    }
 
-            IotLogInfo("document generated is %.*s: ",length,pUpdateDocument);
-        }            
+    //digits from the lowest one, at least one in front of the point
+    do
+    {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while(magnitude != 0 || count <= decimals);
+
+    if(value < 0)
+    {
+        pText[length++] = '-';
     }
-    else if(operation == CLOULD_CHANGE_ENDPOINT_STATE){
-        if(deviceType == LIGHT && attributeType == ON_OFF)
+    while(count > 0)
+    {
+        if(count == decimals)
         {
-            length = sprintf(   pUpdateDocument,
-                                SHADOW_REPORTED_LIGHT_JSON,
-                                attributeValue,
-                                (int)D_Temperature,
-                                ( long unsigned ) ( IotClock_GetTimeMs() % 1000000 ) ); //the clienToken
+            pText[length++] = '.';
+        }
+        pText[length++] = digits[--count];
+    }
+    pText[length] = '\0';
+    return length;
+}
+
+/**
+ * {"Lights":{"ON_OFF":"ON","colorTemperatureInKelvin":3000},"Lock":{...}}
+ * only the attributes in values are written, a key left out of an update
+ * keeps its value in the shadow
+ */
+static void _encodeSection(const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                           char *pUpdateDocument, size_t documentSize, size_t *pLength)
+{
+    bool firstDevice = true;
+
+    _append(pUpdateDocument, documentSize, pLength, "{", 1);
+    for(int first = 0; first < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; )
+    {
+        int last = first;
+        bool updated = false;
 
-            IotLogInfo("document generated is %.*s: ",length,pUpdateDocument);
+        while(last < BRIDGE_SCHEMA_ATTRIBUTE_COUNT && _schemaAttributes[last].device == _schemaAttributes[first].device)
+        {
+            updated = updated || values[last] != NULL;
+            last++;
         }
-        if(deviceType == LIGHT && attributeType == TEMPERATURE)
+
+        if(updated)
         {
-            length = sprintf(   pUpdateDocument,
-                                SHADOW_REPORTED_LIGHT_JSON,
-                                "ON",
-                                atoi(attributeValue),
-                                ( long unsigned ) ( IotClock_GetTimeMs() % 1000000 ) ); //the clienToken
+            bool firstAttribute = true;
+
+            _appendKey(pUpdateDocument, documentSize, pLength, firstDevice, _schemaAttributes[first].pDevice);
+            _append(pUpdateDocument, documentSize, pLength, "{", 1);
+            for(int i = first; i < last; i++)
+            {
+                const SchemaAttribute_t *pSchema = &_schemaAttributes[i];
+
+                if(values[i] == NULL)
+                {
+                    continue;
+                }
+
+                if(pSchema->valueType == VALUE_NUMBER)
+                {
+                    char text[BRIDGE_NUMBER_TEXT_MAX];
+                    size_t textLength = _formatNumber(values[i]->value, pSchema->decimals, text);
+
+                    _appendKey(pUpdateDocument, documentSize, pLength, firstAttribute, pSchema->pAttribute);
+                    _append(pUpdateDocument, documentSize, pLength, text, textLength);
+                }
+                else
+                {
+                    const char *pChoice = pSchema->pChoices[values[i]->value];
 
-            IotLogInfo("document generated is %.*s: ",length,pUpdateDocument);
+                    _appendKey(pUpdateDocument, documentSize, pLength, firstAttribute, pSchema->pAttribute);
+                    _append(pUpdateDocument, documentSize, pLength, "\"", 1);
+                    _append(pUpdateDocument, documentSize, pLength, pChoice, strlen(pChoice));
+                    _append(pUpdateDocument, documentSize, pLength, "\"", 1);
+                }
+                firstAttribute = false;
+            }
+            _append(pUpdateDocument, documentSize, pLength, "}", 1);
+            firstDevice = false;
         }
+        first = last;
     }
+    _append(pUpdateDocument, documentSize, pLength, "}", 1);
+}
+
+static int _encodeShadowDocument(const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                 bool desired,
+                                 char *pUpdateDocument,
+                                 size_t documentSize)
+{
+    char token[BRIDGE_NUMBER_TEXT_MAX];
+    size_t length = 0;
 
-    return pUpdateDocument;
+    pUpdateDocument[0] = '\0';
+    _append(pUpdateDocument, documentSize, &length, "{\"state\":{", 10);
+    if(desired)
+    {
+        _appendKey(pUpdateDocument, documentSize, &length, true, "desired");
+        _encodeSection(values, pUpdateDocument, documentSize, &length);
+    }
+    _appendKey(pUpdateDocument, documentSize, &length, desired == false, "reported");
+    _encodeSection(values, pUpdateDocument, documentSize, &length);
+    _append(pUpdateDocument, documentSize, &length, "},", 2);
+
+    //the clienToken, a timestamp of six digits
+    size_t tokenLength = _formatNumber((int32_t)(IotClock_GetTimeMs() % 1000000), 0, token);
+    _appendKey(pUpdateDocument, documentSize, &length, true, "clientToken");
+    _append(pUpdateDocument, documentSize, &length, "\"000000", 7 - tokenLength);
+    _append(pUpdateDocument, documentSize, &length, token, tokenLength);
+    _append(pUpdateDocument, documentSize, &length, "\"}", 2);
+
+    if(length >= documentSize)
+    {
+        IotLogError("document does not fit into %d bytes",(int)documentSize);
+        pUpdateDocument[0] = '\0';
+        return 0;
+    }
+    return (int)length;
 }
+
 /**
  * generate shadow document if the data analysis result is a add device directive
  */
@@ -1010,18 +1668,23 @@ static char* generateControlShadowDocument( UpdateOperation_t operation,
 //update desired part thing shadow, only called when device has data coming 
 static AwsIotShadowError_t wrapUpdateThingShadow(   char *pUpdateDocument,
                                                 IotMqttConnection_t mqttConnection,
-                                                const char * const pThingName,
-                                                size_t thingNameLength )
+                                                const Thing_t *pThing )
 {
     AwsIotShadowError_t updateStatus = AWS_IOT_SHADOW_STATUS_PENDING;
     AwsIotShadowDocumentInfo_t updateDocument = AWS_IOT_SHADOW_DOCUMENT_INFO_INITIALIZER;
 
     /* Set the common members of the Shadow update document info. */
-    updateDocument.pThingName = pThingName;
-    updateDocument.thingNameLength = thingNameLength;
+    updateDocument.pThingName = pThing->pName;
+    updateDocument.thingNameLength = pThing->nameLength;
     updateDocument.u.update.pUpdateDocument = pUpdateDocument;
     updateDocument.u.update.updateDocumentLength = strlen( updateDocument.u.update.pUpdateDocument );
 
+    if( BRIDGE_SHADOW_EMULATOR == 1 )
+    {
+        return _shadowEmuUpdate( &_shadowEmulator, pThing->index, pUpdateDocument,
+                                 updateDocument.u.update.updateDocumentLength );
+    }
+
     /* Send the Shadow update. Because the Shadow is constantly updated in
     * this demo, the "Keep Subscriptions" flag is passed to this function.
     * Note that this flag only needs to be passed on the first call, but
@@ -1035,78 +1698,3096 @@ static AwsIotShadowError_t wrapUpdateThingShadow(   char *pUpdateDocument,
     return updateStatus;
 }
 
-
 /*-----------------------------------------------------------*/
 
-/**
- * @brief The function that runs the Shadow demo, called by the demo runner.
- *
- * @param[in] awsIotMqttMode Ignored for the Shadow demo.
- * @param[in] pIdentifier NULL-terminated Shadow Thing Name.
- * @param[in] pNetworkServerInfo Passed to the MQTT connect function when
- * establishing the MQTT connection for Shadows.
- * @param[in] pNetworkCredentialInfo Passed to the MQTT connect function when
- * establishing the MQTT connection for Shadows.
- * @param[in] pNetworkInterface The network interface to use for this demo.
- *
- * @return `EXIT_SUCCESS` if the demo completes successfully; `EXIT_FAILURE` otherwise.
- */
-int RunShadowDemo(bool awsIotMqttMode,
-                  const char *pIdentifier,
-                  void *pNetworkServerInfo,
-                  void *pNetworkCredentialInfo,
-                  const IotNetworkInterface_t *pNetworkInterface)
+static bool _findMember(const char *pObject, size_t objectLength, const char *pKey,
+                        const char **pValue, size_t *pValueLength)
 {
+    if(pObject == NULL)
+    {
+        return false;
+    }
+    return IotJsonUtils_FindJsonValue(pObject, objectLength, pKey, strlen(pKey), pValue, pValueLength);
+}
 
+static size_t _writeStateCommand(const SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                 char *pCommand, size_t commandSize)
+{
+    size_t length = snprintf(pCommand, commandSize, "{\"state\":{");
+    const char *pOpenDevice = NULL;
 
-    
-    /** initialize the uart  */
-    uart_init();
-    /* Return value of this function and the exit status of this program. */
-    int status = 0;
-
-    /* Handle of the MQTT connection used in this demo. */
-    IotMqttConnection_t mqttConnection = IOT_MQTT_CONNECTION_INITIALIZER;
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT && length < commandSize; i++)
+    {
+        if(values[i].pValue == NULL)
+        {
+            continue;
+        }
 
-    /* Length of Shadow Thing Name. */
-    size_t thingNameLength = 0;
+        if(pOpenDevice == NULL || strcmp(pOpenDevice, _schemaAttributes[i].pDevice) != 0)
+        {
+            length += snprintf(pCommand + length, commandSize - length, "%s\"%s\":{",
+                               (pOpenDevice == NULL) ? "" : "},", _schemaAttributes[i].pDevice);
+            pOpenDevice = _schemaAttributes[i].pDevice;
+        }
+        else
+        {
+            length += snprintf(pCommand + length, commandSize - length, ",");
+        }
+        if(length < commandSize)
+        {
+            length += snprintf(pCommand + length, commandSize - length, "\"%s\":%.*s",
+                               _schemaAttributes[i].pAttribute, (int)values[i].length, values[i].pValue);
+        }
+    }
+    if(length < commandSize)
+    {
+        length += snprintf(pCommand + length, commandSize - length, "%s}}", (pOpenDevice == NULL) ? "" : "}");
+    }
 
-    /* Allows the Shadow update function to wait for the delta callback to complete
-     * a state change before continuing. */
-    IotSemaphore_t deltaSemaphore;
+    return (length < commandSize) ? length : commandSize;
+}
 
-    /* Flags for tracking which cleanup functions must be called. */
-    bool librariesInitialized = false, connectionEstablished = false;
-    bool deltaSemaphoreCreated = false;
+/**
+ * The diff is written as a delta document so the mesh tx task forwards it
+ * the same way as the deltas that follow.
+ */
+static uint32_t _mirrorDiff(ShadowMirror_t *pMirror, uint8_t thing, MirroredShadow_t *pShadow,
+                            char *pCommand, size_t commandSize, size_t *pLength)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    uint32_t outOfSync = 0;
 
-    /* The first parameter of this demo function is not used. Shadows are specific
-     * to AWS IoT, so this value is hardcoded to true whenever needed. */
-    (void)awsIotMqttMode;
+    _mirrorSnapshot(pMirror, thing, pShadow);
 
-    /* Determine the length of the Thing Name. */
-    if (pIdentifier != NULL)
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
     {
-        thingNameLength = strlen(pIdentifier);
-
-        IotLogInfo("thingNameLength is %d, Identifier %s",thingNameLength,pIdentifier);
-
-        if (thingNameLength == 0)
+        if(pShadow->desiredLengths[i] == 0 ||
+           (pShadow->reportedLengths[i] == pShadow->desiredLengths[i] &&
+            memcmp(pShadow->reported[i], pShadow->desired[i], pShadow->desiredLengths[i]) == 0))
         {
-            IotLogError("The length of the Thing Name (identifier) must be nonzero.");
-
-            status = EXIT_FAILURE;
+            continue;
         }
-    }
-    else
-    {
-        IotLogError("A Thing Name (identifier) must be provided for the Shadow demo.");
 
-        status = EXIT_FAILURE;
+        values[i].pValue = pShadow->desired[i];
+        values[i].length = pShadow->desiredLengths[i];
+        outOfSync++;
     }
 
-    /* Initialize the libraries required for this demo. */
-    if (status == EXIT_SUCCESS)
-    {
+    *pLength = _writeStateCommand(values, pCommand, commandSize);
+    return outOfSync;
+}
+
+static int _bootSync(BridgeContext_t *pBridge, const Thing_t *pThing)
+{
+    MirroredShadow_t *pShadow = malloc(sizeof(MirroredShadow_t));
+    char *pCommand = malloc(BRIDGE_DELTA_SLOT_SIZE);
+    uint32_t startUs = (uint32_t) esp_timer_get_time();
+    size_t length = 0;
+
+    if(pShadow == NULL || pCommand == NULL)
+    {
+        free(pShadow);
+        free(pCommand);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t outOfSync = _mirrorDiff(&pBridge->shadowMirror, pThing->index, pShadow,
+                                     pCommand, BRIDGE_DELTA_SLOT_SIZE, &length);
+
+    int status = EXIT_SUCCESS;
+    if(pShadow->bootstrapped == false)
+    {
+        IotLogError("boot sync: the shadow of %.*s is not mirrored", pThing->nameLength, pThing->pName);
+        status = EXIT_FAILURE;
+    }
+    else if(length >= BRIDGE_DELTA_SLOT_SIZE)
+    {
+        IotLogError("boot sync: command does not fit into a delta slot");
+        status = EXIT_FAILURE;
+    }
+    else if(outOfSync > 0)
+    {
+        _postDelta(pBridge, pThing->index, pCommand, length);
+    }
+
+    IotLogInfo("boot sync: %u attributes of %.*s out of sync, took %u us", outOfSync,
+               pThing->nameLength, pThing->pName, (uint32_t) esp_timer_get_time() - startUs);
+    free(pShadow);
+    free(pCommand);
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool _mirrorInit(ShadowMirror_t *pMirror)
+{
+    pMirror->lock = xSemaphoreCreateMutex();
+    return pMirror->lock != NULL;
+}
+
+/**
+ * the only get of a shadow, the document is freed as soon as it is mirrored
+ */
+static int _mirrorBootstrap(BridgeContext_t *pBridge, const Thing_t *pThing)
+{
+    ShadowMirror_t *pMirror = &pBridge->shadowMirror;
+    MirroredShadow_t *pShadow = &pMirror->shadows[pThing->index];
+    AwsIotShadowDocumentInfo_t getInfo = AWS_IOT_SHADOW_DOCUMENT_INFO_INITIALIZER;
+    const char *pDocument = NULL, *pState = NULL, *pDesired = NULL, *pReported = NULL;
+    size_t documentLength = 0, stateLength = 0, desiredLength = 0, reportedLength = 0;
+    uint64_t startMs = IotClock_GetTimeMs();
+
+    getInfo.pThingName = pThing->pName;
+    getInfo.thingNameLength = pThing->nameLength;
+    getInfo.qos = IOT_MQTT_QOS_1;
+    getInfo.u.get.mallocDocument = malloc;
+
+    pMirror->gets++;
+    AwsIotShadowError_t getStatus = (BRIDGE_SHADOW_EMULATOR == 1) ?
+                                    _shadowEmuGet(&_shadowEmulator, pThing->index, &pDocument, &documentLength) :
+                                    AwsIotShadow_TimedGet(pBridge->mqttConnection, &getInfo,
+                                                          AWS_IOT_SHADOW_FLAG_KEEP_SUBSCRIPTIONS, TIMEOUT_MS,
+                                                          &pDocument, &documentLength);
+    if(getStatus == AWS_IOT_SHADOW_NOT_FOUND)
+    {
+        IotLogInfo("shadow mirror: no shadow of %.*s yet, starting empty", pThing->nameLength, pThing->pName);
+        xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+        pShadow->bootstrapped = true;
+        xSemaphoreGive(pMirror->lock);
+        return EXIT_SUCCESS;
+    }
+    if(getStatus != AWS_IOT_SHADOW_SUCCESS)
+    {
+        IotLogError("shadow mirror: shadow get failed, error %s", AwsIotShadow_strerror(getStatus));
+        return EXIT_FAILURE;
+    }
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength))
+    {
+        _findMember(pState, stateLength, "desired", &pDesired, &desiredLength);
+        _findMember(pState, stateLength, "reported", &pReported, &reportedLength);
+    }
+    uint32_t version = _documentVersion(pDocument, documentLength);
+    int status = EXIT_SUCCESS;
+
+    xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+    //a delta that came in while the get was on its way is newer
+    if(version >= pShadow->version)
+    {
+        memset(pShadow->desiredLengths, 0, sizeof(pShadow->desiredLengths));
+        memset(pShadow->reportedLengths, 0, sizeof(pShadow->reportedLengths));
+        if(_mergeSection(pShadow->desired, pShadow->desiredLengths, pDesired, desiredLength) == false ||
+           _mergeSection(pShadow->reported, pShadow->reportedLengths, pReported, reportedLength) == false)
+        {
+            status = EXIT_FAILURE;
+        }
+        pShadow->version = version;
+    }
+    pShadow->bootstrapped = (status == EXIT_SUCCESS);
+    xSemaphoreGive(pMirror->lock);
+
+    free((void *)pDocument);
+    IotLogInfo("shadow mirror: %.*s version %u, %u bytes got in %llu ms", pThing->nameLength, pThing->pName,
+               version, (uint32_t)documentLength, IotClock_GetTimeMs() - startMs);
+    return status;
+}
+
+static void _mirrorApplyDelta(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    MirroredShadow_t *pShadow = &pMirror->shadows[thing];
+    const char *pState = NULL;
+    size_t stateLength = 0;
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false)
+    {
+        return;
+    }
+    uint32_t version = _documentVersion(pDocument, documentLength);
+
+    xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+    if(version != 0 && version < pShadow->version)
+    {
+        pMirror->staleDeltas++;
+    }
+    else
+    {
+        _mergeSection(pShadow->desired, pShadow->desiredLengths, pState, stateLength);
+        pShadow->version = (version > pShadow->version) ? version : pShadow->version;
+        pMirror->deltasApplied++;
+    }
+    xSemaphoreGive(pMirror->lock);
+}
+
+/**
+ * the previous values are dropped, a key missing from the current state was
+ * removed from the shadow. A section with a value too long to mirror keeps the
+ * previous values.
+ */
+static void _mirrorApplyDocuments(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    MirroredShadow_t *pShadow = &pMirror->shadows[thing];
+    const char *pCurrent = NULL, *pState = NULL, *pDesired = NULL, *pReported = NULL;
+    size_t currentLength = 0, stateLength = 0, desiredLength = 0, reportedLength = 0;
+    uint8_t lengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+
+    if(_findMember(pDocument, documentLength, "current", &pCurrent, &currentLength) == false ||
+       _findMember(pCurrent, currentLength, "state", &pState, &stateLength) == false)
+    {
+        return;
+    }
+    _findMember(pState, stateLength, "desired", &pDesired, &desiredLength);
+    _findMember(pState, stateLength, "reported", &pReported, &reportedLength);
+    uint32_t version = _documentVersion(pCurrent, currentLength);
+
+    xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+    if(version < pShadow->version)
+    {
+        pMirror->staleDocuments++;
+    }
+    else
+    {
+        memcpy(lengths, pShadow->desiredLengths, sizeof(lengths));
+        memset(pShadow->desiredLengths, 0, sizeof(pShadow->desiredLengths));
+        if(_mergeSection(pShadow->desired, pShadow->desiredLengths, pDesired, desiredLength) == false)
+        {
+            memcpy(pShadow->desiredLengths, lengths, sizeof(lengths));
+        }
+
+        memcpy(lengths, pShadow->reportedLengths, sizeof(lengths));
+        memset(pShadow->reportedLengths, 0, sizeof(pShadow->reportedLengths));
+        if(_mergeSection(pShadow->reported, pShadow->reportedLengths, pReported, reportedLength) == false)
+        {
+            memcpy(pShadow->reportedLengths, lengths, sizeof(lengths));
+        }
+
+        pShadow->version = version;
+        pMirror->documentsApplied++;
+    }
+    xSemaphoreGive(pMirror->lock);
+}
+
+/**
+ * the service does not answer an update with its version, the version is
+ * left to the next delta or updated document
+ */
+static void _mirrorApplyUpdate(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    MirroredShadow_t *pShadow = &pMirror->shadows[thing];
+    const char *pState = NULL, *pSection = NULL;
+    size_t stateLength = 0, sectionLength = 0;
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false)
+    {
+        return;
+    }
+
+    xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+    if(_findMember(pState, stateLength, "desired", &pSection, &sectionLength))
+    {
+        _mergeSection(pShadow->desired, pShadow->desiredLengths, pSection, sectionLength);
+    }
+    if(_findMember(pState, stateLength, "reported", &pSection, &sectionLength))
+    {
+        _mergeSection(pShadow->reported, pShadow->reportedLengths, pSection, sectionLength);
+    }
+    pMirror->updatesApplied++;
+    xSemaphoreGive(pMirror->lock);
+}
+
+static void _mirrorSnapshot(ShadowMirror_t *pMirror, uint8_t thing, MirroredShadow_t *pShadow)
+{
+    uint32_t startUs = (uint32_t) esp_timer_get_time();
+
+    xSemaphoreTake(pMirror->lock, portMAX_DELAY);
+    *pShadow = pMirror->shadows[thing];
+
+    uint32_t lookupUs = (uint32_t) esp_timer_get_time() - startUs;
+    pMirror->lookups++;
+    pMirror->lookupUs += lookupUs;
+    if(lookupUs > pMirror->maxLookupUs)
+    {
+        pMirror->maxLookupUs = lookupUs;
+    }
+    xSemaphoreGive(pMirror->lock);
+}
+
+static uint32_t _documentVersion(const char *pDocument, size_t documentLength)
+{
+    const char *pVersion = NULL;
+    size_t versionLength = 0;
+    uint32_t version = 0;
+
+    if(_findMember(pDocument, documentLength, "version", &pVersion, &versionLength) == false)
+    {
+        return 0;
+    }
+    for(size_t i = 0; i < versionLength && pVersion[i] >= '0' && pVersion[i] <= '9'; i++)
+    {
+        version = version * 10 + (uint32_t)(pVersion[i] - '0');
+    }
+    return version;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * number of members of a json object, counting the ':' at its top level
+ */
+static size_t _countMembers(const char *pObject, size_t objectLength)
+{
+    size_t members = 0;
+    int depth = 0;
+    bool inString = false;
+
+    for(size_t i = 0; i < objectLength; i++)
+    {
+        char c = pObject[i];
+
+        if(inString)
+        {
+            if(c == '\\')
+            {
+                i++;
+            }
+            else if(c == '"')
+            {
+                inString = false;
+            }
+        }
+        else if(c == '"')
+        {
+            inString = true;
+        }
+        else if(c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if(c == '}' || c == ']')
+        {
+            depth--;
+        }
+        else if(c == ':' && depth == 1)
+        {
+            members++;
+        }
+    }
+    return members;
+}
+
+/**
+ * A delta is only collapsed when its state holds nothing but known
+ * attributes, anything else would be lost by rewriting it.
+ */
+static bool _parseStateAttributes(const char *pState, size_t stateLength,
+                                  SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT])
+{
+    size_t devices = 0, captured = 0;
+
+    for(size_t first = 0; first < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; )
+    {
+        const char *pDevice = NULL;
+        size_t deviceLength = 0, known = 0, last = first;
+
+        while(last < BRIDGE_SCHEMA_ATTRIBUTE_COUNT &&
+              strcmp(_schemaAttributes[last].pDevice, _schemaAttributes[first].pDevice) == 0)
+        {
+            last++;
+        }
+
+        if(_findMember(pState, stateLength, _schemaAttributes[first].pDevice, &pDevice, &deviceLength))
+        {
+            for(size_t i = first; i < last; i++)
+            {
+                if(_findMember(pDevice, deviceLength, _schemaAttributes[i].pAttribute,
+                               &values[i].pValue, &values[i].length))
+                {
+                    known++;
+                }
+            }
+            if(known != _countMembers(pDevice, deviceLength))
+            {
+                return false;
+            }
+            devices++;
+            captured += known;
+        }
+        first = last;
+    }
+
+    const char *pGroups = NULL;
+    size_t groupsLength = 0;
+    bool groups = _findMember(pState, stateLength, BRIDGE_GROUPS_KEY, &pGroups, &groupsLength);
+
+    if(groups)
+    {
+        if(_groupsValid(pGroups, groupsLength) == false)
+        {
+            return false;
+        }
+        devices++;
+    }
+
+    return (captured > 0 || groups) && devices == _countMembers(pState, stateLength);
+}
+
+/**
+ * A delta is only collapsed when its state holds nothing but known
+ * attributes, anything else would be lost by rewriting it.
+ */
+static bool _collapseDelta(DeltaCollapser_t *pCollapser, uint8_t thing, const char *pDocument, size_t documentLength,
+                           uint32_t receivedUs)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    const char *pState = NULL;
+    size_t stateLength = 0;
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false ||
+       _parseStateAttributes(pState, stateLength, values) == false)
+    {
+        return false;
+    }
+    uint32_t version = _documentVersion(pDocument, documentLength);
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(values[i].length >= BRIDGE_COMMAND_VALUE_SIZE)
+        {
+            return false;
+        }
+    }
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(values[i].pValue == NULL)
+        {
+            continue;
+        }
+        //the mesh must end up with the value of the latest version
+        if(version != 0 && version < pCollapser->versions[thing][i])
+        {
+            pCollapser->staleCount++;
+            continue;
+        }
+        if(version != 0)
+        {
+            pCollapser->versions[thing][i] = version;
+        }
+        if(pCollapser->pending[thing][i])
+        {
+            pCollapser->collapsedCount++;
+        }
+        else
+        {
+            pCollapser->receivedUs[thing][i] = receivedUs;
+            pCollapser->pending[thing][i] = true;
+        }
+        memcpy(pCollapser->values[thing][i], values[i].pValue, values[i].length);
+        pCollapser->valueLengths[thing][i] = (uint8_t)values[i].length;
+    }
+    return true;
+}
+
+static TickType_t _collapserWait(DeltaCollapser_t *pCollapser)
+{
+    bool pending = false;
+
+    for(size_t thing = 0; thing < BRIDGE_THING_COUNT; thing++)
+    {
+        for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+        {
+            pending |= pCollapser->pending[thing][i];
+        }
+    }
+    if(pending == false)
+    {
+        return portMAX_DELAY;
+    }
+    if(pCollapser->awaitingAck == false || __atomic_load_n(&pCollapser->acked, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    uint64_t elapsedMs = IotClock_GetTimeMs() - pCollapser->lastReleaseMs;
+    if(elapsedMs >= BRIDGE_MESH_RELEASE_MS)
+    {
+        return 0;
+    }
+    TickType_t ticks = pdMS_TO_TICKS(BRIDGE_MESH_RELEASE_MS - elapsedMs);
+    return (ticks > 0) ? ticks : 1;
+}
+
+/**
+ * every command written to the mesh waits for the ack of the mesh again
+ */
+static void _commandSent(BridgeContext_t *pBridge)
+{
+    DeltaCollapser_t *pCollapser = &pBridge->deltaCollapser;
+
+    __atomic_store_n(&pCollapser->acked, false, __ATOMIC_RELEASE);
+    pCollapser->awaitingAck = true;
+    pCollapser->lastReleaseMs = IotClock_GetTimeMs();
+
+    if(_bootMark(pBridge, BOOT_FIRST_COMMAND) == true)
+    {
+        IotLogInfo("First command forwarded %llu ms after connecting, session %s",
+                   IotClock_GetTimeMs() - pBridge->connectStartMs,
+                   pBridge->sessionResumed ? "resumed" : "subscribed");
+    }
+}
+
+/**
+ * the things share the mesh, so the commands of all of them go out together
+ * and wait for one ack
+ */
+static void _collapserRelease(BridgeContext_t *pBridge)
+{
+    DeltaCollapser_t *pCollapser = &pBridge->deltaCollapser;
+    char command[BRIDGE_SCHEMA_ATTRIBUTE_COUNT * (BRIDGE_COMMAND_VALUE_SIZE + 64) + 16];
+
+    for(uint8_t thing = 0; thing < BRIDGE_THING_COUNT; thing++)
+    {
+        SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+        bool pending = false;
+
+        for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+        {
+            if(pCollapser->pending[thing][i])
+            {
+                values[i].pValue = pCollapser->values[thing][i];
+                values[i].length = pCollapser->valueLengths[thing][i];
+                pending = true;
+            }
+        }
+        if(pending == false)
+        {
+            continue;
+        }
+
+        size_t length = _writeStateCommand(values, command, sizeof(command));
+        pCollapser->uartBytes += _forwardDelta(thing, command, length);
+
+        for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+        {
+            if(pCollapser->pending[thing][i])
+            {
+                _latencyRecord(&pBridge->downlinkLatency[_schemaAttributes[i].trafficClass],
+                               pCollapser->receivedUs[thing][i]);
+                pCollapser->pending[thing][i] = false;
+            }
+        }
+        pCollapser->releasedCount++;
+    }
+    _commandSent(pBridge);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool _groupsValid(const char *pGroups, size_t groupsLength)
+{
+    size_t found = 0;
+
+    for(size_t i = 0; i < sizeof(_meshGroups) / sizeof(_meshGroups[0]); i++)
+    {
+        const char *pGroup = NULL;
+        size_t groupLength = 0;
+
+        if(_findMember(pGroups, groupsLength, _meshGroups[i].pKey, &pGroup, &groupLength))
+        {
+            //{"group":65279, is added in front of the members
+            if(pGroup[0] != '{' || _countMembers(pGroup, groupLength) == 0 ||
+               groupLength + 16 > BRIDGE_GROUP_COMMAND_SIZE)
+            {
+                return false;
+            }
+            found++;
+        }
+    }
+    return found > 0 && found == _countMembers(pGroups, groupsLength);
+}
+
+/**
+ * the provisioner sends a multicast to the group address, so a scene costs
+ * one frame on the uart and one message in the mesh however many nodes
+ * it switches
+ */
+static size_t _fanOutGroups(BridgeContext_t *pBridge, uint8_t thing, const char *pDocument, size_t documentLength,
+                            uint32_t receivedUs)
+{
+    const Thing_t *pThing = &pBridge->things[thing];
+    const char *pState = NULL, *pGroups = NULL;
+    size_t stateLength = 0, groupsLength = 0, written = 0;
+    char command[BRIDGE_GROUP_COMMAND_SIZE];
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false ||
+       _findMember(pState, stateLength, BRIDGE_GROUPS_KEY, &pGroups, &groupsLength) == false)
+    {
+        return 0;
+    }
+
+    for(size_t i = 0; i < sizeof(_meshGroups) / sizeof(_meshGroups[0]); i++)
+    {
+        const char *pGroup = NULL;
+        size_t groupLength = 0;
+
+        if(_findMember(pGroups, groupsLength, _meshGroups[i].pKey, &pGroup, &groupLength) == false)
+        {
+            continue;
+        }
+
+        int length = snprintf(command, sizeof(command), "{\"group\":%u,%.*s",
+                              _meshGroups[i].address, (int)groupLength - 1, pGroup + 1);
+        if(length > 0 && (size_t)length < sizeof(command))
+        {
+            IotLogInfo("Multicast to group %s: %.*s", _meshGroups[i].pKey, length, command);
+            //group addresses are mesh wide, whichever thing the groups came from
+            written += _write_command_into_uart(0, command, (size_t)length);
+            pBridge->deltaCollapser.groupFrames++;
+        }
+    }
+
+    if(written > 0)
+    {
+        AwsIotShadowDocumentInfo_t clearInfo = AWS_IOT_SHADOW_DOCUMENT_INFO_INITIALIZER;
+
+        _latencyRecord(&pBridge->groupLatency, receivedUs);
+        _commandSent(pBridge);
+
+        //not waited for, the mesh tx task must not block on mqtt
+        clearInfo.pThingName = pThing->pName;
+        clearInfo.thingNameLength = pThing->nameLength;
+        clearInfo.u.update.pUpdateDocument = BRIDGE_GROUPS_CLEAR_DOCUMENT;
+        clearInfo.u.update.updateDocumentLength = sizeof(BRIDGE_GROUPS_CLEAR_DOCUMENT) - 1;
+        if(BRIDGE_SHADOW_EMULATOR == 1)
+        {
+            _shadowEmuUpdate(&_shadowEmulator, thing, clearInfo.u.update.pUpdateDocument,
+                             clearInfo.u.update.updateDocumentLength);
+        }
+        else if(AwsIotShadow_Update(pBridge->mqttConnection, &clearInfo, 0, NULL, NULL) != AWS_IOT_SHADOW_STATUS_PENDING)
+        {
+            IotLogWarn("Failed to remove the groups from the desired state");
+        }
+    }
+    return written;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * a delta only lists desired values that differ from the reported ones, and
+ * the bridge writes both, so only the desired values of the update are kept.
+ * An update without a desired state cannot cause a delta and is not recorded.
+ */
+static void _echoRecord(EchoFilter_t *pFilter, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    const char *pToken = NULL, *pState = NULL, *pSection = NULL;
+    size_t tokenLength = 0, stateLength = 0, sectionLength = 0;
+
+    if(_findMember(pDocument, documentLength, "clientToken", &pToken, &tokenLength) == false ||
+       tokenLength > sizeof(pFilter->entries[0].token) ||
+       _findMember(pDocument, documentLength, "state", &pState, &stateLength) == false ||
+       _findMember(pState, stateLength, "desired", &pSection, &sectionLength) == false)
+    {
+        return;
+    }
+    _parseStateAttributes(pSection, sectionLength, values);
+
+    EchoEntry_t *pEntry = &pFilter->entries[pFilter->next % BRIDGE_ECHO_ENTRIES];
+    pFilter->next++;
+
+    __atomic_fetch_add(&pEntry->version, 1, __ATOMIC_ACQ_REL);
+    memcpy(pEntry->token, pToken, tokenLength);
+    pEntry->tokenLength = (uint8_t)tokenLength;
+    pEntry->thing = thing;
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        //a value too long to keep never matches
+        pEntry->valueLengths[i] = 0;
+        if(values[i].pValue != NULL && values[i].length <= sizeof(pEntry->values[i]))
+        {
+            memcpy(pEntry->values[i], values[i].pValue, values[i].length);
+            pEntry->valueLengths[i] = (uint8_t)values[i].length;
+        }
+    }
+    pEntry->publishedMs = (uint32_t)IotClock_GetTimeMs();
+    __atomic_fetch_add(&pEntry->version, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * true if every attribute of the delta holds the value the entry wrote
+ */
+static bool _echoValuesMatch(const EchoEntry_t *pEntry, const SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT])
+{
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(values[i].pValue != NULL &&
+           (pEntry->valueLengths[i] != values[i].length ||
+            memcmp(pEntry->values[i], values[i].pValue, values[i].length) != 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool _echoMatch(EchoFilter_t *pFilter, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    const char *pToken = NULL, *pState = NULL;
+    size_t tokenLength = 0, stateLength = 0;
+
+    if(_findMember(pDocument, documentLength, "clientToken", &pToken, &tokenLength) == false ||
+       _findMember(pDocument, documentLength, "state", &pState, &stateLength) == false ||
+       _parseStateAttributes(pState, stateLength, values) == false)
+    {
+        return false;
+    }
+
+    //the bridge never writes groups, they always come from someone else
+    const char *pGroups = NULL;
+    size_t groupsLength = 0;
+    if(_findMember(pState, stateLength, BRIDGE_GROUPS_KEY, &pGroups, &groupsLength))
+    {
+        return false;
+    }
+
+    uint32_t nowMs = (uint32_t)IotClock_GetTimeMs();
+
+    for(size_t i = 0; i < BRIDGE_ECHO_ENTRIES; i++)
+    {
+        EchoEntry_t *pEntry = &pFilter->entries[i];
+        uint32_t version = __atomic_load_n(&pEntry->version, __ATOMIC_ACQUIRE);
+
+        bool match = (version & 1) == 0 && version != 0 &&
+                     nowMs - pEntry->publishedMs <= BRIDGE_ECHO_WINDOW_MS &&
+                     pEntry->thing == thing &&
+                     pEntry->tokenLength == tokenLength &&
+                     memcmp(pEntry->token, pToken, tokenLength) == 0 &&
+                     _echoValuesMatch(pEntry, values);
+
+        //the entry was rewritten while it was compared
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(match && __atomic_load_n(&pEntry->version, __ATOMIC_ACQUIRE) == version)
+        {
+            pFilter->suppressedCount++;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*-----------------------------------------------------------*/
+
+static bool _traceInit(TraceRecorder_t *pRecorder)
+{
+    if(BRIDGE_TRACE_MODE != BRIDGE_TRACE_RECORD || pRecorder->lock != NULL)
+    {
+        return true;
+    }
+
+    pRecorder->pBuffers[0] = (uint8_t *) malloc(BRIDGE_TRACE_BUFFER_SIZE);
+    pRecorder->pBuffers[1] = (uint8_t *) malloc(BRIDGE_TRACE_BUFFER_SIZE);
+    SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+
+    if(pRecorder->pBuffers[0] == NULL || pRecorder->pBuffers[1] == NULL || lock == NULL)
+    {
+        free(pRecorder->pBuffers[0]);
+        free(pRecorder->pBuffers[1]);
+        pRecorder->pBuffers[0] = pRecorder->pBuffers[1] = NULL;
+        if(lock != NULL)
+        {
+            vSemaphoreDelete(lock);
+        }
+        return false;
+    }
+
+    memcpy(pRecorder->pBuffers[0], BRIDGE_TRACE_MAGIC, 4);
+    pRecorder->lengths[0] = 4;
+    pRecorder->lastUs = (uint32_t) esp_timer_get_time();
+    //the lock is set last, the recorder is used once it is there
+    __atomic_store_n(&pRecorder->lock, lock, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * The copy is done under a mutex, records come from the uart tasks, the
+ * publisher and the mqtt callbacks.
+ */
+static void _traceRecord(TraceKind_t kind, uint8_t thing, const void *pData, size_t length)
+{
+    TraceRecorder_t *pRecorder = &_traceRecorder;
+    SemaphoreHandle_t lock = __atomic_load_n(&pRecorder->lock, __ATOMIC_ACQUIRE);
+
+    if(BRIDGE_TRACE_MODE != BRIDGE_TRACE_RECORD || lock == NULL)
+    {
+        return;
+    }
+    if(length > UINT16_MAX || length + BRIDGE_TRACE_RECORD_HEADER > BRIDGE_TRACE_BUFFER_SIZE)
+    {
+        pRecorder->dropped++;
+        return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    size_t *pLength = &pRecorder->lengths[pRecorder->recording];
+    if(*pLength + BRIDGE_TRACE_RECORD_HEADER + length > BRIDGE_TRACE_BUFFER_SIZE)
+    {
+        if(pRecorder->dumpPending)
+        {
+            pRecorder->dropped++;
+            xSemaphoreGive(lock);
+            return;
+        }
+        pRecorder->recording ^= 1;
+        pRecorder->dumpPending = true;
+        pLength = &pRecorder->lengths[pRecorder->recording];
+    }
+
+    uint8_t *pRecord = pRecorder->pBuffers[pRecorder->recording] + *pLength;
+    uint32_t nowUs = (uint32_t) esp_timer_get_time();
+    uint32_t deltaUs = nowUs - pRecorder->lastUs;
+
+    pRecord[0] = (uint8_t) kind;
+    pRecord[1] = thing;
+    pRecord[2] = (uint8_t) length;
+    pRecord[3] = (uint8_t) (length >> 8);
+    for(int i = 0; i < 4; i++)
+    {
+        pRecord[4 + i] = (uint8_t) (deltaUs >> (8 * i));
+    }
+    memcpy(pRecord + BRIDGE_TRACE_RECORD_HEADER, pData, length);
+
+    *pLength += BRIDGE_TRACE_RECORD_HEADER + length;
+    pRecorder->lastUs = nowUs;
+    pRecorder->records++;
+
+    xSemaphoreGive(lock);
+}
+
+static void _traceDump(TraceRecorder_t *pRecorder)
+{
+    if(pRecorder->lock == NULL || pRecorder->dumpPending == false)
+    {
+        return;
+    }
+
+    //the full buffer is not touched by the recorder until dumpPending is cleared
+    xSemaphoreTake(pRecorder->lock, portMAX_DELAY);
+    uint32_t full = pRecorder->recording ^ 1;
+    xSemaphoreGive(pRecorder->lock);
+
+    const uint8_t *pBuffer = pRecorder->pBuffers[full];
+    size_t length = pRecorder->lengths[full];
+    char line[2 * 32 + 1];
+
+    IotLogInfo("trace: %u bytes from offset %u, %u records, %u dropped",
+               (uint32_t)length, pRecorder->dumpedBytes, pRecorder->records, pRecorder->dropped);
+    for(size_t offset = 0; offset < length; offset += 32)
+    {
+        size_t count = (length - offset < 32) ? length - offset : 32;
+
+        for(size_t i = 0; i < count; i++)
+        {
+            line[2 * i] = "0123456789abcdef"[pBuffer[offset + i] >> 4];
+            line[2 * i + 1] = "0123456789abcdef"[pBuffer[offset + i] & 0x0f];
+        }
+        line[2 * count] = '\0';
+        IotLogInfo("trace %06u: %s", pRecorder->dumpedBytes + (uint32_t)offset, line);
+    }
+
+    xSemaphoreTake(pRecorder->lock, portMAX_DELAY);
+    pRecorder->dumpedBytes += (uint32_t)length;
+    pRecorder->lengths[full] = 0;
+    pRecorder->dumpPending = false;
+    xSemaphoreGive(pRecorder->lock);
+}
+
+/**
+ * Recorded commands and updates are what the bridge wrote, they are skipped;
+ * the bridge writes them again from the replayed input. Packets and deltas
+ * of things this bridge does not have are skipped too.
+ */
+static void _traceReplayTask(void *pArgument)
+{
+#if ( BRIDGE_TRACE_MODE == BRIDGE_TRACE_REPLAY )
+    BridgeContext_t *pBridge = pArgument;
+    const uint8_t *pRecord = _traceStart + 4;
+    uint32_t replayed = 0, skipped = 0;
+
+    //one spare byte so the packet is always followed by a '\0'
+    uint8_t *data = (uint8_t *) malloc(BUF_SIZE + 1);
+    if(data == NULL || _traceEnd - _traceStart < 4 || memcmp(_traceStart, BRIDGE_TRACE_MAGIC, 4) != 0)
+    {
+        IotLogError("No trace to replay");
+        free(data);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    uint64_t startMs = IotClock_GetTimeMs();
+    while(_traceEnd - pRecord >= BRIDGE_TRACE_RECORD_HEADER)
+    {
+        TraceKind_t kind = (TraceKind_t) pRecord[0];
+        uint8_t thing = pRecord[1];
+        size_t length = pRecord[2] | ((size_t)pRecord[3] << 8);
+        uint32_t deltaUs = pRecord[4] | ((uint32_t)pRecord[5] << 8) | ((uint32_t)pRecord[6] << 16) | ((uint32_t)pRecord[7] << 24);
+        const uint8_t *pPayload = pRecord + BRIDGE_TRACE_RECORD_HEADER;
+
+        if((size_t)(_traceEnd - pPayload) < length)
+        {
+            IotLogError("trace is cut in a record of %u bytes", (uint32_t)length);
+            break;
+        }
+        pRecord = pPayload + length;
+
+        if(BRIDGE_TRACE_REPLAY_SPEED > 0 && deltaUs / 1000 / BRIDGE_TRACE_REPLAY_SPEED > 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(deltaUs / 1000 / BRIDGE_TRACE_REPLAY_SPEED));
+        }
+
+        if(kind != TRACE_UART_IN && kind != TRACE_SHADOW_DELTA)
+        {
+            continue;
+        }
+        if(thing >= BRIDGE_THING_COUNT)
+        {
+            skipped++;
+            continue;
+        }
+
+        //the packet names its thing as well, the mesh is shared by all things
+        if(kind == TRACE_UART_IN && length <= BUF_SIZE)
+        {
+            memcpy(data, pPayload, length);
+            data[length] = '\0';
+            _ingestPacket(pBridge, data, length, (uint32_t) esp_timer_get_time());
+            replayed++;
+        }
+        else if(kind == TRACE_SHADOW_DELTA)
+        {
+            _postDelta(pBridge, thing, (const char *) pPayload, length);
+            replayed++;
+        }
+    }
+
+    IotLogInfo("trace replayed: %u packets and deltas in %llu ms, %u of other things skipped",
+               replayed, IotClock_GetTimeMs() - startMs, skipped);
+    free(data);
+#else
+    (void) pArgument;
+#endif
+    vTaskDelete(NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+static bool _meshSimFrame(uint8_t *pFrame, UpdateOperation_t operation, uint8_t thing, int schemaIndex,
+                          const char *pValue, size_t valueLength)
+{
+    const char *pDevice = NULL, *pAttribute = NULL;
+    char device[deviceNameLength + 1];
+    int length = 0;
+
+    for(size_t n = 0; n < sizeof(_deviceNames) / sizeof(_deviceNames[0]); n++)
+    {
+        if(_deviceNames[n].device == _schemaAttributes[schemaIndex].device)
+        {
+            pDevice = _deviceNames[n].pName;
+        }
+    }
+    for(size_t n = 0; n < sizeof(_attributeNames) / sizeof(_attributeNames[0]); n++)
+    {
+        if(_attributeNames[n].attribute == _schemaAttributes[schemaIndex].attribute)
+        {
+            pAttribute = _attributeNames[n].pName;
+        }
+    }
+    if(pDevice == NULL || pAttribute == NULL || valueLength > attributeValueLength)
+    {
+        return false;
+    }
+    length = (thing > 0) ? snprintf(device, sizeof(device), "%s:%u", pDevice, thing) :
+                           snprintf(device, sizeof(device), "%s", pDevice);
+    if(length < 0 || (size_t)length >= sizeof(device))
+    {
+        return false;
+    }
+
+    //'x' ends every block that is not full
+    memset(pFrame, 'x', BRIDGE_MESH_SIM_FRAME_SIZE);
+    pFrame[BRIDGE_MESH_SIM_FRAME_SIZE] = '\0';
+    pFrame[0] = (operation == CLOULD_CHANGE_ENDPOINT_STATE) ? '1' : '2';
+    memcpy(pFrame + operationTypeLength, device, (size_t)length);
+    memcpy(pFrame + operationTypeLength + deviceNameLength, pAttribute, strlen(pAttribute));
+    memcpy(pFrame + operationTypeLength + deviceNameLength + attributeNameLength, pValue, valueLength);
+    return true;
+}
+
+/**
+ * the mesh acks a command by reporting the first attribute it applied
+ */
+static void _meshSimCommand(MeshSimulator_t *pSimulator, uint8_t thing, const char *pCommand, size_t commandLength)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    bool prepared = false;
+
+    pSimulator->commandsReceived++;
+    if(__atomic_load_n(&pSimulator->ackPending, __ATOMIC_ACQUIRE) == 0)
+    {
+        _parseStateAttributes(pCommand, commandLength, values);
+    }
+
+    for(int i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT && prepared == false; i++)
+    {
+        const char *pValue = values[i].pValue;
+        size_t valueLength = values[i].length;
+
+        if(pValue == NULL)
+        {
+            continue;
+        }
+        if(valueLength >= 2 && pValue[0] == '"')
+        {
+            pValue++;
+            valueLength -= 2;
+        }
+        prepared = _meshSimFrame(pSimulator->ackFrame, CLOULD_CHANGE_ENDPOINT_STATE, thing, i, pValue, valueLength);
+    }
+
+    if(prepared == false)
+    {
+        pSimulator->commandsNotAcked++;
+        return;
+    }
+    pSimulator->commandUs = (uint32_t) esp_timer_get_time();
+    __atomic_store_n(&pSimulator->ackPending, 1, __ATOMIC_RELEASE);
+    if(pSimulator->task != NULL)
+    {
+        xTaskNotifyGive(pSimulator->task);
+    }
+}
+
+/**
+ * a report of a node, a random value of the attribute the node stands for.
+ * The nodes are spread over the things.
+ */
+static void _meshSimReport(BridgeContext_t *pBridge, MeshSimulator_t *pSimulator, uint32_t node)
+{
+    uint8_t frame[BRIDGE_MESH_SIM_FRAME_SIZE + 1];
+    uint8_t thing = (uint8_t)(node % BRIDGE_THING_COUNT);
+    int index = (int)((node / BRIDGE_THING_COUNT) % BRIDGE_SCHEMA_ATTRIBUTE_COUNT);
+    const SchemaAttribute_t *pSchema = &_schemaAttributes[index];
+    char text[BRIDGE_NUMBER_TEXT_MAX];
+    const char *pValue = text;
+    size_t valueLength = 0;
+
+    if(pSchema->valueType == VALUE_NUMBER)
+    {
+        int32_t value = pSchema->minimum + (int32_t)(esp_random() % (uint32_t)(pSchema->maximum - pSchema->minimum + 1));
+        valueLength = _formatNumber(value, pSchema->decimals, text);
+    }
+    else
+    {
+        int choices = 0;
+        while(choices < SCHEMA_CHOICES_MAX && pSchema->pChoices[choices] != NULL)
+        {
+            choices++;
+        }
+        pValue = pSchema->pChoices[esp_random() % choices];
+        valueLength = strlen(pValue);
+    }
+
+    if(_meshSimFrame(frame, LOCALLY_CHANGE_ENDPOINT_STATE, thing, index, pValue, valueLength))
+    {
+        _ingestPacket(pBridge, frame, BRIDGE_MESH_SIM_FRAME_SIZE, (uint32_t) esp_timer_get_time());
+        pSimulator->framesSent++;
+    }
+}
+
+/**
+ * sends the frames of one event of the pattern
+ * return microseconds until the next event
+ */
+static uint32_t _meshSimEvent(BridgeContext_t *pBridge, MeshSimulator_t *pSimulator)
+{
+    uint8_t frame[BRIDGE_MESH_SIM_FRAME_SIZE + 1];
+    char text[BRIDGE_NUMBER_TEXT_MAX];
+
+    switch(BRIDGE_MESH_SIM_PATTERN)
+    {
+        case MESH_SIM_BURST:
+            for(uint32_t node = 0; node < BRIDGE_MESH_SIM_NODES; node++)
+            {
+                _meshSimReport(pBridge, pSimulator, node);
+            }
+            return BRIDGE_MESH_SIM_BURST_PERIOD_MS * 1000;
+
+        case MESH_SIM_SCENE:
+            pSimulator->sliderStep ^= 1;
+            for(uint32_t node = 0; node < BRIDGE_MESH_SIM_NODES; node++)
+            {
+                const char *pValue = pSimulator->sliderStep ? "ON" : "OFF";
+
+                if(_meshSimFrame(frame, LOCALLY_CHANGE_ENDPOINT_STATE, (uint8_t)(node % BRIDGE_THING_COUNT),
+                                 SCHEMA_LIGHT_ON_OFF, pValue, strlen(pValue)))
+                {
+                    _ingestPacket(pBridge, frame, BRIDGE_MESH_SIM_FRAME_SIZE, (uint32_t) esp_timer_get_time());
+                    pSimulator->framesSent++;
+                }
+            }
+            return BRIDGE_MESH_SIM_BURST_PERIOD_MS * 1000;
+
+        case MESH_SIM_SLIDER:
+        {
+            //0 to 100 and back in steps of 5
+            uint32_t step = pSimulator->sliderStep++ % 40;
+            size_t length = _formatNumber((int32_t)((step <= 20 ? step : 40 - step) * 5), 0, text);
+
+            if(_meshSimFrame(frame, LOCALLY_CHANGE_ENDPOINT_STATE, 0, SCHEMA_LIGHT_POWER_LEVEL, text, length))
+            {
+                _ingestPacket(pBridge, frame, BRIDGE_MESH_SIM_FRAME_SIZE, (uint32_t) esp_timer_get_time());
+                pSimulator->framesSent++;
+            }
+            return BRIDGE_MESH_SIM_SLIDER_STEP_MS * 1000;
+        }
+
+        case MESH_SIM_POISSON:
+        default:
+        {
+            _meshSimReport(pBridge, pSimulator, esp_random() % BRIDGE_MESH_SIM_NODES);
+
+            //exponential gaps, the mean gap of the whole mesh is the node interval over the nodes
+            float uniform = ((esp_random() >> 8) + 1) / 16777217.0f;
+            return (uint32_t)(-logf(uniform) * (BRIDGE_MESH_SIM_NODE_INTERVAL_MS * 1000.0f / BRIDGE_MESH_SIM_NODES));
+        }
+    }
+}
+
+/**
+ * The simulator is the only producer of the frame lanes, acks and reports of
+ * the virtual nodes are written from this task.
+ */
+static void _meshSimulatorTask(void *pArgument)
+{
+    BridgeContext_t *pBridge = pArgument;
+    MeshSimulator_t *pSimulator = &_meshSimulator;
+    uint32_t nextUs = (uint32_t) esp_timer_get_time();
+
+    pSimulator->task = xTaskGetCurrentTaskHandle();
+    IotLogInfo("mesh simulator: %u virtual nodes, pattern %d", BRIDGE_MESH_SIM_NODES, BRIDGE_MESH_SIM_PATTERN);
+
+    for(;;)
+    {
+        uint32_t nowUs = (uint32_t) esp_timer_get_time();
+        bool ackPending = __atomic_load_n(&pSimulator->ackPending, __ATOMIC_ACQUIRE) != 0;
+        uint32_t ackDueUs = pSimulator->commandUs + BRIDGE_MESH_SIM_ACK_MS * 1000;
+
+        if(ackPending && (int32_t)(nowUs - ackDueUs) >= 0)
+        {
+            _ingestPacket(pBridge, pSimulator->ackFrame, BRIDGE_MESH_SIM_FRAME_SIZE, nowUs);
+            _latencyRecord(&pSimulator->ackLatency, pSimulator->commandUs);
+            __atomic_store_n(&pSimulator->ackPending, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        if((int32_t)(nowUs - nextUs) >= 0)
+        {
+            _latencyRecord(&pSimulator->lateness, nextUs);
+            nextUs += _meshSimEvent(pBridge, pSimulator);
+            continue;
+        }
+
+        uint32_t waitUs = nextUs - nowUs;
+        if(ackPending && ackDueUs - nowUs < waitUs)
+        {
+            waitUs = ackDueUs - nowUs;
+        }
+        TickType_t ticks = pdMS_TO_TICKS(waitUs / 1000);
+        ulTaskNotifyTake(pdTRUE, (ticks > 0) ? ticks : 1);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * nothing is merged when one of the values is too long, so a section is
+ * taken as a whole or not at all
+ */
+static bool _mergeSection(char values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE],
+                          uint8_t lengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                          const char *pSection, size_t sectionLength)
+{
+    const char *pDevice = NULL, *pValue = NULL;
+    size_t deviceLength = 0, valueLength = 0;
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(_findMember(pSection, sectionLength, _schemaAttributes[i].pDevice, &pDevice, &deviceLength) &&
+           _findMember(pDevice, deviceLength, _schemaAttributes[i].pAttribute, &pValue, &valueLength) &&
+           valueLength >= BRIDGE_COMMAND_VALUE_SIZE)
+        {
+            return false;
+        }
+    }
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(_findMember(pSection, sectionLength, _schemaAttributes[i].pDevice, &pDevice, &deviceLength) == false ||
+           _findMember(pDevice, deviceLength, _schemaAttributes[i].pAttribute, &pValue, &valueLength) == false)
+        {
+            continue;
+        }
+        if(valueLength == 4 && strncmp(pValue, "null", 4) == 0)
+        {
+            lengths[i] = 0;
+            continue;
+        }
+        memcpy(values[i], pValue, valueLength);
+        lengths[i] = (uint8_t)valueLength;
+    }
+    return true;
+}
+
+/**
+ * the object of a section, _writeStateCommand writes it as {"state":<object>}
+ */
+static size_t _writeStateObject(const SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                char *pObject, size_t objectSize)
+{
+    size_t length = _writeStateCommand(values, pObject, objectSize);
+    if(length >= objectSize)
+    {
+        return objectSize;
+    }
+    memmove(pObject, pObject + 9, length - 10);
+    pObject[length - 10] = '\0';
+    return length - 10;
+}
+
+static size_t _shadowEmuSection(char values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE],
+                                const uint8_t lengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                char *pSection, size_t sectionSize)
+{
+    SyncValue_t section[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(lengths[i] > 0)
+        {
+            section[i].pValue = values[i];
+            section[i].length = lengths[i];
+        }
+    }
+    return _writeStateObject(section, pSection, sectionSize);
+}
+
+/**
+ * {"state":{"desired":{...},"reported":{...}},"version":n}, size is returned
+ * when it does not fit
+ */
+static size_t _shadowEmuDocument(EmulatedShadow_t *pShadow, char *pDocument, size_t size)
+{
+    size_t length = snprintf(pDocument, size, "{\"state\":{\"desired\":");
+
+    length += _shadowEmuSection(pShadow->desired, pShadow->desiredLengths, pDocument + length, size - length);
+    if(length < size)
+    {
+        length += snprintf(pDocument + length, size - length, ",\"reported\":");
+    }
+    if(length < size)
+    {
+        length += _shadowEmuSection(pShadow->reported, pShadow->reportedLengths, pDocument + length, size - length);
+    }
+    if(length < size)
+    {
+        length += snprintf(pDocument + length, size - length, "},\"version\":%u}", pShadow->version);
+    }
+    return (length < size) ? length : size;
+}
+
+/**
+ * Like the shadow service a delta is only published when the update wrote
+ * the desired state, holds every desired value that differs from the
+ * reported one and carries the client token of that update. The bridge
+ * writes desired and reported together, so a delta with its token only holds
+ * values the app changed, which the echo filter has to forward.
+ */
+static AwsIotShadowError_t _shadowEmuUpdate(ShadowEmulator_t *pEmulator, uint8_t thing, const char *pDocument, size_t documentLength)
+{
+    EmulatedShadow_t *pShadow = &pEmulator->shadows[thing];
+    const char *pState = NULL, *pDesired = NULL, *pReported = NULL, *pToken = NULL;
+    size_t stateLength = 0, desiredLength = 0, reportedLength = 0, tokenLength = 0;
+    AwsIotShadowError_t status = AWS_IOT_SHADOW_SUCCESS;
+
+    vTaskDelay(pdMS_TO_TICKS(BRIDGE_SHADOW_EMU_LATENCY_MS));
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false)
+    {
+        pEmulator->rejected++;
+        return AWS_IOT_SHADOW_BAD_REQUEST;
+    }
+    if(documentLength > BRIDGE_SHADOW_EMU_DOCUMENT_MAX)
+    {
+        pEmulator->rejected++;
+        return AWS_IOT_SHADOW_TOO_LARGE;
+    }
+    bool desired = _findMember(pState, stateLength, "desired", &pDesired, &desiredLength);
+    _findMember(pState, stateLength, "reported", &pReported, &reportedLength);
+    _findMember(pDocument, documentLength, "clientToken", &pToken, &tokenLength);
+
+    xSemaphoreTake(pEmulator->lock, portMAX_DELAY);
+
+    //like the service, the update rate is limited per thing
+    uint64_t nowMs = IotClock_GetTimeMs();
+    if(nowMs - pShadow->windowStartMs >= 1000)
+    {
+        pShadow->windowStartMs = nowMs;
+        pShadow->windowUpdates = 0;
+    }
+
+    if(BRIDGE_SHADOW_EMU_RATE_PER_SEC > 0 && pShadow->windowUpdates >= BRIDGE_SHADOW_EMU_RATE_PER_SEC)
+    {
+        pEmulator->throttled++;
+        status = AWS_IOT_SHADOW_THROTTLED;
+    }
+    else if(_mergeSection(pShadow->desired, pShadow->desiredLengths, pDesired, desiredLength) == false ||
+            _mergeSection(pShadow->reported, pShadow->reportedLengths, pReported, reportedLength) == false)
+    {
+        pEmulator->rejected++;
+        status = AWS_IOT_SHADOW_BAD_REQUEST;
+    }
+    else
+    {
+        pShadow->windowUpdates++;
+        pShadow->version++;
+        pEmulator->accepted++;
+    }
+
+    if(status == AWS_IOT_SHADOW_SUCCESS)
+    {
+        //the updated document, only its current state is read by the bridge
+        size_t length = snprintf(pEmulator->documents, sizeof(pEmulator->documents), "{\"current\":");
+        length += _shadowEmuDocument(pShadow, pEmulator->documents + length, sizeof(pEmulator->documents) - length);
+        if(length < sizeof(pEmulator->documents))
+        {
+            length += snprintf(pEmulator->documents + length, sizeof(pEmulator->documents) - length, "}");
+        }
+        if(length < sizeof(pEmulator->documents))
+        {
+            _mirrorApplyDocuments(&_bridgeContext.shadowMirror, thing, pEmulator->documents, length);
+        }
+    }
+
+    if(status == AWS_IOT_SHADOW_SUCCESS && desired)
+    {
+        char deltaValues[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+        uint8_t deltaLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { 0 };
+        bool differs = false;
+
+        for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+        {
+            if(pShadow->desiredLengths[i] > 0 &&
+               (pShadow->desiredLengths[i] != pShadow->reportedLengths[i] ||
+                memcmp(pShadow->desired[i], pShadow->reported[i], pShadow->desiredLengths[i]) != 0))
+            {
+                memcpy(deltaValues[i], pShadow->desired[i], pShadow->desiredLengths[i]);
+                deltaLengths[i] = pShadow->desiredLengths[i];
+                differs = true;
+            }
+        }
+
+        if(differs)
+        {
+            size_t length = snprintf(pEmulator->delta, sizeof(pEmulator->delta), "{\"state\":");
+            length += _shadowEmuSection(deltaValues, deltaLengths, pEmulator->delta + length, sizeof(pEmulator->delta) - length);
+            if(length < sizeof(pEmulator->delta))
+            {
+                length += snprintf(pEmulator->delta + length, sizeof(pEmulator->delta) - length,
+                                   ",\"version\":%u,\"timestamp\":%llu", pShadow->version, nowMs / 1000);
+            }
+            if(length < sizeof(pEmulator->delta) && pToken != NULL)
+            {
+                length += snprintf(pEmulator->delta + length, sizeof(pEmulator->delta) - length,
+                                   ",\"clientToken\":%.*s", (int)tokenLength, pToken);
+            }
+            if(length < sizeof(pEmulator->delta))
+            {
+                length += snprintf(pEmulator->delta + length, sizeof(pEmulator->delta) - length, "}");
+            }
+            if(length < sizeof(pEmulator->delta))
+            {
+                //the delta callback only copies the document
+                _postDelta(&_bridgeContext, thing, pEmulator->delta, length);
+                pEmulator->deltas++;
+                if(pToken != NULL && strncmp(pToken, "\"app-", 5) != 0)
+                {
+                    pEmulator->ownDeltas++;
+                }
+            }
+        }
+    }
+
+    xSemaphoreGive(pEmulator->lock);
+    return status;
+}
+
+static AwsIotShadowError_t _shadowEmuGet(ShadowEmulator_t *pEmulator, uint8_t thing, const char **ppDocument, size_t *pDocumentLength)
+{
+    EmulatedShadow_t *pShadow = &pEmulator->shadows[thing];
+    char *pDocument = malloc(2 * BRIDGE_DELTA_SLOT_SIZE);
+    size_t length = 0, size = 2 * BRIDGE_DELTA_SLOT_SIZE;
+
+    vTaskDelay(pdMS_TO_TICKS(BRIDGE_SHADOW_EMU_LATENCY_MS));
+    if(pDocument == NULL)
+    {
+        return AWS_IOT_SHADOW_NO_MEMORY;
+    }
+
+    xSemaphoreTake(pEmulator->lock, portMAX_DELAY);
+    if(pShadow->version == 0)
+    {
+        xSemaphoreGive(pEmulator->lock);
+        free(pDocument);
+        return AWS_IOT_SHADOW_NOT_FOUND;
+    }
+
+    length = _shadowEmuDocument(pShadow, pDocument, size);
+    xSemaphoreGive(pEmulator->lock);
+
+    if(length >= size)
+    {
+        free(pDocument);
+        return AWS_IOT_SHADOW_TOO_LARGE;
+    }
+    *ppDocument = pDocument;
+    *pDocumentLength = length;
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+/**
+ * sets a random control attribute of a random thing to a random value of the
+ * schema, like a user tapping in the app
+ */
+static void _shadowEmuAppTask(void *pArgument)
+{
+    ShadowEmulator_t *pEmulator = pArgument;
+    char document[BRIDGE_SCHEMA_ATTRIBUTE_COUNT * (BRIDGE_COMMAND_VALUE_SIZE + 64) + 64];
+    char text[BRIDGE_NUMBER_TEXT_MAX + 2];
+    uint32_t changes = 0;
+
+    for(;;)
+    {
+        vTaskDelay(pdMS_TO_TICKS(BRIDGE_SHADOW_EMU_APP_PERIOD_MS));
+
+        int index = (int)(esp_random() % BRIDGE_SCHEMA_ATTRIBUTE_COUNT);
+        const SchemaAttribute_t *pSchema = &_schemaAttributes[index];
+        SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+
+        if(pSchema->trafficClass == CLASS_TELEMETRY)
+        {
+            continue;
+        }
+        if(pSchema->valueType == VALUE_NUMBER)
+        {
+            int32_t value = pSchema->minimum + (int32_t)(esp_random() % (uint32_t)(pSchema->maximum - pSchema->minimum + 1));
+            values[index].length = _formatNumber(value, pSchema->decimals, text);
+        }
+        else
+        {
+            int choices = 0;
+            while(choices < SCHEMA_CHOICES_MAX && pSchema->pChoices[choices] != NULL)
+            {
+                choices++;
+            }
+            values[index].length = snprintf(text, sizeof(text), "\"%s\"", pSchema->pChoices[esp_random() % choices]);
+        }
+        values[index].pValue = text;
+
+        size_t length = snprintf(document, sizeof(document), "{\"state\":{\"desired\":");
+        length += _writeStateObject(values, document + length, sizeof(document) - length);
+        snprintf(document + length, sizeof(document) - length, "},\"clientToken\":\"app-%u\"}", changes++);
+
+        _shadowEmuUpdate(pEmulator, (uint8_t)(esp_random() % BRIDGE_THING_COUNT), document, strlen(document));
+    }
+}
+
+static int _shadowEmuStart(BridgeContext_t *pBridge)
+{
+    ShadowEmulator_t *pEmulator = &_shadowEmulator;
+
+    (void) pBridge;
+    pEmulator->lock = xSemaphoreCreateMutex();
+    if(pEmulator->lock == NULL)
+    {
+        IotLogError("Failed to create the shadow emulator");
+        return EXIT_FAILURE;
+    }
+
+    if(BRIDGE_SHADOW_EMU_APP_PERIOD_MS > 0 &&
+       xTaskCreatePinnedToCore(_shadowEmuAppTask, "shadowEmuApp", BRIDGE_PUBLISHER_TASK_STACK, pEmulator,
+                               BRIDGE_TASK_PRIORITY, NULL, BRIDGE_NETWORK_CORE) != pdPASS)
+    {
+        IotLogError("Failed to start the app of the shadow emulator");
+        return EXIT_FAILURE;
+    }
+
+    IotLogInfo("shadow emulator: %u ms latency, %u updates/s", BRIDGE_SHADOW_EMU_LATENCY_MS, BRIDGE_SHADOW_EMU_RATE_PER_SEC);
+    return EXIT_SUCCESS;
+}
+
+/*-----------------------------------------------------------*/
+
+static IotNetworkError_t _openNetworkConnection(BridgeContext_t *pBridge,
+                                                void *pNetworkServerInfo,
+                                                void *pNetworkCredentialInfo)
+{
+    uint64_t startMs = IotClock_GetTimeMs();
+    IotNetworkError_t networkStatus = pBridge->pNetworkInterface->create(pNetworkServerInfo,
+                                                                        pNetworkCredentialInfo,
+                                                                        &pBridge->pNetworkConnection);
+
+    if(networkStatus != IOT_NETWORK_SUCCESS)
+    {
+        IotLogError("Failed to create the network connection, error %d", networkStatus);
+        pBridge->pNetworkConnection = NULL;
+        return networkStatus;
+    }
+
+    pBridge->connectStats.fullHandshakes++;
+    pBridge->connectStats.lastHandshakeMs = (uint32_t)(IotClock_GetTimeMs() - startMs);
+    pBridge->connectStats.totalHandshakeMs += pBridge->connectStats.lastHandshakeMs;
+
+    IotLogInfo("TLS handshake took %u ms", pBridge->connectStats.lastHandshakeMs);
+
+    return networkStatus;
+}
+
+/**
+ * up to half of the wait is random, so gateways that lost the broker together
+ * do not all come back at once
+ */
+static void _connectBackoff(uint32_t *pBackoffMs)
+{
+    uint32_t waitMs = *pBackoffMs / 2 + esp_random() % (*pBackoffMs / 2 + 1);
+
+    IotLogInfo("Retrying the connection in %u ms", waitMs);
+    vTaskDelay(pdMS_TO_TICKS(waitMs));
+
+    *pBackoffMs = (*pBackoffMs * 2 > BRIDGE_CONNECT_BACKOFF_MAX_MS) ? BRIDGE_CONNECT_BACKOFF_MAX_MS : *pBackoffMs * 2;
+}
+
+static void _closeNetworkConnection(BridgeContext_t *pBridge)
+{
+    if(pBridge->pNetworkConnection == NULL)
+    {
+        return;
+    }
+
+    pBridge->pNetworkInterface->close(pBridge->pNetworkConnection);
+    pBridge->pNetworkInterface->destroy(pBridge->pNetworkConnection);
+    pBridge->pNetworkConnection = NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * FNV-1a, only used to tell the cached session of one gateway from another
+ */
+static uint32_t _thingNameHash(const char *pThingName, size_t thingNameLength)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < thingNameLength; i++)
+    {
+        hash = (hash ^ (uint8_t) pThingName[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * rtc memory holds garbage after a power cycle or brownout, and the broker
+ * may have dropped the session by then, so the cache is only trusted after a
+ * reset that happened while the gateway was running. Even then the session
+ * may have expired on the broker, a wrong guess only costs the resumed
+ * subscriptions that never receive anything.
+ */
+static bool _sessionCacheValid(const char *pThingName, size_t thingNameLength)
+{
+    esp_reset_reason_t resetReason = esp_reset_reason();
+
+    if(resetReason == ESP_RST_POWERON || resetReason == ESP_RST_BROWNOUT || resetReason == ESP_RST_UNKNOWN)
+    {
+        _sessionCacheClear();
+        return false;
+    }
+
+    //a firmware serving more things has to subscribe the topics of the new ones
+    return _sessionCache.magic == BRIDGE_SESSION_CACHE_MAGIC &&
+           _sessionCache.thingNameHash == _thingNameHash(pThingName, thingNameLength) &&
+           _sessionCache.thingCount == BRIDGE_THING_COUNT &&
+           _sessionCache.deltaSubscribed == 1;
+}
+
+static void _sessionCacheStore(const char *pThingName, size_t thingNameLength)
+{
+    _sessionCache.thingNameHash = _thingNameHash(pThingName, thingNameLength);
+    _sessionCache.thingCount = BRIDGE_THING_COUNT;
+    _sessionCache.deltaSubscribed = 1;
+    _sessionCache.magic = BRIDGE_SESSION_CACHE_MAGIC;
+}
+
+static void _sessionCacheClear(void)
+{
+    _sessionCache.magic = 0;
+    _sessionCache.deltaSubscribed = 0;
+}
+
+/*-----------------------------------------------------------*/
+
+static void _ringNotifyConsumer(SpscRing_t *pRing, BaseType_t *pHigherPriorityTaskWoken)
+{
+    if(pRing->consumer == NULL)
+    {
+        return;
+    }
+
+    if(pHigherPriorityTaskWoken == NULL)
+    {
+        xTaskNotifyGive(pRing->consumer);
+    }
+    else
+    {
+        vTaskNotifyGiveFromISR(pRing->consumer, pHigherPriorityTaskWoken);
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static TrafficClass_t _classifyFrame(Device_t deviceType, Attribute_t attributeType)
+{
+    int index = _schemaIndex(deviceType, attributeType);
+
+    if(index >= 0)
+    {
+        return _schemaAttributes[index].trafficClass;
+    }
+    if(deviceType == LOCK || attributeType == LOCK_UNLOCK)
+    {
+        return CLASS_SECURITY;
+    }
+    if(attributeType == POWER_LEVEL || attributeType == TEMPERATURE)
+    {
+        return CLASS_TELEMETRY;
+    }
+    return CLASS_CONTROL;
+}
+
+/**
+ * an attribute is only looked for while it could raise the class
+ */
+static TrafficClass_t _classifyState(const char *pState, size_t stateLength)
+{
+    TrafficClass_t trafficClass = CLASS_TELEMETRY;
+    const char *pDevice = NULL, *pValue = NULL;
+    size_t deviceLength = 0, valueLength = 0;
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(_schemaAttributes[i].trafficClass < trafficClass &&
+           _findMember(pState, stateLength, _schemaAttributes[i].pDevice, &pDevice, &deviceLength) &&
+           _findMember(pDevice, deviceLength, _schemaAttributes[i].pAttribute, &pValue, &valueLength))
+        {
+            trafficClass = _schemaAttributes[i].trafficClass;
+        }
+    }
+    return trafficClass;
+}
+
+/**
+ * a scene is as urgent as the most urgent attribute it sets
+ */
+static TrafficClass_t _classifyDelta(const char *pDocument, size_t documentLength)
+{
+    const char *pState = NULL, *pGroups = NULL, *pGroup = NULL;
+    size_t stateLength = 0, groupsLength = 0, groupLength = 0;
+
+    if(_findMember(pDocument, documentLength, "state", &pState, &stateLength) == false)
+    {
+        return CLASS_TELEMETRY;
+    }
+
+    TrafficClass_t trafficClass = _classifyState(pState, stateLength);
+
+    if(_findMember(pState, stateLength, BRIDGE_GROUPS_KEY, &pGroups, &groupsLength))
+    {
+        for(size_t i = 0; i < sizeof(_meshGroups) / sizeof(_meshGroups[0]); i++)
+        {
+            if(_findMember(pGroups, groupsLength, _meshGroups[i].pKey, &pGroup, &groupLength))
+            {
+                TrafficClass_t groupClass = _classifyState(pGroup, groupLength);
+                trafficClass = (groupClass < trafficClass) ? groupClass : trafficClass;
+            }
+        }
+    }
+    return trafficClass;
+}
+
+/**
+ * every class that has work but is not served is passed over once, the
+ * served class starts over. The lowest class that reached the starvation
+ * limit wins over strict priority.
+ */
+static TrafficClass_t _selectLane(const bool hasWork[CLASS_COUNT], uint32_t passedOver[CLASS_COUNT])
+{
+    TrafficClass_t selected = CLASS_COUNT;
+
+    for(int trafficClass = CLASS_COUNT - 1; trafficClass >= 0; trafficClass--)
+    {
+        if(hasWork[trafficClass] && passedOver[trafficClass] >= BRIDGE_LANE_STARVATION_LIMIT)
+        {
+            selected = (TrafficClass_t) trafficClass;
+            break;
+        }
+    }
+
+    for(int trafficClass = 0; selected == CLASS_COUNT && trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        if(hasWork[trafficClass])
+        {
+            selected = (TrafficClass_t) trafficClass;
+        }
+    }
+
+    for(int trafficClass = 0; selected != CLASS_COUNT && trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        if(trafficClass == (int) selected)
+        {
+            passedOver[trafficClass] = 0;
+        }
+        else if(hasWork[trafficClass])
+        {
+            passedOver[trafficClass]++;
+        }
+    }
+
+    return selected;
+}
+
+static bool _lanesInit(PriorityLanes_t *pLanes, uint32_t capacity, size_t elementSize)
+{
+    for(int trafficClass = 0; trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        pLanes->passedOver[trafficClass] = 0;
+        if(_ringInit(&pLanes->lanes[trafficClass], capacity, elementSize) == false)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _lanesSetConsumer(PriorityLanes_t *pLanes, TaskHandle_t consumer)
+{
+    for(int trafficClass = 0; trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        pLanes->lanes[trafficClass].consumer = consumer;
+    }
+}
+
+static bool _lanesPop(PriorityLanes_t *pLanes, void *pElement, TrafficClass_t *pClass)
+{
+    bool hasWork[CLASS_COUNT];
+
+    for(int trafficClass = 0; trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        hasWork[trafficClass] = _ringCount(&pLanes->lanes[trafficClass]) != 0;
+    }
+
+    TrafficClass_t selected = _selectLane(hasWork, pLanes->passedOver);
+    if(selected == CLASS_COUNT)
+    {
+        return false;
+    }
+
+    *pClass = selected;
+    return _ringPop(&pLanes->lanes[selected], pElement);
+}
+
+/**
+ * the notification count is kept while the consumer is busy, so a push that
+ * happens between the empty check and this wait is never lost
+ */
+static void _lanesWait(PriorityLanes_t *pLanes, TickType_t timeout)
+{
+    for(int trafficClass = 0; trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        if(_ringCount(&pLanes->lanes[trafficClass]) != 0)
+        {
+            return;
+        }
+    }
+    ulTaskNotifyTake(pdTRUE, timeout);
+}
+
+static void _latencyRecord(LatencyHistogram_t *pHistogram, uint32_t startUs)
+{
+    uint32_t latencyMs = ((uint32_t) esp_timer_get_time() - startUs) / 1000;
+    uint32_t bucket = latencyMs == 0 ? 0 : 32 - __builtin_clz(latencyMs);
+
+    if(bucket >= BRIDGE_LATENCY_BUCKETS)
+    {
+        bucket = BRIDGE_LATENCY_BUCKETS - 1;
+    }
+    pHistogram->buckets[bucket]++;
+}
+
+static uint32_t _latencyPercentileMs(const LatencyHistogram_t *pHistogram, uint32_t percentile)
+{
+    uint64_t total = 0;
+    uint64_t seen = 0;
+
+    for(int bucket = 0; bucket < BRIDGE_LATENCY_BUCKETS; bucket++)
+    {
+        total += pHistogram->buckets[bucket];
+    }
+
+    for(int bucket = 0; total != 0 && bucket < BRIDGE_LATENCY_BUCKETS; bucket++)
+    {
+        seen += pHistogram->buckets[bucket];
+        if(seen * 100 >= total * percentile)
+        {
+            return 1u << bucket;
+        }
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+static void _drainIntoBatch(PriorityLanes_t *pLanes, FrameBatch_t *pBatch, RateLimiter_t pLimiters[BRIDGE_THING_COUNT])
+{
+    BridgeFrame_t frame;
+    TrafficClass_t trafficClass;
+
+    while(pBatch->count < BRIDGE_BATCH_MAX && _lanesPop(pLanes, &frame, &trafficClass))
+    {
+        if(_batchAdd(pBatch, &frame))
+        {
+            pLimiters[frame.thing].batchedFrames++;
+        }
+    }
+}
+
+/**
+ * things are served in turn, so a throttled thing does not hold up the
+ * frames of the others
+ */
+static int _batchTakeThing(const FrameBatch_t *pBatch, RateLimiter_t pLimiters[BRIDGE_THING_COUNT],
+                           uint8_t firstThing, uint32_t *pWaitMs)
+{
+    *pWaitMs = UINT32_MAX;
+
+    for(uint32_t k = 0; k < BRIDGE_THING_COUNT; k++)
+    {
+        uint8_t thing = (uint8_t)((firstThing + k) % BRIDGE_THING_COUNT);
+        bool inBatch = false;
+
+        for(uint32_t i = 0; i < pBatch->count && inBatch == false; i++)
+        {
+            inBatch = (pBatch->frames[i].thing == thing);
+        }
+        if(inBatch == false)
+        {
+            continue;
+        }
+
+        uint32_t waitMs = _rateLimiterAcquire(&pLimiters[thing]);
+        if(waitMs == 0)
+        {
+            return thing;
+        }
+        if(waitMs < *pWaitMs)
+        {
+            *pWaitMs = waitMs;
+        }
+    }
+    return -1;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool _mailboxInit(DeltaMailbox_t *pMailbox, uint32_t slotCount)
+{
+    pMailbox->pSlots = (DeltaSlot_t *) calloc(slotCount, sizeof(DeltaSlot_t));
+    if(pMailbox->pSlots == NULL)
+    {
+        IotLogError("No memory for %u mailbox slots",slotCount);
+        return false;
+    }
+
+    pMailbox->slotCount = slotCount;
+    pMailbox->nextSequence = 0;
+    pMailbox->overflowCount = 0;
+    pMailbox->oversizedCount = 0;
+    pMailbox->resync = false;
+    pMailbox->resyncCount = 0;
+    pMailbox->consumer = NULL;
+    memset(pMailbox->passedOver, 0, sizeof(pMailbox->passedOver));
+
+    return true;
+}
+
+/**
+ * a slot is claimed by moving it from SLOT_FREE to SLOT_FILLING, only the
+ * producer that won the compare and swap writes into it. The sequence is
+ * taken when the slot is complete, so the consumer sees deltas in the order
+ * the producers finished them.
+ */
+static bool _mailboxPost(DeltaMailbox_t *pMailbox, uint8_t thing, const char *pDocument, size_t documentLength,
+                         uint32_t receivedUs, DeltaSlotKind_t kind)
+{
+    if(documentLength > BRIDGE_DELTA_SLOT_SIZE)
+    {
+        __atomic_fetch_add(&pMailbox->oversizedCount, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    for(uint32_t i = 0; i < pMailbox->slotCount; i++)
+    {
+        DeltaSlot_t *pSlot = &pMailbox->pSlots[i];
+        uint32_t expected = SLOT_FREE;
+
+        if(__atomic_compare_exchange_n(&pSlot->state, &expected, SLOT_FILLING,
+                                       false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            memcpy(pSlot->document, pDocument, documentLength);
+            pSlot->documentLength = documentLength;
+            pSlot->receivedUs = receivedUs;
+            pSlot->thing = thing;
+            pSlot->kind = kind;
+            pSlot->classified = false;
+            pSlot->sequence = __atomic_fetch_add(&pMailbox->nextSequence, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pSlot->state, SLOT_READY, __ATOMIC_RELEASE);
+
+            if(pMailbox->consumer != NULL)
+            {
+                xTaskNotifyGive(pMailbox->consumer);
+            }
+            return true;
+        }
+    }
+
+    __atomic_fetch_add(&pMailbox->overflowCount, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+/**
+ * the producers only copy, a slot is classified here the first time it is
+ * seen ready, so the mqtt callbacks do no json parsing
+ */
+static DeltaSlot_t *_mailboxTake(DeltaMailbox_t *pMailbox)
+{
+    DeltaSlot_t *pOldest[CLASS_COUNT] = { NULL };
+    bool hasWork[CLASS_COUNT] = { false };
+
+    for(uint32_t i = 0; i < pMailbox->slotCount; i++)
+    {
+        DeltaSlot_t *pSlot = &pMailbox->pSlots[i];
+
+        if(__atomic_load_n(&pSlot->state, __ATOMIC_ACQUIRE) == SLOT_READY)
+        {
+            if(pSlot->classified == false)
+            {
+                pSlot->trafficClass = _classifyDelta(pSlot->document, pSlot->documentLength);
+                pSlot->classified = true;
+            }
+            TrafficClass_t trafficClass = pSlot->trafficClass;
+
+            if(pOldest[trafficClass] == NULL || (int32_t)(pSlot->sequence - pOldest[trafficClass]->sequence) < 0)
+            {
+                pOldest[trafficClass] = pSlot;
+                hasWork[trafficClass] = true;
+            }
+        }
+    }
+
+    TrafficClass_t selected = _selectLane(hasWork, pMailbox->passedOver);
+    if(selected == CLASS_COUNT)
+    {
+        return NULL;
+    }
+
+    /* A later delta of a thing must not be written before an earlier one,
+     * the mesh would end up with the older value. */
+    DeltaSlot_t *pTaken = pOldest[selected];
+    for(uint32_t i = 0; i < pMailbox->slotCount; i++)
+    {
+        DeltaSlot_t *pSlot = &pMailbox->pSlots[i];
+
+        if(__atomic_load_n(&pSlot->state, __ATOMIC_ACQUIRE) == SLOT_READY && pSlot->classified &&
+           pSlot->thing == pTaken->thing && (int32_t)(pSlot->sequence - pTaken->sequence) < 0)
+        {
+            pTaken = pSlot;
+        }
+    }
+
+    __atomic_store_n(&pTaken->state, SLOT_DRAINING, __ATOMIC_RELAXED);
+    return pTaken;
+}
+
+static void _mailboxRelease(DeltaSlot_t *pSlot)
+{
+    __atomic_store_n(&pSlot->state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+/*-----------------------------------------------------------*/
+
+static void _stageRecord(StageStats_t *pStats, uint32_t startUs)
+{
+    uint32_t itemUs = (uint32_t) esp_timer_get_time() - startUs;
+
+    pStats->busyUs += itemUs;
+    pStats->items++;
+    if(itemUs > pStats->maxItemUs)
+    {
+        pStats->maxItemUs = itemUs;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static int _prepareBridge(BridgeContext_t *pBridge,
+                          const char *pThingName,
+                          size_t thingNameLength)
+{
+    for(uint8_t i = 0; i < BRIDGE_THING_COUNT; i++)
+    {
+        Thing_t *pThing = &pBridge->things[i];
+        char suffix[sizeof("-99")] = "";
+        int topicLength = 0;
+
+        if(i > 0)
+        {
+            snprintf(suffix, sizeof(suffix), "-%u", i);
+        }
+        topicLength = snprintf(pThing->deltaTopic, sizeof(pThing->deltaTopic),
+                               "$aws/things/%.*s%s/shadow/update/delta", (int)thingNameLength, pThingName, suffix);
+
+        //AWS IoT accepts thing names of at most 128 characters
+        if(topicLength < 0 || thingNameLength + strlen(suffix) > 128)
+        {
+            IotLogError("Thing Name is too long for the delta topic");
+            return EXIT_FAILURE;
+        }
+
+        pThing->pBridge = pBridge;
+        pThing->index = i;
+        pThing->deltaSubscribed = false;
+        pThing->pName = pThing->deltaTopic + BRIDGE_THING_NAME_OFFSET;
+        pThing->nameLength = (uint8_t)(thingNameLength + strlen(suffix));
+    }
+
+    if(_mailboxInit(&pBridge->deltaMailbox, BRIDGE_DELTA_SLOT_COUNT) == false)
+    {
+        IotLogError("Failed to create the delta mailbox");
+        return EXIT_FAILURE;
+    }
+
+    if(_mirrorInit(&pBridge->shadowMirror) == false)
+    {
+        IotLogError("Failed to create the shadow mirror");
+        return EXIT_FAILURE;
+    }
+
+    pBridge->readyEvents = xEventGroupCreate();
+    if(pBridge->readyEvents == NULL)
+    {
+        IotLogError("Failed to create the bridge events");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * create the rings and mailboxes between the stages and start the pipeline tasks,
+ * the uart tasks are pinned to BRIDGE_UART_CORE and the publisher to
+ * BRIDGE_NETWORK_CORE. The consumer of a ring is started before its producer.
+ */
+static int _startBridgePipeline(BridgeContext_t *pBridge)
+{
+    int status = EXIT_SUCCESS;
+    StageStats_t *pStats = pBridge->stats;
+
+    pStats[STAGE_UART_INGRESS].pName = "uart ingress";
+    pStats[STAGE_MESH_TX].pName = "mesh tx";
+    pStats[STAGE_SHADOW_PUBLISH].pName = "shadow publish";
+    pStats[STAGE_SHADOW_DELTA].pName = "shadow delta";
+
+    if(_lanesInit(&pBridge->frameLanes, BRIDGE_FRAME_RING_CAPACITY, sizeof(BridgeFrame_t)) == false)
+    {
+        IotLogError("Failed to create the pipeline queues");
+        status = EXIT_FAILURE;
+    }
+
+    for(size_t i = 0; i < BRIDGE_THING_COUNT; i++)
+    {
+        _rateLimiterInit(&pBridge->rateLimiters[i]);
+    }
+
+    if(status == EXIT_SUCCESS && _traceInit(&_traceRecorder) == false)
+    {
+        IotLogError("No memory for the traffic trace");
+        status = EXIT_FAILURE;
+    }
+
+    if(status == EXIT_SUCCESS &&
+       xTaskCreatePinnedToCore(_shadowPublisherTask, "shadowPublish", BRIDGE_PUBLISHER_TASK_STACK, pBridge,
+                               BRIDGE_TASK_PRIORITY, &pStats[STAGE_SHADOW_PUBLISH].task, BRIDGE_NETWORK_CORE) != pdPASS)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    _lanesSetConsumer(&pBridge->frameLanes, pStats[STAGE_SHADOW_PUBLISH].task);
+
+    //the replayed trace or the simulator takes the place of the uart as the producer of the frame lanes
+    TaskFunction_t ingressTask = (BRIDGE_TRACE_MODE == BRIDGE_TRACE_REPLAY) ? _traceReplayTask :
+                                 (BRIDGE_MESH_SIMULATOR == 1) ? _meshSimulatorTask : _uartIngressTask;
+
+    if(status == EXIT_SUCCESS &&
+       xTaskCreatePinnedToCore(ingressTask, "uartIngress", BRIDGE_UART_TASK_STACK, pBridge,
+                               BRIDGE_TASK_PRIORITY, &pStats[STAGE_UART_INGRESS].task, BRIDGE_UART_CORE) != pdPASS)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    if(status == EXIT_SUCCESS &&
+       xTaskCreatePinnedToCore(_meshTxTask, "meshTx", BRIDGE_UART_TASK_STACK, pBridge,
+                               BRIDGE_TASK_PRIORITY, &pStats[STAGE_MESH_TX].task, BRIDGE_UART_CORE) != pdPASS)
+    {
+        status = EXIT_FAILURE;
+    }
+
+    pBridge->deltaMailbox.consumer = pStats[STAGE_MESH_TX].task;
+
+    if(status == EXIT_FAILURE)
+    {
+        IotLogError("Failed to start the bridge pipeline");
+
+        for(int stage = 0; stage < STAGE_COUNT; stage++)
+        {
+            if(pStats[stage].task != NULL)
+            {
+                vTaskDelete(pStats[stage].task);
+                pStats[stage].task = NULL;
+            }
+        }
+    }
+
+    return status;
+}
+
+/**
+ * reads whatever is buffered in the rx buffer, splits it into frames, decodes
+ * them and pushes them into the lanes of their traffic class. A frame cut by
+ * the read is completed by the next one. When the publisher is behind the
+ * push overflows and is retried, so bursts are kept in the uart rx buffer
+ * instead of being dropped.
+ */
+static void _uartIngressTask(void *pArgument)
+{
+    BridgeContext_t *pBridge = pArgument;
+    StageStats_t *pStats = &pBridge->stats[STAGE_UART_INGRESS];
+
+    //one spare byte so the packet is always followed by a '\0'
+    uint8_t *data = (uint8_t *) malloc(BUF_SIZE + 1);
+    if(data == NULL)
+    {
+        IotLogError("No memory for the uart ingress buffer");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    //bytes of a frame not complete yet, at the start of data
+    size_t pending = 0;
+    uint64_t lastReadMs = 0;
+
+    for(;;)
+    {
+        size_t length = 0;
+        ESP_ERROR_CHECK(uart_get_buffered_data_len(UART_NUM_1, &length));
+
+        if(length == 0)
+        {
+            //nothing followed, the packet is shorter than a frame
+            if(pending > 0 && IotClock_GetTimeMs() - lastReadMs >= BRIDGE_UART_FRAME_GAP_MS)
+            {
+                data[pending] = '\0';
+                _traceRecord(TRACE_UART_IN, _packetThing(data, pending), data, pending);
+                _ingestPacket(pBridge, data, pending, (uint32_t) esp_timer_get_time());
+                pending = 0;
+            }
+            vTaskDelay(pdMS_TO_TICKS(BRIDGE_UART_POLL_MS));
+            continue;
+        }
+
+        if(length > BUF_SIZE - pending)
+        {
+            length = BUF_SIZE - pending;
+        }
+
+        uint32_t startUs = (uint32_t) esp_timer_get_time();
+        int readLength = uart_read_bytes(UART_NUM_1, data + pending, length, 100/portTICK_PERIOD_MS);
+        IotLogDebug("Read %d bytes from the rx buffer", readLength);
+
+        if(readLength > 0)
+        {
+            pending += (size_t)readLength;
+            lastReadMs = IotClock_GetTimeMs();
+
+            size_t ingested = _ingestFrames(pBridge, data, pending, startUs);
+            pending -= ingested;
+            memmove(data, data + ingested, pending);
+        }
+        else
+        {
+            _stageRecord(pStats, startUs);
+        }
+    }
+}
+
+static size_t _ingestFrames(BridgeContext_t *pBridge, const uint8_t *data, size_t length, uint32_t startUs)
+{
+    //one spare byte so the frame is always followed by a '\0'
+    uint8_t frame[BRIDGE_FRAME_SIZE + 1];
+    size_t ingested = 0;
+
+    while(length - ingested >= BRIDGE_FRAME_SIZE)
+    {
+        memcpy(frame, data + ingested, BRIDGE_FRAME_SIZE);
+        frame[BRIDGE_FRAME_SIZE] = '\0';
+        _traceRecord(TRACE_UART_IN, _packetThing(frame, BRIDGE_FRAME_SIZE), frame, BRIDGE_FRAME_SIZE);
+        _ingestPacket(pBridge, frame, BRIDGE_FRAME_SIZE, startUs);
+        ingested += BRIDGE_FRAME_SIZE;
+    }
+    return ingested;
+}
+
+static void _ingestPacket(BridgeContext_t *pBridge, uint8_t *data, size_t length, uint32_t startUs)
+{
+    BridgeFrame_t frame;
+
+    if(length > operationTypeLength && data[0] == '3')
+    {
+        _answerQuery(pBridge, data, length, startUs);
+        _stageRecord(&pBridge->stats[STAGE_UART_INGRESS], startUs);
+        return;
+    }
+
+    bool decoded = _decodeFrame(data, length, &frame);
+    frame.receivedUs = startUs;
+
+    /* The mesh acts on a rule before the trigger goes to the cloud. */
+    if(decoded && BRIDGE_LOCAL_RULES == 1)
+    {
+        _applyLocalRules(pBridge, &frame);
+    }
+
+    _stageRecord(&pBridge->stats[STAGE_UART_INGRESS], startUs);
+
+    if(decoded && frame.operation == CLOULD_CHANGE_ENDPOINT_STATE)
+    {
+        /* The mesh applied a command, the next one may be released. */
+        __atomic_store_n(&pBridge->deltaCollapser.acked, true, __ATOMIC_RELEASE);
+        xTaskNotifyGive(pBridge->stats[STAGE_MESH_TX].task);
+
+        if(BRIDGE_LOCAL_RULES == 1)
+        {
+            _ruleResultAcked(pBridge, &frame);
+        }
+    }
+
+    if(decoded)
+    {
+        _queueFrame(pBridge, &frame);
+    }
+}
+
+static void _queueFrame(BridgeContext_t *pBridge, const BridgeFrame_t *pFrame)
+{
+    SpscRing_t *pLane = &pBridge->frameLanes.lanes[_classifyFrame(pFrame->deviceType, pFrame->attributeType)];
+
+    while(_ringPush(pLane, pFrame) == false)
+    {
+        vTaskDelay(pdMS_TO_TICKS(BRIDGE_UART_POLL_MS));
+    }
+    _ringNotifyConsumer(pLane, NULL);
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * Only local changes trigger rules. The acks of the mesh and the results of
+ * rules do not, so rules never trigger each other in a loop.
+ */
+static uint32_t _applyLocalRules(BridgeContext_t *pBridge, const BridgeFrame_t *pFrame)
+{
+    int trigger = _schemaIndex(pFrame->deviceType, pFrame->attributeType);
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    char texts[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    BridgeFrame_t results[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    uint32_t fired = 0;
+
+    if(pFrame->operation != LOCALLY_CHANGE_ENDPOINT_STATE || trigger < 0)
+    {
+        return 0;
+    }
+
+    for(size_t r = 0; r < sizeof(_localRules) / sizeof(_localRules[0]); r++)
+    {
+        const LocalRule_t *pRule = &_localRules[r];
+        const SchemaAttribute_t *pTrigger = &_schemaAttributes[trigger];
+
+        if((int)pRule->trigger != trigger ||
+           (pRule->pTriggerValue != NULL &&
+            (pTrigger->valueType != VALUE_ENUM || strcmp(pTrigger->pChoices[pFrame->value.value], pRule->pTriggerValue) != 0)))
+        {
+            continue;
+        }
+
+        BridgeFrame_t result = *pFrame;
+        const SchemaAttribute_t *pTarget = &_schemaAttributes[pRule->target];
+
+        if(_ruleValue(pRule, &pFrame->value, &result.value) == false)
+        {
+            pBridge->rulesSkipped++;
+            continue;
+        }
+
+        char *pText = texts[pRule->target];
+        values[pRule->target].pValue = pText;
+        values[pRule->target].length = (pTarget->valueType == VALUE_NUMBER) ?
+                                       _formatNumber(result.value.value, pTarget->decimals, pText) :
+                                       (size_t)snprintf(pText, BRIDGE_COMMAND_VALUE_SIZE, "\"%s\"",
+                                                        pTarget->pChoices[result.value.value]);
+
+        result.deviceType = pTarget->device;
+        result.attributeType = pTarget->attribute;
+        results[pRule->target] = result;
+        fired++;
+    }
+
+    if(fired == 0)
+    {
+        return 0;
+    }
+
+    char *pCommand = malloc(BRIDGE_DELTA_SLOT_SIZE);
+    size_t commandLength = (pCommand != NULL) ? _writeStateCommand(values, pCommand, BRIDGE_DELTA_SLOT_SIZE) : 0;
+
+    if(commandLength > 0 && commandLength < BRIDGE_DELTA_SLOT_SIZE &&
+       _mailboxPost(&pBridge->deltaMailbox, pFrame->thing, pCommand, commandLength, pFrame->receivedUs, SLOT_KIND_RULE))
+    {
+        IotLogInfo("local rules: %u fired, %.*s", fired, (int)commandLength, pCommand);
+        pBridge->rulesFired += fired;
+
+        for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+        {
+            if(values[i].pValue != NULL)
+            {
+                _ruleResultPending(pBridge, &results[i]);
+            }
+        }
+    }
+    else
+    {
+        IotLogWarn("local rules: the command of %u rules was not posted", fired);
+        pBridge->rulesSkipped += fired;
+    }
+    free(pCommand);
+    return fired;
+}
+
+/**
+ * a full table gives up the oldest result
+ */
+static void _ruleResultPending(BridgeContext_t *pBridge, const BridgeFrame_t *pResult)
+{
+    RuleResult_t *pSlot = &pBridge->ruleResults[0];
+
+    for(size_t i = 0; i < BRIDGE_RULE_RESULTS; i++)
+    {
+        RuleResult_t *pEntry = &pBridge->ruleResults[i];
+
+        if(pEntry->pending == false)
+        {
+            pSlot = pEntry;
+            break;
+        }
+        if((int32_t)(pEntry->postedMs - pSlot->postedMs) < 0)
+        {
+            pSlot = pEntry;
+        }
+    }
+
+    if(pSlot->pending)
+    {
+        pBridge->ruleResultsLost++;
+    }
+    pSlot->frame = *pResult;
+    pSlot->postedMs = (uint32_t)IotClock_GetTimeMs();
+    pSlot->pending = true;
+}
+
+static void _ruleResultAcked(BridgeContext_t *pBridge, BridgeFrame_t *pFrame)
+{
+    uint32_t nowMs = (uint32_t)IotClock_GetTimeMs();
+
+    for(size_t i = 0; i < BRIDGE_RULE_RESULTS; i++)
+    {
+        RuleResult_t *pEntry = &pBridge->ruleResults[i];
+
+        if(pEntry->pending == false)
+        {
+            continue;
+        }
+        if(nowMs - pEntry->postedMs > BRIDGE_RULE_ACK_MS)
+        {
+            pEntry->pending = false;
+            pBridge->ruleResultsLost++;
+            continue;
+        }
+        if(pEntry->frame.thing == pFrame->thing &&
+           pEntry->frame.deviceType == pFrame->deviceType &&
+           pEntry->frame.attributeType == pFrame->attributeType &&
+           pEntry->frame.value.value == pFrame->value.value)
+        {
+            //reported like the local change that triggered the rule
+            pFrame->operation = LOCALLY_CHANGE_ENDPOINT_STATE;
+            pEntry->pending = false;
+            pBridge->ruleResultsAcked++;
+            return;
+        }
+    }
+}
+
+/**
+ * enum values are matched by the text of their choice, so a switch "ON"
+ * turns a light "ON" even if the choices are in another order
+ */
+static bool _ruleValue(const LocalRule_t *pRule, const AttributeValue_t *pTrigger, AttributeValue_t *pValue)
+{
+    const SchemaAttribute_t *pFrom = &_schemaAttributes[pRule->trigger];
+    const SchemaAttribute_t *pTo = &_schemaAttributes[pRule->target];
+    const char *pChoice = pRule->pTargetValue;
+
+    pValue->type = pTo->valueType;
+    if(pTo->valueType == VALUE_NUMBER)
+    {
+        if(pChoice != NULL || pFrom->valueType != VALUE_NUMBER || pFrom->decimals != pTo->decimals ||
+           pTrigger->value < pTo->minimum || pTrigger->value > pTo->maximum)
+        {
+            return false;
+        }
+        pValue->value = pTrigger->value;
+        return true;
+    }
+
+    if(pChoice == NULL)
+    {
+        if(pFrom->valueType != VALUE_ENUM)
+        {
+            return false;
+        }
+        pChoice = pFrom->pChoices[pTrigger->value];
+    }
+    for(int i = 0; i < SCHEMA_CHOICES_MAX && pTo->pChoices[i] != NULL; i++)
+    {
+        if(strcmp(pTo->pChoices[i], pChoice) == 0)
+        {
+            pValue->value = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Only the device block of a query is read, "Lights" or "Lights:2" for a
+ * device and "*" or "*:2" for all devices of a thing. The answer is posted
+ * into the delta mailbox so the mesh tx task writes it in order with the
+ * other commands.
+ */
+static void _answerQuery(BridgeContext_t *pBridge, const uint8_t *data, size_t length, uint32_t startUs)
+{
+    size_t blockLength = _blockTextLength(data + operationTypeLength,
+                                          length - operationTypeLength < deviceNameLength ?
+                                          length - operationTypeLength : deviceNameLength);
+    bool all = blockLength > 0 && data[operationTypeLength] == '*' &&
+               (blockLength == 1 || data[operationTypeLength + 1] == ':');
+    uint8_t thing = _frameThing(data);
+    Device_t deviceType = all ? UNKNOWN_TYPE : analysisDeviceType((uint8_t *)data);
+
+    if(thing >= BRIDGE_THING_COUNT || (all == false && deviceType == UNKNOWN_TYPE))
+    {
+        IotLogWarn("query of unknown device %.*s, not answered", (int)blockLength, data + operationTypeLength);
+        pBridge->queriesUnanswered++;
+        return;
+    }
+
+    MirroredShadow_t *pShadow = malloc(sizeof(MirroredShadow_t));
+    char *pCommand = malloc(BRIDGE_DELTA_SLOT_SIZE);
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+    uint32_t found = 0;
+
+    if(pShadow == NULL || pCommand == NULL)
+    {
+        free(pShadow);
+        free(pCommand);
+        pBridge->queriesUnanswered++;
+        return;
+    }
+
+    _mirrorSnapshot(&pBridge->shadowMirror, thing, pShadow);
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(pShadow->desiredLengths[i] > 0 && (all || _schemaAttributes[i].device == deviceType))
+        {
+            values[i].pValue = pShadow->desired[i];
+            values[i].length = pShadow->desiredLengths[i];
+            found++;
+        }
+    }
+
+    size_t commandLength = _writeStateCommand(values, pCommand, BRIDGE_DELTA_SLOT_SIZE);
+    if(pShadow->bootstrapped == false || found == 0 || commandLength >= BRIDGE_DELTA_SLOT_SIZE ||
+       _mailboxPost(&pBridge->deltaMailbox, thing, pCommand, commandLength, startUs, SLOT_KIND_ANSWER) == false)
+    {
+        IotLogWarn("query of %.*s not answered, %u desired attributes mirrored",
+                   (int)blockLength, data + operationTypeLength, found);
+        pBridge->queriesUnanswered++;
+    }
+
+    free(pShadow);
+    free(pCommand);
+}
+
+/**
+ * the same diff as the boot sync, merged into the pending values so it goes
+ * out with the next release
+ */
+static void _meshResync(BridgeContext_t *pBridge)
+{
+    DeltaCollapser_t *pCollapser = &pBridge->deltaCollapser;
+    MirroredShadow_t *pShadow = malloc(sizeof(MirroredShadow_t));
+    char *pCommand = malloc(BRIDGE_DELTA_SLOT_SIZE);
+    uint32_t startUs = (uint32_t) esp_timer_get_time();
+    uint32_t outOfSync = 0;
+
+    if(pShadow == NULL || pCommand == NULL)
+    {
+        //tried again the next time the mailbox is empty
+        __atomic_store_n(&pBridge->deltaMailbox.resync, true, __ATOMIC_RELEASE);
+        free(pShadow);
+        free(pCommand);
+        return;
+    }
+
+    for(uint8_t thing = 0; thing < BRIDGE_THING_COUNT; thing++)
+    {
+        size_t length = 0;
+        uint32_t attributes = _mirrorDiff(&pBridge->shadowMirror, thing, pShadow,
+                                          pCommand, BRIDGE_DELTA_SLOT_SIZE, &length);
+
+        if(attributes == 0 || pShadow->bootstrapped == false || length >= BRIDGE_DELTA_SLOT_SIZE)
+        {
+            continue;
+        }
+        if(_collapseDelta(pCollapser, thing, pCommand, length, startUs) == false)
+        {
+            pCollapser->uartBytes += _forwardDelta(thing, pCommand, length);
+            _commandSent(pBridge);
+        }
+        outOfSync += attributes;
+    }
+    pBridge->deltaMailbox.resyncCount++;
+
+    IotLogWarn("mesh resync after dropped deltas: %u attributes out of sync", outOfSync);
+    free(pShadow);
+    free(pCommand);
+}
+
+/**
+ * forwards the deltas posted by the shadow callbacks into the uart port. The
+ * mesh is far slower than mqtt, so deltas are collapsed per attribute and
+ * only the latest values are written once the mesh can take them.
+ */
+static void _meshTxTask(void *pArgument)
+{
+    BridgeContext_t *pBridge = pArgument;
+    StageStats_t *pStats = &pBridge->stats[STAGE_MESH_TX];
+    DeltaCollapser_t *pCollapser = &pBridge->deltaCollapser;
+
+    for(;;)
+    {
+        DeltaSlot_t *pSlot = _mailboxTake(&pBridge->deltaMailbox);
+        uint32_t startUs = (uint32_t) esp_timer_get_time();
+
+        /* Rule commands and query answers go out at once, collapsed deltas
+         * wait behind them. An answer is read from the mirror, so it must
+         * not be patched back into it. */
+        if(pSlot != NULL && pSlot->kind != SLOT_KIND_DELTA)
+        {
+            size_t written = _forwardDelta(pSlot->thing, pSlot->document, pSlot->documentLength);
+
+            pCollapser->uartBytes += written;
+            if(pSlot->kind == SLOT_KIND_RULE)
+            {
+                _latencyRecord(&pBridge->ruleLatency, pSlot->receivedUs);
+            }
+            else if(written > 0)
+            {
+                _latencyRecord(&pBridge->queryLatency, pSlot->receivedUs);
+                pBridge->queriesAnswered++;
+            }
+            _commandSent(pBridge);
+            _mailboxRelease(pSlot);
+            _stageRecord(pStats, startUs);
+            continue;
+        }
+
+        /* The echo of an own update still tells the desired state. */
+        if(pSlot != NULL)
+        {
+            _mirrorApplyDelta(&pBridge->shadowMirror, pSlot->thing, pSlot->document, pSlot->documentLength);
+        }
+
+        if(pSlot != NULL && _echoMatch(&pBridge->echoFilter, pSlot->thing, pSlot->document, pSlot->documentLength))
+        {
+            IotLogInfo("Dropped the echo of an own update: %.*s", pSlot->documentLength, pSlot->document);
+            _mailboxRelease(pSlot);
+            _stageRecord(pStats, startUs);
+            continue;
+        }
+
+        if(pSlot != NULL)
+        {
+            if(_collapseDelta(pCollapser, pSlot->thing, pSlot->document, pSlot->documentLength,
+                              pSlot->receivedUs) == false)
+            {
+                /* Keep the order, what is pending goes out first. */
+                if(_collapserWait(pCollapser) != portMAX_DELAY)
+                {
+                    _collapserRelease(pBridge);
+                }
+                pCollapser->uartBytes += _forwardDelta(pSlot->thing, pSlot->document, pSlot->documentLength);
+                _latencyRecord(&pBridge->downlinkLatency[pSlot->trafficClass], pSlot->receivedUs);
+                pCollapser->rawCount++;
+                _commandSent(pBridge);
+            }
+            else
+            {
+                pCollapser->uartBytes += _fanOutGroups(pBridge, pSlot->thing, pSlot->document,
+                                                       pSlot->documentLength, pSlot->receivedUs);
+            }
+            _mailboxRelease(pSlot);
+
+            _stageRecord(pStats, startUs);
+            continue;
+        }
+
+        /* Only once the older deltas are out, the mirror already holds the
+         * newer ones that were dropped. */
+        if(__atomic_exchange_n(&pBridge->deltaMailbox.resync, false, __ATOMIC_ACQ_REL))
+        {
+            _meshResync(pBridge);
+            _stageRecord(pStats, startUs);
+            continue;
+        }
+
+        TickType_t waitTicks = _collapserWait(pCollapser);
+        if(waitTicks == 0)
+        {
+            _collapserRelease(pBridge);
+            _stageRecord(pStats, startUs);
+            continue;
+        }
+
+        ulTaskNotifyTake(pdTRUE, waitTicks);
+    }
+}
+
+/**
+ * publishes the frames decoded by the uart ingress task through the rate
+ * limiter, one update per thing in the batch. The frames of a throttled
+ * update are kept and published again, any other failed update restarts the
+ * gateway.
+ */
+static void _shadowPublisherTask(void *pArgument)
+{
+    BridgeContext_t *pBridge = pArgument;
+    StageStats_t *pStats = &pBridge->stats[STAGE_SHADOW_PUBLISH];
+    RateLimiter_t *pLimiters = pBridge->rateLimiters;
+    FrameBatch_t batch = { .count = 0 };
+    uint8_t nextThing = 0;
+    BridgeFrame_t frame;
+    TrafficClass_t trafficClass = CLASS_CONTROL;
+
+    /* Scratch buffers owned by this task for encoding. */
+    EncodeArena_t *pArena = (EncodeArena_t *) malloc(sizeof(EncodeArena_t));
+    if(pArena == NULL)
+    {
+        IotLogError("Failed to allocate encode arena");
+        vTaskDelete(NULL);
+        return;
+    }
+
+    /* Frames read while connecting wait in the lanes until there is a
+     * connection to publish them on. */
+    xEventGroupWaitBits(pBridge->readyEvents, BRIDGE_EVENT_CONNECTED, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    for(;;)
+    {
+        if(batch.count == 0)
+        {
+            if(_lanesPop(&pBridge->frameLanes, &frame, &trafficClass) == false)
+            {
+                _lanesWait(&pBridge->frameLanes, portMAX_DELAY);
+                continue;
+            }
+            if(_batchAdd(&batch, &frame) == false)
+            {
+                continue;
+            }
+        }
+
+        /* Near the throttling limit every token has to carry as many frames
+         * as possible, so everything that arrives while waiting for a token
+         * is merged into this update. */
+        uint32_t waitMs = 0;
+        int thing = -1;
+        while((thing = _batchTakeThing(&batch, pLimiters, nextThing, &waitMs)) < 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(waitMs));
+            _drainIntoBatch(&pBridge->frameLanes, &batch, pLimiters);
+        }
+        if(_rateLimiterNearLimit(&pLimiters[thing]))
+        {
+            _drainIntoBatch(&pBridge->frameLanes, &batch, pLimiters);
+        }
+
+        /* The thing that took the token is published, the frames of the
+         * other things wait for their own tokens. */
+        const Thing_t *pThing = &pBridge->things[thing];
+        RateLimiter_t *pLimiter = &pLimiters[thing];
+        nextThing = (uint8_t)((thing + 1) % BRIDGE_THING_COUNT);
+        uint32_t startUs = (uint32_t) esp_timer_get_time();
+        AwsIotShadowError_t updateResult = reportLocalChange(   &batch,
+                                                                pBridge->mqttConnection,
+                                                                pThing,
+                                                                pArena,
+                                                                &pBridge->echoFilter);
+
+        _stageRecord(pStats, startUs);
+
+        /* Nothing was sent, the token goes back and neither the rate nor
+         * the latencies learn anything from it. */
+        if(updateResult == AWS_IOT_SHADOW_BAD_PARAMETER)
+        {
+            _rateLimiterRelease(pLimiter);
+            _batchRemoveThing(&batch, pThing->index);
+            continue;
+        }
+
+        _rateLimiterFeedback(pLimiter, updateResult);
+
+        if(updateResult == AWS_IOT_SHADOW_THROTTLED)
+        {
+            continue;
+        }
+
+        if(updateResult != AWS_IOT_SHADOW_SUCCESS)
+        {
+            IotLogError("Report local change failed, restarting");
+            esp_restart();
+        }
+
+        //the arena still holds the update that was accepted
+        _mirrorApplyUpdate(&pBridge->shadowMirror, pThing->index, pArena->updateDocument,
+                           strlen(pArena->updateDocument));
+
+        for(uint32_t i = 0; i < batch.count; i++)
+        {
+            const BridgeFrame_t *pFrame = &batch.frames[i];
+            if(pFrame->thing == pThing->index)
+            {
+                _latencyRecord(&pBridge->uplinkLatency[_classifyFrame(pFrame->deviceType, pFrame->attributeType)],
+                               pFrame->receivedUs);
+            }
+        }
+        _batchRemoveThing(&batch, pThing->index);
+    }
+}
+
+/**
+ * busy is the wall time a stage spent on its items, which for the shadow stages
+ * includes waiting for the broker. cpu is taken from the FreeRTOS run time
+ * stats of the stage task when they are enabled.
+ */
+static void _reportStageUtilization(BridgeContext_t *pBridge, uint32_t elapsedUs)
+{
+#if ( configGENERATE_RUN_TIME_STATS == 1 ) && ( configUSE_TRACE_FACILITY == 1 )
+    UBaseType_t taskCount = uxTaskGetNumberOfTasks();
+    uint32_t totalRunTime = 0;
+    TaskStatus_t *pTaskStatus = (TaskStatus_t *) malloc(taskCount * sizeof(TaskStatus_t));
+
+    if(pTaskStatus != NULL)
+    {
+        taskCount = uxTaskGetSystemState(pTaskStatus, taskCount, &totalRunTime);
+    }
+    uint32_t windowRunTime = totalRunTime - pBridge->reportedTotalRunTime;
+#endif
+
+    for(int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        StageStats_t *pStats = &pBridge->stats[stage];
+        uint32_t busyUs = pStats->busyUs;
+        uint32_t items = pStats->items;
+        uint32_t windowBusyUs = busyUs - pStats->reportedBusyUs;
+        uint32_t cpuPermille = 0;
+
+#if ( configGENERATE_RUN_TIME_STATS == 1 ) && ( configUSE_TRACE_FACILITY == 1 )
+        for(UBaseType_t i = 0; pTaskStatus != NULL && i < taskCount; i++)
+        {
+            if(pStats->task != NULL && pTaskStatus[i].xHandle == pStats->task)
+            {
+                uint32_t taskRunTime = pTaskStatus[i].ulRunTimeCounter;
+                if(windowRunTime != 0)
+                {
+                    cpuPermille = (uint32_t)(((uint64_t)(taskRunTime - pStats->reportedRunTime) * 1000) / windowRunTime);
+                }
+                pStats->reportedRunTime = taskRunTime;
+            }
+        }
+#endif
+
+        uint32_t windowItems = items - pStats->reportedItems;
+
+        //the shadow delta stage runs on the tasks of the mqtt library
+        UBaseType_t stackFree = pStats->task != NULL ? uxTaskGetStackHighWaterMark(pStats->task) : 0;
+
+        IotLogInfo("stage %s: %u items, busy %u.%u%%, cpu %u.%u%%, avg %u us, max %u us per item, min free stack %u",
+                   pStats->pName,
+                   windowItems,
+                   (uint32_t)(((uint64_t)windowBusyUs * 1000 / elapsedUs) / 10),
+                   (uint32_t)(((uint64_t)windowBusyUs * 1000 / elapsedUs) % 10),
+                   cpuPermille / 10,
+                   cpuPermille % 10,
+                   windowItems == 0 ? 0 : windowBusyUs / windowItems,
+                   pStats->maxItemUs,
+                   (uint32_t)stackFree);
+
+        pStats->reportedBusyUs = busyUs;
+        pStats->reportedItems = items;
+    }
+
+    for(int trafficClass = 0; trafficClass < CLASS_COUNT; trafficClass++)
+    {
+        SpscRing_t *pLane = &pBridge->frameLanes.lanes[trafficClass];
+
+        IotLogInfo("%s lane: %u waiting, %u overflows, uplink p50 %u ms p99 %u ms, downlink p50 %u ms p99 %u ms",
+                   _trafficClassNames[trafficClass],
+                   _ringCount(pLane),
+                   pLane->overflowCount,
+                   _latencyPercentileMs(&pBridge->uplinkLatency[trafficClass], 50),
+                   _latencyPercentileMs(&pBridge->uplinkLatency[trafficClass], 99),
+                   _latencyPercentileMs(&pBridge->downlinkLatency[trafficClass], 50),
+                   _latencyPercentileMs(&pBridge->downlinkLatency[trafficClass], 99));
+    }
+    uint32_t minRateMilli = UINT32_MAX, throttled = 0, batched = 0;
+    for(size_t i = 0; i < BRIDGE_THING_COUNT; i++)
+    {
+        const RateLimiter_t *pLimiter = &pBridge->rateLimiters[i];
+
+        minRateMilli = (pLimiter->rateMilli < minRateMilli) ? pLimiter->rateMilli : minRateMilli;
+        throttled += pLimiter->throttledCount;
+        batched += pLimiter->batchedFrames;
+    }
+    IotLogInfo("shadow updates: lowest rate %u.%u/s, %u throttled, %u frames batched",
+               minRateMilli / 1000,
+               (minRateMilli % 1000) / 100,
+               throttled,
+               batched);
+    IotLogInfo("delta mailbox: %u overflows, %u oversized, %u mesh resyncs",
+               pBridge->deltaMailbox.overflowCount,
+               pBridge->deltaMailbox.oversizedCount,
+               pBridge->deltaMailbox.resyncCount);
+    IotLogInfo("mesh commands: %u released, %u deltas collapsed, %u stale values, %u forwarded as they came, %u bytes written",
+               pBridge->deltaCollapser.releasedCount,
+               pBridge->deltaCollapser.collapsedCount,
+               pBridge->deltaCollapser.staleCount,
+               pBridge->deltaCollapser.rawCount,
+               pBridge->deltaCollapser.uartBytes);
+    IotLogInfo("mesh groups: %u multicast commands, scene p50 %u ms p99 %u ms",
+               pBridge->deltaCollapser.groupFrames,
+               _latencyPercentileMs(&pBridge->groupLatency, 50),
+               _latencyPercentileMs(&pBridge->groupLatency, 99));
+    IotLogInfo("local rules: %u fired, %u skipped, %u results acked, %u lost, command p50 %u ms p99 %u ms",
+               pBridge->rulesFired,
+               pBridge->rulesSkipped,
+               pBridge->ruleResultsAcked,
+               pBridge->ruleResultsLost,
+               _latencyPercentileMs(&pBridge->ruleLatency, 50),
+               _latencyPercentileMs(&pBridge->ruleLatency, 99));
+    IotLogInfo("mesh queries: %u answered, %u not answered, answer p50 %u ms p99 %u ms",
+               pBridge->queriesAnswered,
+               pBridge->queriesUnanswered,
+               _latencyPercentileMs(&pBridge->queryLatency, 50),
+               _latencyPercentileMs(&pBridge->queryLatency, 99));
+    IotLogInfo("echoes of own updates dropped: %u", pBridge->echoFilter.suppressedCount);
+    IotLogInfo("shadow mirror: %u gets, %u deltas, %u own updates and %u documents applied, %u stale deltas, %u stale documents, %u lookups avg %u us max %u us",
+               pBridge->shadowMirror.gets,
+               pBridge->shadowMirror.deltasApplied,
+               pBridge->shadowMirror.updatesApplied,
+               pBridge->shadowMirror.documentsApplied,
+               pBridge->shadowMirror.staleDeltas,
+               pBridge->shadowMirror.staleDocuments,
+               pBridge->shadowMirror.lookups,
+               (pBridge->shadowMirror.lookups > 0) ? pBridge->shadowMirror.lookupUs / pBridge->shadowMirror.lookups : 0,
+               pBridge->shadowMirror.maxLookupUs);
+    if(BRIDGE_SHADOW_EMULATOR == 1)
+    {
+        uint32_t versions = 0;
+        for(size_t i = 0; i < BRIDGE_THING_COUNT; i++)
+        {
+            versions += _shadowEmulator.shadows[i].version;
+        }
+        IotLogInfo("shadow emulator: %u versions over %d things, %u accepted, %u rejected, %u throttled, %u deltas, %u with an own token",
+                   versions,
+                   BRIDGE_THING_COUNT,
+                   _shadowEmulator.accepted,
+                   _shadowEmulator.rejected,
+                   _shadowEmulator.throttled,
+                   _shadowEmulator.deltas,
+                   _shadowEmulator.ownDeltas);
+    }
+    if(BRIDGE_MESH_SIMULATOR == 1)
+    {
+        IotLogInfo("mesh simulator: %u frames, late p50 %u ms p99 %u ms, %u commands, %u not acked, ack p50 %u ms p99 %u ms",
+                   _meshSimulator.framesSent,
+                   _latencyPercentileMs(&_meshSimulator.lateness, 50),
+                   _latencyPercentileMs(&_meshSimulator.lateness, 99),
+                   _meshSimulator.commandsReceived,
+                   _meshSimulator.commandsNotAcked,
+                   _latencyPercentileMs(&_meshSimulator.ackLatency, 50),
+                   _latencyPercentileMs(&_meshSimulator.ackLatency, 99));
+    }
+    IotLogInfo("tls: %u handshakes, %u ms total",
+               pBridge->connectStats.fullHandshakes,
+               pBridge->connectStats.totalHandshakeMs);
+
+#if ( configGENERATE_RUN_TIME_STATS == 1 ) && ( configUSE_TRACE_FACILITY == 1 )
+    pBridge->reportedTotalRunTime = totalRunTime;
+    free(pTaskStatus);
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * esp_timer starts counting when the chip boots, so the marks are ms since
+ * power-on or the last esp_restart()
+ */
+static bool _bootMark(BridgeContext_t *pBridge, BootMilestone_t milestone)
+{
+    if(pBridge->bootMs[milestone] != 0)
+    {
+        return false;
+    }
+
+    pBridge->bootMs[milestone] = (uint32_t)(esp_timer_get_time() / 1000);
+    if(pBridge->bootMs[milestone] == 0)
+    {
+        pBridge->bootMs[milestone] = 1;
+    }
+
+    IotLogInfo("boot: %s at %u ms", _bootMilestoneNames[milestone], pBridge->bootMs[milestone]);
+    return true;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief The function that runs the Shadow demo, called by the demo runner.
+ *
+ * @param[in] awsIotMqttMode Ignored for the Shadow demo.
+ * @param[in] pIdentifier NULL-terminated Shadow Thing Name.
+ * @param[in] pNetworkServerInfo Passed to the MQTT connect function when
+ * establishing the MQTT connection for Shadows.
+ * @param[in] pNetworkCredentialInfo Passed to the MQTT connect function when
+ * establishing the MQTT connection for Shadows.
+ * @param[in] pNetworkInterface The network interface to use for this demo.
+ *
+ * @return `EXIT_SUCCESS` if the demo completes successfully; `EXIT_FAILURE` otherwise.
+ */
+int RunShadowDemo(bool awsIotMqttMode,
+                  const char *pIdentifier,
+                  void *pNetworkServerInfo,
+                  void *pNetworkCredentialInfo,
+                  const IotNetworkInterface_t *pNetworkInterface)
+{
+
+
+    
+    /* State shared by the pipeline tasks. */
+    BridgeContext_t * pBridge = &_bridgeContext;
+
+    /** initialize the uart  */
+    uart_init();
+    _bootMark( pBridge, BOOT_UART_READY );
+
+    /* Return value of this function and the exit status of this program. */
+    int status = 0;
+
+    /* Handle of the MQTT connection used in this demo. */
+    IotMqttConnection_t mqttConnection = IOT_MQTT_CONNECTION_INITIALIZER;
+
+    /* Length of Shadow Thing Name. */
+    size_t thingNameLength = 0;
+
+    /* Flags for tracking which cleanup functions must be called. */
+    bool librariesInitialized = false, connectionEstablished = false;
+
+    /* The first parameter of this demo function is not used. Shadows are specific
+     * to AWS IoT, so this value is hardcoded to true whenever needed. */
+    (void)awsIotMqttMode;
+
+    /* Determine the length of the Thing Name. */
+    if (pIdentifier != NULL)
+    {
+        thingNameLength = strlen(pIdentifier);
+
+        IotLogInfo("thingNameLength is %d, Identifier %s",thingNameLength,pIdentifier);
+
+        if (thingNameLength == 0)
+        {
+            IotLogError("The length of the Thing Name (identifier) must be nonzero.");
+
+            status = EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        IotLogError("A Thing Name (identifier) must be provided for the Shadow demo.");
+
+        status = EXIT_FAILURE;
+    }
+
+    /* Initialize the libraries required for this demo. */
+    if (status == EXIT_SUCCESS)
+    {
         status = _initializeDemo();
     }
 
@@ -1114,45 +4795,91 @@ int RunShadowDemo(bool awsIotMqttMode,
     {
         /* Mark the libraries as initialized. */
         librariesInitialized = true;
+    }
+
+    if (status == EXIT_SUCCESS)
+    {
+        /* A resumed session may deliver deltas as soon as it is connected. */
+        status = _prepareBridge( pBridge,
+                                 pIdentifier,
+                                 thingNameLength );
+    }
+
+    if( status == EXIT_SUCCESS )
+    {
+        /* The uart side of the pipeline runs while the TLS handshake is in
+         * progress, the publisher waits for the connection. */
+        status = _startBridgePipeline( pBridge );
+    }
+
+    if( status == EXIT_SUCCESS )
+    {
+        _bootMark( pBridge, BOOT_PIPELINE_STARTED );
+    }
 
+    if( status == EXIT_SUCCESS && BRIDGE_SHADOW_EMULATOR == 1 )
+    {
+        /* The shadow is kept in process, nothing is connected. */
+        status = _shadowEmuStart( pBridge );
+    }
+    else if( status == EXIT_SUCCESS )
+    {
         /* Establish a new MQTT connection. */
         status = _establishMqttConnection(pIdentifier,
                                           pNetworkServerInfo,
                                           pNetworkCredentialInfo,
                                           pNetworkInterface,
+                                          pBridge,
                                           &mqttConnection);
     }
 
-    if (status == EXIT_SUCCESS)
+    if( status == EXIT_SUCCESS )
     {
         /* Mark the MQTT connection as established. */
-        connectionEstablished = true;
+        connectionEstablished = ( BRIDGE_SHADOW_EMULATOR == 0 );
 
-        /* Create the semaphore that synchronizes with the delta callback. */
-        deltaSemaphoreCreated = IotSemaphore_Create( &deltaSemaphore, 0, 1 );
+        pBridge->mqttConnection = mqttConnection;
+        xEventGroupSetBits( pBridge->readyEvents, BRIDGE_EVENT_CONNECTED );
+        _bootMark( pBridge, BOOT_CONNECTED );
+    }
 
-        if( deltaSemaphoreCreated == false )
-        {
-            status = EXIT_FAILURE;
-        }
+    if( status == EXIT_SUCCESS && BRIDGE_SHADOW_EMULATOR == 0 )
+    {
+        /* Set the Shadow callbacks for this demo. */
+        status = _setShadowCallbacks( pBridge,
+                                      mqttConnection );
     }
 
     if( status == EXIT_SUCCESS )
     {
-        /* Set the Shadow callbacks for this demo. */
-        status = _setShadowCallbacks( &deltaSemaphore,
-                                      mqttConnection,
-                                      pIdentifier,
-                                      thingNameLength );
+        _bootMark( pBridge, BOOT_SUBSCRIBED );
+
+        /* Deltas are already subscribed, so nothing changed after the get
+         * is missed. A failed sync only leaves the mesh waiting for deltas. */
+        int syncStatus = EXIT_SUCCESS;
+        for( size_t i = 0; i < BRIDGE_THING_COUNT; i++ )
+        {
+            if( _mirrorBootstrap( pBridge, &pBridge->things[ i ] ) != EXIT_SUCCESS )
+            {
+                syncStatus = EXIT_FAILURE;
+            }
+#if ( BRIDGE_BOOT_SYNC == 1 )
+            else if( _bootSync( pBridge, &pBridge->things[ i ] ) != EXIT_SUCCESS )
+            {
+                syncStatus = EXIT_FAILURE;
+            }
+#endif
+        }
+        if( syncStatus == EXIT_SUCCESS && BRIDGE_BOOT_SYNC == 1 )
+        {
+            _bootMark( pBridge, BOOT_SYNCED );
+        }
     }
 
     if(status == EXIT_SUCCESS)
     {
         IotLogInfo("free heap size is %d bytes ",xPortGetFreeHeapSize());
-        status = _thingShadowOperation( &deltaSemaphore,
-                                        mqttConnection,
-                                        pIdentifier,
-                                        thingNameLength);
+        status = _thingShadowOperation( pBridge );
     }
     
     /* Disconnect the MQTT connection if it was established. */
@@ -1162,15 +4889,13 @@ int RunShadowDemo(bool awsIotMqttMode,
         IotMqtt_Disconnect(mqttConnection, 0);
     }
 
+    /* The MQTT library does not own the network connection, close it here. */
+    _closeNetworkConnection(pBridge);
+
     /* Clean up libraries if they were initialized. */
     if (librariesInitialized == true)
     {
         _cleanupDemo();
     }
-    /* Destroy the delta semaphore if it was created. */
-    if( deltaSemaphoreCreated == true )
-    {
-        IotSemaphore_Destroy( &deltaSemaphore );
-    }
     return status;
 }
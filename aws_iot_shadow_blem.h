@@ -10,33 +10,37 @@
 /*Uart headers */
 #include "FreeRTOS.h"
 #include "task.h"
+#include "queue.h"
+#include "event_groups.h"
+#include "semphr.h"
 #include "driver/uart.h"
 
 //TODO 编写各种更新操作的种类类型，比如添加设备需要增加3级section，update的时候就需要构建适当的json文件
 typedef enum UPDATE_OPERATION{
+    QUERY_DESIRED_STATE=3,//a rebooted node asks for its desired state
     LOCALLY_CHANGE_ENDPOINT_STATE=2,
     CLOULD_CHANGE_ENDPOINT_STATE=1,
     UNKNOWN_OP=0
 }UpdateOperation_t;
 
+/* device types and attributes are listed in aws_iot_shadow_schema.def */
 typedef enum DEVICE_TYPE{
-    LIGHT=1,
-    SWITCH=2,
-    LOCK=3,
+#define SCHEMA_DEVICE(device, value, name) device = value,
+#include "aws_iot_shadow_schema.def"
     UNKNOWN_TYPE=0
 }Device_t;
 
 typedef enum ATTRIBUTE_TYPE{
-    ON_OFF =1,
-    LOCK_UNLOCK=2,
-    POWER_LEVEL=3,
-    TEMPERATURE=4,
+#define SCHEMA_ATTRIBUTE(attribute, value, name) attribute = value,
+#include "aws_iot_shadow_schema.def"
     UNKNOWN_ATT=0
 }Attribute_t;
 /**
 * |----1--------|------10----|--------20------|--------10-------|
 * |  operation  |device type | attribute name | attribute value | 
 * the length of each block should be showed as above   
+* a block shorter than its length ends with 'x' (or '\0'), the rest of the
+* block is padding
 */
 typedef enum Data{
     operationTypeLength =1,
@@ -44,19 +48,402 @@ typedef enum Data{
     attributeNameLength =20,
     attributeValueLength = 10
 }DataLength_t;
+
+/**
+ * a uart frame with every block filled up, the mesh sends packets of this size
+ * back to back
+ */
+#define BRIDGE_FRAME_SIZE (operationTypeLength + deviceNameLength + attributeNameLength + attributeValueLength)
+/**
+ * priority classes of the traffic in both directions, lower value is served
+ * first. Lock commands must not wait behind sensor chatter.
+ */
+typedef enum TrafficClass{
+    CLASS_SECURITY = 0,//Lock
+    CLASS_CONTROL,//switching lights and switches
+    CLASS_TELEMETRY,//power level, temperature
+    CLASS_COUNT
+}TrafficClass_t;
+
+/**
+ * kinds of attribute values, they decide how a value is parsed from the
+ * uart frame and written into the shadow document
+ */
+typedef enum ValueType{
+    VALUE_ENUM = 0,//one of the choices of the schema, "ON"
+    VALUE_NUMBER//fixed point number with the decimals of the schema, 3000
+}ValueType_t;
+
+/**
+ * an attribute value, parsed once at the uart frame and kept in binary form
+ * until it is written into a shadow document
+ */
+typedef struct AttributeValue{
+    ValueType_t type;
+    int32_t value;//index of the choice, or the number * 10^decimals
+}AttributeValue_t;
+
+/**
+ * longest text of a number, sign, 10 digits, point and '\0'
+ */
+#define BRIDGE_NUMBER_TEXT_MAX (14)
+
+/**
+ * number of things the gateway serves over its one mqtt connection. Thing 0
+ * is the thing name the demo is started with, thing n is "<thing name>-n".
+ */
+#define BRIDGE_THING_COUNT (1)
+
+//the index has to fit the device block of a frame, "Thermo:99"
+_Static_assert(BRIDGE_THING_COUNT >= 1 && BRIDGE_THING_COUNT <= 100, "1 to 100 things");
+
+/**
+ * a packet received from local, decoded once on the uart core and then
+ * handed over to the shadow publisher
+ */
+typedef struct BridgeFrame{
+    uint8_t thing;//index in the thing registry, "Lights:2" in the device block, 0 without
+    UpdateOperation_t operation;
+    Device_t deviceType;
+    Attribute_t attributeType;
+    AttributeValue_t value;
+    uint32_t receivedUs;//esp timer time when the packet was read from uart
+}BridgeFrame_t;
+
+/**
+ * maximum number of frames merged into one shadow update
+ */
+#define BRIDGE_BATCH_MAX (8)
+
+/**
+ * frames published with one shadow update, only the last value of each
+ * device attribute is kept
+ */
+typedef struct FrameBatch{
+    BridgeFrame_t frames[BRIDGE_BATCH_MAX];
+    uint32_t count;
+}FrameBatch_t;
+
+/* RateLimiter_t and its functions are in aws_iot_shadow_limiter.h */
+#include "aws_iot_shadow_limiter.h"
+
+/* SpscRing_t and its functions are in aws_iot_shadow_ring.h */
+#include "aws_iot_shadow_ring.h"
+
 /**
- * the Light default data
+ * size of one delta mailbox slot, deltas longer than this are dropped
  */
-typedef enum LightDefaultData{
+#define BRIDGE_DELTA_SLOT_SIZE (1024)
 
-    D_Brightness = 55,
-    D_Temperature = 3000,
-    //color defination
-    D_Hue = 300,
-    D_Saturation = 1,
-    D_Cbrightness = 1//color brightness
+typedef enum DeltaSlotState{
+    SLOT_FREE = 0,
+    SLOT_FILLING,
+    SLOT_READY,
+    SLOT_DRAINING
+}DeltaSlotState_t;
 
-}LightDefaultData_t;
+/**
+ * what a slot carries. Only deltas go through the shadow mirror, the echo
+ * filter and the collapser, the others are written to the mesh at once.
+ */
+typedef enum DeltaSlotKind{
+    SLOT_KIND_DELTA = 0,
+    SLOT_KIND_RULE,//a command of a local rule
+    SLOT_KIND_ANSWER//the answer to the query of a mesh node
+}DeltaSlotKind_t;
+
+/**
+ * one delta document copied out of the mqtt receive buffer
+ */
+typedef struct DeltaSlot{
+    uint32_t state;//DeltaSlotState_t, changed with atomics only
+    uint32_t sequence;//order in which the slots became ready
+    uint8_t thing;//the thing whose shadow sent the delta
+    DeltaSlotKind_t kind;
+    bool classified;//trafficClass was set by the consumer
+    TrafficClass_t trafficClass;
+    uint32_t receivedUs;
+    size_t documentLength;
+    char document[BRIDGE_DELTA_SLOT_SIZE];
+}DeltaSlot_t;
+
+/**
+ * bounded mailbox from the shadow callbacks to the mesh tx task. Shadow
+ * callbacks run on the mqtt task pool, which may have several workers, so
+ * unlike SpscRing_t the mailbox accepts many producers: a producer claims a
+ * free slot with a compare and swap, so posting never blocks or locks.
+ * There is a single consumer.
+ */
+typedef struct DeltaMailbox{
+    DeltaSlot_t *pSlots;
+    uint32_t slotCount;
+    uint32_t nextSequence;
+    uint32_t overflowCount;//no free slot
+    uint32_t oversizedCount;//document longer than BRIDGE_DELTA_SLOT_SIZE
+    bool resync;//a delta was dropped, the mesh tx task diffs the mirror once the mailbox is empty
+    uint32_t resyncCount;
+    uint32_t passedOver[CLASS_COUNT];//consumer only, see _selectLane
+    TaskHandle_t consumer;
+}DeltaMailbox_t;
+
+/**
+ * one SpscRing_t per traffic class between the same producer and consumer
+ */
+typedef struct PriorityLanes{
+    SpscRing_t lanes[CLASS_COUNT];
+    uint32_t passedOver[CLASS_COUNT];//consumer only, see _selectLane
+}PriorityLanes_t;
+
+/**
+ * number of buckets of a latency histogram, bucket i counts latencies
+ * below 2^i ms and the last bucket everything above
+ */
+#define BRIDGE_LATENCY_BUCKETS (16)
+
+/**
+ * latency histogram, written by one task only
+ */
+typedef struct LatencyHistogram{
+    uint32_t buckets[BRIDGE_LATENCY_BUCKETS];
+}LatencyHistogram_t;
+
+/**
+ * stages of the bridge pipeline, the uart stages run on one core and the
+ * mqtt/shadow stages on the other
+ */
+typedef enum BridgeStage{
+    STAGE_UART_INGRESS = 0,
+    STAGE_MESH_TX,
+    STAGE_SHADOW_PUBLISH,
+    STAGE_SHADOW_DELTA,
+    STAGE_COUNT
+}BridgeStage_t;
+
+/**
+ * time spent by one pipeline stage. busyUs and items are only written by the
+ * task running the stage, the reported* snapshots only by the stats reporter
+ */
+typedef struct StageStats{
+    const char *pName;
+    TaskHandle_t task;//NULL if the stage runs on a task not owned by the bridge
+    volatile uint32_t busyUs;
+    volatile uint32_t items;
+    volatile uint32_t maxItemUs;
+    uint32_t reportedBusyUs;
+    uint32_t reportedItems;
+    uint32_t reportedRunTime;
+}StageStats_t;
+
+/**
+ * size of the shadow delta topic buffer, 128 is the longest thing name AWS IoT accepts
+ */
+#define BRIDGE_DELTA_TOPIC_SIZE (sizeof("$aws/things/") + 128 + sizeof("/shadow/update/delta"))
+
+/**
+ * subscription state of the previous mqtt session. It is kept in rtc memory,
+ * which survives esp_restart() but not a power cycle, so after a restart the
+ * bridge knows the broker probably still holds its delta subscription.
+ */
+typedef struct SessionCache{
+    uint32_t magic;
+    uint32_t thingNameHash;
+    uint32_t thingCount;//the delta topics of this many things are subscribed
+    uint32_t deltaSubscribed;
+}SessionCache_t;
+
+/**
+ * points of the start-up sequence, in the order they are normally reached
+ */
+typedef enum BootMilestone{
+    BOOT_UART_READY = 0,
+    BOOT_PIPELINE_STARTED,
+    BOOT_CONNECTED,
+    BOOT_SUBSCRIBED,
+    BOOT_SYNCED,
+    BOOT_FIRST_COMMAND,
+    BOOT_MILESTONE_COUNT
+}BootMilestone_t;
+
+/**
+ * bits of BridgeContext_t.readyEvents
+ */
+#define BRIDGE_EVENT_CONNECTED (1 << 0)
+
+/**
+ * cost of getting the tls connection up, every connect attempt pays a full
+ * handshake. Session resumption belongs to the network layer, which does not
+ * offer it.
+ */
+typedef struct ConnectStats{
+    uint32_t fullHandshakes;
+    uint32_t lastHandshakeMs;
+    uint32_t totalHandshakeMs;
+}ConnectStats_t;
+
+/**
+ * index of every device attribute in the shadow schema, the attributes the
+ * bridge knows
+ */
+typedef enum SchemaIndex{
+#define SCHEMA_FIELD(device, attribute, ...) SCHEMA_##device##_##attribute,
+#include "aws_iot_shadow_schema.def"
+    BRIDGE_SCHEMA_ATTRIBUTE_COUNT
+}SchemaIndex_t;
+
+/**
+ * longest json value of a single attribute kept by the delta collapser
+ */
+#define BRIDGE_COMMAND_VALUE_SIZE (32)
+
+/**
+ * latest pending value of every known attribute of every thing on the way to
+ * the mesh. Deltas overwrite the pending values, one command per thing with
+ * all of them is released when the mesh acked the previous one or the
+ * cadence elapsed.
+ */
+typedef struct DeltaCollapser{
+    char values[BRIDGE_THING_COUNT][BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    uint8_t valueLengths[BRIDGE_THING_COUNT][BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    bool pending[BRIDGE_THING_COUNT][BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    uint32_t receivedUs[BRIDGE_THING_COUNT][BRIDGE_SCHEMA_ATTRIBUTE_COUNT];//oldest delta behind the pending value
+    uint32_t versions[BRIDGE_THING_COUNT][BRIDGE_SCHEMA_ATTRIBUTE_COUNT];//shadow version of the value pending or last written
+    bool awaitingAck;
+    bool acked;//set by uart ingress when the mesh reports a cloud change
+    uint64_t lastReleaseMs;
+    uint32_t collapsedCount;
+    uint32_t releasedCount;
+    uint32_t rawCount;
+    uint32_t staleCount;//values of a delta older than the pending or written one, dropped
+    uint32_t groupFrames;//multicast commands written for groups and scenes
+    uint32_t uartBytes;//written to the mesh
+}DeltaCollapser_t;
+
+/**
+ * number of own shadow updates remembered for echo suppression
+ */
+#define BRIDGE_ECHO_ENTRIES (8)
+
+/**
+ * client token of an own shadow update and the desired values it wrote, as
+ * json text. version is odd while the publisher rewrites the entry.
+ */
+typedef struct EchoEntry{
+    uint32_t version;
+    uint32_t publishedMs;
+    uint8_t thing;
+    uint8_t tokenLength;
+    char token[14];//json value of the token, quotes included
+    uint8_t valueLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];//0 if the attribute was not written
+    char values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_NUMBER_TEXT_MAX];
+}EchoEntry_t;
+
+/**
+ * recent own updates, written by the shadow publisher and read by mesh tx
+ */
+typedef struct EchoFilter{
+    EchoEntry_t entries[BRIDGE_ECHO_ENTRIES];
+    uint32_t next;
+    uint32_t suppressedCount;
+}EchoFilter_t;
+
+/**
+ * desired and reported state of a thing as last seen by the gateway. A value
+ * length of 0 means the attribute is not in the section.
+ */
+typedef struct MirroredShadow{
+    char desired[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    uint8_t desiredLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    char reported[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    uint8_t reportedLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    uint32_t version;//last version the shadow service sent, 0 before
+    bool bootstrapped;//the whole shadow was got once
+}MirroredShadow_t;
+
+/**
+ * local copy of the shadows of all things. It is bootstrapped with one get per
+ * thing and then kept current by the updated documents of the shadows. Deltas
+ * and the own updates the service accepted are patched in as soon as they are
+ * seen, so reading the state needs no round trip.
+ */
+typedef struct ShadowMirror{
+    SemaphoreHandle_t lock;
+    MirroredShadow_t shadows[BRIDGE_THING_COUNT];
+    uint32_t gets;//shadow gets sent, only to bootstrap
+    uint32_t deltasApplied;
+    uint32_t staleDeltas;//older than the mirrored version, not applied
+    uint32_t updatesApplied;
+    uint32_t documentsApplied;
+    uint32_t staleDocuments;
+    uint32_t lookups;
+    uint32_t lookupUs;//total time spent reading, lock included
+    uint32_t maxLookupUs;
+}ShadowMirror_t;
+
+/**
+ * offset of the thing name in its delta topic
+ */
+#define BRIDGE_THING_NAME_OFFSET (sizeof("$aws/things/") - 1)
+
+/**
+ * a thing served by the gateway, its name is kept inside its delta topic
+ */
+typedef struct Thing{
+    struct BridgeContext *pBridge;
+    const char *pName;//points into deltaTopic, not terminated
+    uint8_t nameLength;
+    uint8_t index;
+    bool deltaSubscribed;//the delta topic was subscribed in this session, the resumed subscription stands down
+    char deltaTopic[BRIDGE_DELTA_TOPIC_SIZE];
+}Thing_t;
+
+/**
+ * number of rule commands whose ack from the mesh is awaited
+ */
+#define BRIDGE_RULE_RESULTS (8)
+
+/**
+ * value a rule command set, reported to the shadow once the mesh acks it
+ */
+typedef struct RuleResult{
+    BridgeFrame_t frame;
+    uint32_t postedMs;
+    bool pending;
+}RuleResult_t;
+
+/**
+ * everything the pipeline tasks share, lives as long as the tasks do
+ */
+typedef struct BridgeContext{
+    IotMqttConnection_t mqttConnection;
+    const IotNetworkInterface_t *pNetworkInterface;
+    void *pNetworkConnection;//owned by the bridge, not by the mqtt connection
+    ConnectStats_t connectStats;
+    Thing_t things[BRIDGE_THING_COUNT];//the thing registry
+    bool sessionResumed;//the delta subscriptions of the previous session were handed to the mqtt library
+    uint64_t connectStartMs;
+    EventGroupHandle_t readyEvents;//lets the pipeline start before the connection is up
+    uint32_t bootMs[BOOT_MILESTONE_COUNT];//ms since power-on, 0 while not reached
+    PriorityLanes_t frameLanes;//uart ingress -> shadow publisher
+    RateLimiter_t rateLimiters[BRIDGE_THING_COUNT];//AWS IoT throttles the updates of each thing
+    DeltaMailbox_t deltaMailbox;//shadow delta callback -> mesh tx
+    DeltaCollapser_t deltaCollapser;//owned by mesh tx
+    EchoFilter_t echoFilter;//shadow publisher -> mesh tx
+    ShadowMirror_t shadowMirror;//patched by mesh tx and shadow publisher
+    StageStats_t stats[STAGE_COUNT];
+    LatencyHistogram_t uplinkLatency[CLASS_COUNT];//uart read -> shadow updated
+    LatencyHistogram_t downlinkLatency[CLASS_COUNT];//delta received -> written to uart
+    LatencyHistogram_t groupLatency;//delta received -> last group of it written to uart
+    LatencyHistogram_t queryLatency;//query read from uart -> answer written to uart
+    uint32_t queriesAnswered;
+    uint32_t queriesUnanswered;//unknown device, nothing desired or no mirror yet
+    LatencyHistogram_t ruleLatency;//trigger read from uart -> rule command written to uart
+    uint32_t rulesFired;
+    uint32_t rulesSkipped;//the value of the trigger has no counterpart in the target
+    RuleResult_t ruleResults[BRIDGE_RULE_RESULTS];//uart ingress only
+    uint32_t ruleResultsAcked;
+    uint32_t ruleResultsLost;//not acked in time, not reported
+    uint32_t reportedTotalRunTime;
+}BridgeContext_t;
 
 /*get specific value in the shadow document
     the maximum nested layers for the shadow document is 4
@@ -131,38 +518,34 @@ static Device_t analysisDeviceType(uint8_t* data);
 static Attribute_t analysisAttribute(uint8_t* data);
 
 
-/**
- * generate a control shadow document to send
- * param devcieType  the device type found 
- * param attributeType the attribute type found
- * param stateValue the value that to be updated
- */
-static char * generateControlShadowDocument(UpdateOperation_t operation,
-                                            Device_t deviceType, 
-                                            Attribute_t attributeType,
-                                            char* stateValue
-                                            );
-
-
 /**
  * update the thing shadow document 
  * param pUpdateDocument the shadow document to update
  * param mqttConnection mqtt connection to use
- * param pThingName the thing on IoT console to update
- * param thingNameLength thing name length
+ * param pThing the thing on IoT console to update
  * return please reference the type def of AwsIotShadowError_t
  */
 static AwsIotShadowError_t wrapUpdateThingShadow( char *pUpdateDocument,
                                IotMqttConnection_t mqttConnection,
-                               const char * const pThingName,
-                               size_t thingNameLength );
+                               const Thing_t *pThing );
 /**
  * get attribute value from the packet received from local
  * param data packet from local
+ * param length number of bytes received, the value block may be cut short
+ * param deviceType the device type
  * param attributeType the attribute type
- * return attribute value 
+ * param pValue [out] the parsed value
+ * return false if the schema does not accept the value
  *  */                             
-static char* _getAttributeValue(Attribute_t attributeType, uint8_t *data);
+static bool _getAttributeValue(Device_t deviceType, Attribute_t attributeType, const uint8_t *data, size_t length, AttributeValue_t *pValue);
+
+/**
+ * length of the text in a block of the packet, up to the 'x' that ends it
+ * param pBlock first byte of the block
+ * param blockLength length of the block
+ * return the length of the text, blockLength when it is not terminated
+ */
+static size_t _blockTextLength(const uint8_t *pBlock, size_t blockLength);
 /**
  * get device name from the packet received from local
  * param data packet from local
@@ -177,15 +560,6 @@ static char* _getAttributeValue(Attribute_t attributeType, uint8_t *data);
  *  */       
 // static char* getAttributeNameFromPacket(uint8_t* data);
 
-/**
- * report the local changes to IoT console, this function
- */
-static int reportLocalChange(   uint32_t length,    
-                                IotMqttConnection_t mqttConnection,
-                                const char * pThingName,
-                                size_t thingNameLength,
-                                int status);
-
 static int retriveCloudCommand( IotMqttConnection_t mqttConnection,
                                 AwsIotShadowDocumentInfo_t getInfo,
                                 AwsIotShadowOperation_t getOperation,
@@ -193,185 +567,796 @@ static int retriveCloudCommand( IotMqttConnection_t mqttConnection,
 
 /**
  * write value to the uart port 
- * @param command  the value to be written into uart port
+ * @param thing  the thing the command is for, a command for thing n > 0 is
+ *               written as {"thing":n,...}
+ * @param command  the value to be written into uart port, a json object
+ * @return number of bytes written, newline included, 0 on failure
  *  */
-static void _write_command_into_uart(const char* command, size_t commandLength);
+static size_t _write_command_into_uart(uint8_t thing, const char* command, size_t commandLength);
 
-/********************Json document templates *****************************/
+/********************Shadow schema *****************************/
 
 /**
- * @brief Format string representing a Shadow document with a "desired" state.
- *
- * Note the client token, which is required for all Shadow updates. The client
- * token must be unique at any given time, but may be reused once the update is
- * completed. For this demo, a timestamp is used for a client token.
+ * longest shadow keys of the schema, they bound the size of a document
  */
+#define SHADOW_DEVICE_KEY_MAX (16)
+#define SHADOW_ATTRIBUTE_KEY_MAX (32)
 
-#define SHADOW_DESIRED_JSON                                             \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"desired\": {"                                             \
-               "\"Lights%s\" :{"                                        \
-                  "\"thing name\" : \"sample-light\","                  \
-                    "\"device info\":\"000\","                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"brightness\":\"%s\","                            \
-                    "\"value\" :  {\"value\": \"%s\" },"                \
-                    "\"property1\" : {\"default property1\": 0 },"      \
-                    "\"colorTemperatureInKelvin\" : \"%s\""             \
-                    "},"                                                \
-                "\"Switch\":{"                                          \
-                    "\"Switch value\": \"%s\""                          \
-                "},"                                                    \
-                "\"Lock\":{"                                            \
-                    "\"Lock value\": \"%s\""                            \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
-    
-#define SHADOW_DESIRED_JSON_SIZE (sizeof(SHADOW_DESIRED_JSON) - 3)
-/**
- * @brief Format string representing a Shadow document with a "reported" state.
- *
- * Note the client token, which is required for all Shadow updates. The client
- * token must be unique at any given time, but may be reused once the update is
- * completed. For this demo, a timestamp is used for a client token.
- */
-#define SHADOW_REPORTED_JSON                                            \
-    "{"                                                                 \
-        "\"state\": { "                                                 \
-            "\"reported\": {"                                           \
-                "\"Lights\" :{ "                                        \
-                    "\"thing name\" : \"sample-light\","                \
-                    "\"device info\":\"000\","                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"brightness\":\"%s\","                            \
-                    "\"value\" :  {\"value\": \"%s\" },"                \
-                    "\"property1\" : {\"default property1\": \"%s\" }," \
-                    "\"colorTemperatureInKelvin\" : \"%s\""             \
-                "},"                                                    \
-                "\"Switch\":{"                                          \
-                    "\"Switch value\": \"%s\""                          \
-                "},"                                                    \
-                "\"Lock\":{"                                            \
-                     "\"Lock value\":\"%s\""                            \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+/**
+ * most accepted values of a string attribute
+ */
+#define SCHEMA_CHOICES_MAX (4)
 
-     
-#define SHADOW_REPORTED_JSON_SIZE (sizeof(SHADOW_REPORTED_JSON) - 3)
+/**
+ * a device attribute as the mesh and the shadow know it. The schema tables
+ * are const, so they stay in flash together with their strings. Entries of
+ * one device are next to each other.
+ */
+typedef struct SchemaAttribute{
+    Device_t device;
+    Attribute_t attribute;
+    const char *pDevice;//shadow key of the device
+    const char *pAttribute;//shadow key of the attribute
+    ValueType_t valueType;
+    TrafficClass_t trafficClass;
+    const char *pChoices[SCHEMA_CHOICES_MAX];//accepted values of an enum
+    int32_t minimum;//accepted range of a number, * 10^decimals
+    int32_t maximum;
+    uint8_t decimals;
+}SchemaAttribute_t;
+
+/**
+ * names the mesh uses for device types and attributes in the uart frames
+ */
+typedef struct DeviceName{
+    Device_t device;
+    const char *pName;
+}DeviceName_t;
 
+typedef struct AttributeName{
+    Attribute_t attribute;
+    const char *pName;
+}AttributeName_t;
 
-/** Update light desired status JSON 
- * The shadow document will only update the part listed and leave the rest
- * untouched
+/**
+ * index of the device attribute in the schema, -1 if it is not in there
  */
-#define SHADOW_DESIRED_LIGHT_JSON                                       \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"desired\": {"                                             \
-               "\"Lights\" :{"                                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"colorTemperatureInKelvin\" : %d "                \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+static int _schemaIndex(Device_t deviceType, Attribute_t attributeType);
 
-#define SHADOW_DESIRED_LIGHT_SIZE     (sizeof(SHADOW_DESIRED_LIGHT_JSON))
+/**
+ * write a shadow document with the given values, only the attributes that
+ * have a value are written
+ * param values value of each schema attribute as received from the mesh, NULL if absent
+ * param desired write the values into desired as well as reported
+ * return length of the document, 0 if it does not fit
+ */
+static int _encodeShadowDocument(const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                 bool desired,
+                                 char *pUpdateDocument,
+                                 size_t documentSize);
 
-/** Update light reported status JSON 
- * The shadow document will only update the part listed and leave the rest
- * untouched
+/**
+ * write a number as json, without printf
+ * param pText [out] at least BRIDGE_NUMBER_TEXT_MAX bytes
+ * return length of the text
  */
-#define SHADOW_LIGHT_JSON                                               \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"desired\": {"                                             \
-               "\"Lights\" :{"                                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"colorTemperatureInKelvin\" : %d"                 \
-                "}"                                                     \
-            "},"                                                        \
-           "\"reported\": {"                                            \
-               "\"Lights\" :{"                                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"colorTemperatureInKelvin\" : %d"                 \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+static size_t _formatNumber(int32_t value, uint8_t decimals, char *pText);
 
-#define SHADOW_LIGHT_JSON_SIZE     (sizeof(SHADOW_LIGHT_JSON))
-/** Update light reported status JSON 
- * The shadow document will only update the part listed and leave the rest
- * untouched
+/********************Encode arena *****************************/
+
+/** large enough for every schema attribute in both desired and reported */
+#define SHADOW_UPDATE_DOCUMENT_SIZE  (2 * BRIDGE_SCHEMA_ATTRIBUTE_COUNT * \
+                                      (SHADOW_DEVICE_KEY_MAX + SHADOW_ATTRIBUTE_KEY_MAX + BRIDGE_NUMBER_TEXT_MAX + 12) + 64)
+
+/**
+ * Scratch buffers of the encode path. Every task that decodes packets or
+ * generates shadow documents owns exactly one arena and passes it down, so
+ * no function on the encode path keeps state in static storage and several
+ * tasks can run it at the same time.
  */
-#define SHADOW_REPORTED_LIGHT_JSON                                      \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"reported\": {"                                            \
-               "\"Lights\" :{"                                          \
-                    "\"ON_OFF\":\"%s\","                                \
-                    "\"colorTemperatureInKelvin\" : %d"                 \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+typedef struct EncodeArena{
+    char updateDocument[SHADOW_UPDATE_DOCUMENT_SIZE];
+}EncodeArena_t;
+
+/**
+ * report the local changes to IoT console, this function
+ * param pBatch the decoded packets to report, those of pThing go into one update
+ * param pThing the thing whose shadow is updated
+ * param pArena encode arena owned by the calling task
+ * param pEchoFilter remembers the update so its deltas are not sent back
+ * return the result of the shadow update, AWS_IOT_SHADOW_BAD_PARAMETER if
+ * there was nothing to report and no update was sent
+ */
+static AwsIotShadowError_t reportLocalChange(   const FrameBatch_t *pBatch,    
+                                                IotMqttConnection_t mqttConnection,
+                                                const Thing_t *pThing,
+                                                EncodeArena_t *pArena,
+                                                EchoFilter_t *pEchoFilter);
 
-#define SHADOW_REPORTED_LIGHT_SIZE     (sizeof(SHADOW_REPORTED_LIGHT_JSON))
+/**
+ * generate one shadow document for the frames of one thing in a batch
+ * return length of the generated document, 0 if nothing was generated
+ */
+static int generateBatchShadowDocument( const FrameBatch_t *pBatch,
+                                        uint8_t thing,
+                                        char* pUpdateDocument,
+                                        size_t documentSize);
 
-/** Update switch status JSON */
-#define SHADOW_REPORTED_SWITCH_JSON                                     \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"reported\": {"                                            \
-               "\"Switch\" :{"                                          \
-                    "\"Switch value\":\"%s\","                          \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+/**
+ * drop the frames of one thing from a batch once they are published
+ */
+static void _batchRemoveThing(FrameBatch_t *pBatch, uint8_t thing);
 
-#define SHADOW_REPORTED_SWITCH_SIZE     (sizeof(SHADOW_DESIRED_SWITCH_JSON))
+/**
+ * merge a frame into a batch, replacing an earlier value of the same device
+ * attribute of the same thing
+ * return false if the batch is full or the frame has no shadow field
+ */
+static bool _batchAdd(FrameBatch_t *pBatch, const BridgeFrame_t *pFrame);
 
-/** Update lock status JSON */
-#define SHADOW_REPORTED_LOCK_JSON                                       \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"reported\": {"                                            \
-               "\"Lock\" :{"                                            \
-                    "\"Lock value\":\"%s\","                            \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+/********************Rate limiter *****************************/
 
-#define SHADOW_REPORTED_LOCK_SIZE     (sizeof(SHADOW_DESIRED_LOCK_JSON))
+/**
+ * move frames waiting in the lanes into a batch until it is full, counting
+ * them as batched in the limiter of their thing
+ */
+static void _drainIntoBatch(PriorityLanes_t *pLanes, FrameBatch_t *pBatch, RateLimiter_t pLimiters[BRIDGE_THING_COUNT]);
 
+/**
+ * pick the next thing of the batch that gets a token, starting at firstThing
+ * param pWaitMs [out] ms until the first token if no thing got one
+ * return index of the thing, or -1 if none got a token
+ */
+static int _batchTakeThing(const FrameBatch_t *pBatch, RateLimiter_t pLimiters[BRIDGE_THING_COUNT],
+                           uint8_t firstThing, uint32_t *pWaitMs);
 
+/********************Persistent session *****************************/
 
+/**
+ * true if the previous session of this gateway subscribed to the delta topics
+ * of all its things and the gateway was restarted by software since then
+ */
+static bool _sessionCacheValid(const char *pThingName, size_t thingNameLength);
 
-#define DESIRED_ADD_DEVICE_STRING_ATTRIBUTE_JSON                        \
-   "{"                                                                  \
-       "\"state\":{"                                                    \
-           "\"desired\": {"                                             \
-               "\"%s\" :{"                                              \
-                    "\"%s\":\"%s\","                                    \
-                "}"                                                     \
-            "}"                                                         \
-        "},"                                                            \
-        "\"clientToken\":\"%06lu\""                                     \
-    "}"                                                                 \
+/**
+ * remember that the broker holds the delta subscriptions of the things
+ */
+static void _sessionCacheStore(const char *pThingName, size_t thingNameLength);
+
+/**
+ * forget the cached subscription state
+ */
+static void _sessionCacheClear(void);
+
+/********************Boot sync *****************************/
+
+/**
+ * json value of each known attribute, pValue is NULL when it is absent
+ */
+typedef struct SyncValue{
+    const char *pValue;
+    size_t length;
+}SyncValue_t;
+
+/**
+ * write the present values as a delta document, {"state":{"Lights":{...}}}
+ * return the length, or commandSize when it does not fit
+ */
+static size_t _writeStateCommand(const SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                 char *pCommand, size_t commandSize);
+
+/**
+ * write every attribute of a thing whose desired value differs from the
+ * reported one into a single command, as read from the shadow mirror
+ * param pShadow [out] the snapshot the command was written from
+ * param pLength [out] length of the command, commandSize when it does not fit
+ * return number of attributes out of sync
+ */
+static uint32_t _mirrorDiff(ShadowMirror_t *pMirror, uint8_t thing, MirroredShadow_t *pShadow,
+                            char *pCommand, size_t commandSize, size_t *pLength);
+
+/**
+ * post the diff of a thing to the mesh. The shadow mirror has to be
+ * bootstrapped first.
+ */
+static int _bootSync(BridgeContext_t *pBridge, const Thing_t *pThing);
+
+/********************Shadow mirror *****************************/
+
+/**
+ * create the lock of the mirror
+ * return false if it could not be created
+ */
+static bool _mirrorInit(ShadowMirror_t *pMirror);
+
+/**
+ * get the whole shadow of a thing once and keep it in the mirror. A version
+ * older than what deltas already brought in is not taken.
+ * return EXIT_SUCCESS if the shadow was got or does not exist yet
+ */
+static int _mirrorBootstrap(BridgeContext_t *pBridge, const Thing_t *pThing);
+
+/**
+ * patch the desired state of a thing with a delta document, a delta without a
+ * version is applied as well
+ */
+static void _mirrorApplyDelta(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength);
+
+/**
+ * replace the desired and reported state of a thing with the current state of
+ * an updated document, unless the mirror holds a newer version
+ */
+static void _mirrorApplyDocuments(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength);
+
+/**
+ * patch the desired and reported state of a thing with an own update
+ * document the shadow service accepted
+ */
+static void _mirrorApplyUpdate(ShadowMirror_t *pMirror, uint8_t thing, const char *pDocument, size_t documentLength);
 
-#define DESIRED_ADD_DEVICE_STRING_ATTRIBUTE_SIZE     (sizeof(DESIRED_ADD_DEVICE_STRING_ATTRIBUTE_JSON))
\ No newline at end of file
+/**
+ * copy the mirrored shadow of a thing
+ */
+static void _mirrorSnapshot(ShadowMirror_t *pMirror, uint8_t thing, MirroredShadow_t *pShadow);
+
+/**
+ * merge a desired or reported section of a document into the values of the
+ * known attributes, null removes an attribute
+ * return false if a value is too long to be kept
+ */
+static bool _mergeSection(char values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE],
+                          uint8_t lengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                          const char *pSection, size_t sectionLength);
+
+/**
+ * the "version" of a shadow document, 0 if it has none
+ */
+static uint32_t _documentVersion(const char *pDocument, size_t documentLength);
+
+/********************Delta collapsing *****************************/
+
+/**
+ * find the known attributes in a state object, {"Lights":{"ON_OFF":..},..}
+ * a valid "groups" member is left to _fanOutGroups
+ * return false if the object has members that are not known attributes
+ */
+static bool _parseStateAttributes(const char *pState, size_t stateLength,
+                                  SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT]);
+
+/**
+ * take the known attributes of a delta into the pending values. A value from
+ * an older shadow version than the one pending or last written is dropped, a
+ * delta without a version, like a resync, is always taken.
+ * return false if the delta has members the collapser does not know, it
+ * must then be forwarded as it is
+ */
+static bool _collapseDelta(DeltaCollapser_t *pCollapser, uint8_t thing, const char *pDocument, size_t documentLength,
+                           uint32_t receivedUs);
+
+/**
+ * ticks until the pending values may be released, 0 if they may be released
+ * now, portMAX_DELAY if nothing is pending
+ */
+static TickType_t _collapserWait(DeltaCollapser_t *pCollapser);
+
+/**
+ * write the pending values to the uart as one command per thing
+ */
+static void _collapserRelease(BridgeContext_t *pBridge);
+
+/********************Local rules *****************************/
+
+/**
+ * an automation run on the gateway, see SCHEMA_RULE
+ */
+typedef struct LocalRule{
+    SchemaIndex_t trigger;
+    const char *pTriggerValue;//NULL for any value
+    SchemaIndex_t target;
+    const char *pTargetValue;//NULL to copy the value of the trigger
+}LocalRule_t;
+
+/**
+ * run the rules triggered by a local change. Their commands are posted to
+ * the mesh right away, their results wait for the ack of the mesh.
+ * return number of rules fired
+ */
+static uint32_t _applyLocalRules(BridgeContext_t *pBridge, const BridgeFrame_t *pFrame);
+
+/**
+ * remember a value set by a rule command until the mesh acks it
+ */
+static void _ruleResultPending(BridgeContext_t *pBridge, const BridgeFrame_t *pResult);
+
+/**
+ * if an ack of the mesh confirms a rule result, turn it into a local change so
+ * the shadow follows the rule without its desired state undoing it
+ * param pFrame [in, out] the ack
+ */
+static void _ruleResultAcked(BridgeContext_t *pBridge, BridgeFrame_t *pFrame);
+
+/**
+ * the value a rule sets for the value of its trigger
+ * return false if the target has no such value
+ */
+static bool _ruleValue(const LocalRule_t *pRule, const AttributeValue_t *pTrigger, AttributeValue_t *pValue);
+
+/**
+ * push a decoded frame into its lane of the publisher, waits while the lane is full
+ */
+static void _queueFrame(BridgeContext_t *pBridge, const BridgeFrame_t *pFrame);
+
+/********************Mesh groups *****************************/
+
+/**
+ * member of the desired state holding the groups and scenes,
+ * {"groups":{"livingRoom":{"Lights":{"ON_OFF":"ON"}}}}
+ */
+#define BRIDGE_GROUPS_KEY "groups"
+
+/**
+ * removes the groups from the desired state once they were multicast,
+ * otherwise every later delta would carry them again
+ */
+#define BRIDGE_GROUPS_CLEAR_DOCUMENT "{\"state\":{\"desired\":{\"" BRIDGE_GROUPS_KEY "\":null}},\"clientToken\":\"groups\"}"
+
+/**
+ * longest multicast command written for a single group
+ */
+#define BRIDGE_GROUP_COMMAND_SIZE (256)
+
+/**
+ * a group of mesh nodes, one multicast reaches all of them
+ */
+typedef struct MeshGroup{
+    const char *pKey;
+    uint16_t address;
+}MeshGroup_t;
+
+/**
+ * true if every member of a "groups" object is a known group whose command
+ * fits BRIDGE_GROUP_COMMAND_SIZE
+ */
+static bool _groupsValid(const char *pGroups, size_t groupsLength);
+
+/**
+ * write one multicast command per group found in the state of a delta,
+ * {"group":49153,"Lights":{"ON_OFF":"ON"}}
+ * return number of bytes written to the uart
+ */
+static size_t _fanOutGroups(BridgeContext_t *pBridge, uint8_t thing, const char *pDocument, size_t documentLength,
+                            uint32_t receivedUs);
+
+/********************Traffic trace *****************************/
+
+/**
+ * values of BRIDGE_TRACE_MODE
+ */
+#define BRIDGE_TRACE_OFF (0)
+#define BRIDGE_TRACE_RECORD (1)
+#define BRIDGE_TRACE_REPLAY (2)
+
+/**
+ * a trace starts with these 4 bytes, followed by the records
+ */
+#define BRIDGE_TRACE_MAGIC "BTR2"
+
+/**
+ * every record starts with kind (1 byte), thing (1 byte), length (2 bytes)
+ * and the microseconds since the previous record (4 bytes), little endian,
+ * followed by length bytes of the packet or document
+ */
+#define BRIDGE_TRACE_RECORD_HEADER (8)
+
+typedef enum TraceKind{
+    TRACE_UART_IN = 1,//one packet read from the mesh
+    TRACE_UART_OUT,//command written to the mesh
+    TRACE_SHADOW_DELTA,//delta document received
+    TRACE_SHADOW_UPDATE//update document published
+}TraceKind_t;
+
+/**
+ * records the traffic of the bridge into one of two ram buffers, a full
+ * buffer is logged as hex by the supervising task while the other one fills
+ */
+typedef struct TraceRecorder{
+    SemaphoreHandle_t lock;
+    uint8_t *pBuffers[2];
+    size_t lengths[2];
+    uint32_t recording;//index of the buffer being written
+    bool dumpPending;//the other buffer is full and not logged yet
+    uint32_t lastUs;
+    uint32_t dumpedBytes;
+    uint32_t records;
+    uint32_t dropped;//both buffers were full
+}TraceRecorder_t;
+
+/**
+ * allocate the buffers of the recorder when BRIDGE_TRACE_MODE records
+ * return false if there is no memory for them
+ */
+static bool _traceInit(TraceRecorder_t *pRecorder);
+
+/**
+ * append a packet or document of a thing to the trace, does nothing unless
+ * recording
+ */
+static void _traceRecord(TraceKind_t kind, uint8_t thing, const void *pData, size_t length);
+
+/**
+ * log a full buffer of the trace as hex lines "trace <offset>: <bytes>",
+ * their bytes in offset order are the trace file
+ */
+static void _traceDump(TraceRecorder_t *pRecorder);
+
+/**
+ * feeds the packets and deltas of the trace linked into the firmware to the
+ * pipeline, in place of the uart ingress task
+ */
+static void _traceReplayTask(void *pArgument);
+
+/********************Mesh simulator *****************************/
+
+/**
+ * traffic of the virtual nodes of the mesh simulator
+ */
+typedef enum MeshSimPattern{
+    MESH_SIM_POISSON = 0,//every node reports now and then, independently
+    MESH_SIM_BURST,//every node reports at once, each its own attribute
+    MESH_SIM_SCENE,//every light is switched at once
+    MESH_SIM_SLIDER//one light is dimmed step by step
+}MeshSimPattern_t;
+
+/**
+ * a uart frame of the simulator, every block filled up
+ */
+#define BRIDGE_MESH_SIM_FRAME_SIZE (BRIDGE_FRAME_SIZE)
+
+/**
+ * a provisioner with virtual nodes in place of the uart. Commands written by
+ * the bridge are acked by the simulator task the way the mesh does.
+ */
+typedef struct MeshSimulator{
+    TaskHandle_t task;
+    uint8_t ackFrame[BRIDGE_MESH_SIM_FRAME_SIZE + 1];
+    uint32_t ackPending;//ackFrame is written, changed with atomics only
+    uint32_t commandUs;//when the pending command was written
+    uint32_t sliderStep;
+    uint32_t framesSent;
+    uint32_t commandsReceived;
+    uint32_t commandsNotAcked;//the command had no known attribute or an ack was pending
+    LatencyHistogram_t lateness;//a frame sent behind its schedule, the bridge pushed back
+    LatencyHistogram_t ackLatency;//command written -> ack decoded by the bridge
+}MeshSimulator_t;
+
+/**
+ * generate the frames of the virtual nodes and ack the commands of the
+ * bridge, in place of the uart ingress task
+ */
+static void _meshSimulatorTask(void *pArgument);
+
+/**
+ * take a command written by the bridge and prepare its ack
+ */
+static void _meshSimCommand(MeshSimulator_t *pSimulator, uint8_t thing, const char *pCommand, size_t commandLength);
+
+/**
+ * write a frame of the given schema attribute and value as the mesh sends it
+ * return false if the value does not fit its block
+ */
+static bool _meshSimFrame(uint8_t *pFrame, UpdateOperation_t operation, uint8_t thing, int schemaIndex,
+                          const char *pValue, size_t valueLength);
+
+/**
+ * send a random value of the attribute a virtual node stands for
+ */
+static void _meshSimReport(BridgeContext_t *pBridge, MeshSimulator_t *pSimulator, uint32_t node);
+
+/**
+ * send the frames of the next event of BRIDGE_MESH_SIM_PATTERN
+ * return microseconds until the event after it
+ */
+static uint32_t _meshSimEvent(BridgeContext_t *pBridge, MeshSimulator_t *pSimulator);
+
+/********************Shadow emulator *****************************/
+
+/**
+ * a thing shadow kept in process. It knows the attributes of the schema,
+ * other members of a document are ignored. A value length of 0 means the
+ * attribute is not in the section.
+ */
+typedef struct EmulatedShadow{
+    char desired[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    uint8_t desiredLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    char reported[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_COMMAND_VALUE_SIZE];
+    uint8_t reportedLengths[BRIDGE_SCHEMA_ATTRIBUTE_COUNT];
+    uint32_t version;//0 while the shadow does not exist
+    uint64_t windowStartMs;//updates are counted per second for throttling
+    uint32_t windowUpdates;
+}EmulatedShadow_t;
+
+/**
+ * the shadows of all things kept in process, for benchmarks without AWS
+ */
+typedef struct ShadowEmulator{
+    SemaphoreHandle_t lock;
+    EmulatedShadow_t shadows[BRIDGE_THING_COUNT];
+    char delta[BRIDGE_DELTA_SLOT_SIZE];
+    char documents[2 * BRIDGE_DELTA_SLOT_SIZE];
+    uint32_t accepted;
+    uint32_t rejected;
+    uint32_t throttled;
+    uint32_t deltas;
+    uint32_t ownDeltas;//published for an update of the bridge
+}ShadowEmulator_t;
+
+/**
+ * create the emulated shadow and the task that changes its desired state the
+ * way an app would
+ * return EXIT_SUCCESS if the emulator runs
+ */
+static int _shadowEmuStart(BridgeContext_t *pBridge);
+
+/**
+ * apply an update document to the emulated shadow, with the injected latency,
+ * size limit and throttling, and post the delta it causes to the bridge
+ * return the status the shadow service would answer with
+ */
+static AwsIotShadowError_t _shadowEmuUpdate(ShadowEmulator_t *pEmulator, uint8_t thing, const char *pDocument, size_t documentLength);
+
+/**
+ * get the emulated shadow document, allocated with malloc like a shadow get
+ */
+static AwsIotShadowError_t _shadowEmuGet(ShadowEmulator_t *pEmulator, uint8_t thing, const char **ppDocument, size_t *pDocumentLength);
+
+/**
+ * changes the desired state of the emulated shadow now and then
+ */
+static void _shadowEmuAppTask(void *pArgument);
+
+/**
+ * write the known attributes as a state object, {"Lights":{"ON_OFF":"ON"}}
+ * return the length, or objectSize when it does not fit
+ */
+static size_t _writeStateObject(const SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT],
+                                char *pObject, size_t objectSize);
+
+/********************Echo suppression *****************************/
+
+/**
+ * remember the client token of an own update and the desired values it
+ * wrote, before it is published
+ */
+static void _echoRecord(EchoFilter_t *pFilter, uint8_t thing, const char *pDocument, size_t documentLength);
+
+/**
+ * true if the delta of the thing carries the token of a recent own update of
+ * that thing and every value in it is the one that update wrote to desired
+ */
+static bool _echoMatch(EchoFilter_t *pFilter, uint8_t thing, const char *pDocument, size_t documentLength);
+
+/********************Network connection *****************************/
+
+/**
+ * create the tls connection the mqtt connection runs over and time the handshake
+ */
+static IotNetworkError_t _openNetworkConnection(BridgeContext_t *pBridge,
+                                                void *pNetworkServerInfo,
+                                                void *pNetworkCredentialInfo);
+
+/**
+ * close and destroy the tls connection, the next connect does a full handshake
+ */
+static void _closeNetworkConnection(BridgeContext_t *pBridge);
+
+/**
+ * wait before the next connect attempt and lengthen the wait after it
+ */
+static void _connectBackoff(uint32_t *pBackoffMs);
+
+/********************SPSC ring *****************************/
+
+/**
+ * wake the consumer of the ring after one or more pushes
+ * param pHigherPriorityTaskWoken NULL when called from a task, otherwise
+ * the isr yield flag
+ */
+static void _ringNotifyConsumer(SpscRing_t *pRing, BaseType_t *pHigherPriorityTaskWoken);
+
+/********************Priority lanes *****************************/
+
+/**
+ * class of a packet received from local
+ */
+static TrafficClass_t _classifyFrame(Device_t deviceType, Attribute_t attributeType);
+
+/**
+ * most urgent class of the schema attributes in a state object
+ */
+static TrafficClass_t _classifyState(const char *pState, size_t stateLength);
+
+/**
+ * class of a delta document, the most urgent class of the schema attributes
+ * it sets directly or through a scene
+ */
+static TrafficClass_t _classifyDelta(const char *pDocument, size_t documentLength);
+
+/**
+ * pick the class to serve next: the highest priority class that has work,
+ * unless a lower class has been passed over BRIDGE_LANE_STARVATION_LIMIT times
+ * param hasWork which classes have something waiting
+ * param passedOver per class count of times it was passed over, updated
+ * return the class to serve, CLASS_COUNT if nothing is waiting
+ */
+static TrafficClass_t _selectLane(const bool hasWork[CLASS_COUNT], uint32_t passedOver[CLASS_COUNT]);
+
+/**
+ * create one ring per class
+ */
+static bool _lanesInit(PriorityLanes_t *pLanes, uint32_t capacity, size_t elementSize);
+
+/**
+ * set the task woken by a push into any lane
+ */
+static void _lanesSetConsumer(PriorityLanes_t *pLanes, TaskHandle_t consumer);
+
+/**
+ * pop the next element in priority order, only to be called by the consumer
+ * param pClass [out] class the element was taken from
+ * return false if all lanes are empty
+ */
+static bool _lanesPop(PriorityLanes_t *pLanes, void *pElement, TrafficClass_t *pClass);
+
+/**
+ * block the consumer until any lane has an element or the timeout expires
+ */
+static void _lanesWait(PriorityLanes_t *pLanes, TickType_t timeout);
+
+/**
+ * add a latency measured from startUs to a histogram
+ */
+static void _latencyRecord(LatencyHistogram_t *pHistogram, uint32_t startUs);
+
+/**
+ * upper bound in ms of the given percentile of a histogram, 0 if empty
+ */
+static uint32_t _latencyPercentileMs(const LatencyHistogram_t *pHistogram, uint32_t percentile);
+
+/********************Delta mailbox *****************************/
+
+/**
+ * allocate the slots of a mailbox
+ * return false if there is no memory
+ */
+static bool _mailboxInit(DeltaMailbox_t *pMailbox, uint32_t slotCount);
+
+/**
+ * copy a delta document into a free slot and wake the consumer, safe to be
+ * called by several producers at once. Never blocks.
+ * param kind what the document is
+ * return false and count the drop if no slot is free or the document is too long
+ */
+static bool _mailboxPost(DeltaMailbox_t *pMailbox, uint8_t thing, const char *pDocument, size_t documentLength,
+                         uint32_t receivedUs, DeltaSlotKind_t kind);
+
+/**
+ * take the oldest ready slot of the class chosen by _selectLane, only to be
+ * called by the consumer. A slot is classified once, when it is first seen.
+ * Classes only reorder the slots of different things, an older slot of the
+ * same thing is taken first.
+ * return NULL if no slot is ready
+ */
+static DeltaSlot_t *_mailboxTake(DeltaMailbox_t *pMailbox);
+
+/**
+ * give a slot returned by _mailboxTake back to the producers
+ */
+static void _mailboxRelease(DeltaSlot_t *pSlot);
+
+/**
+ * record the time one item took in a stage
+ */
+static void _stageRecord(StageStats_t *pStats, uint32_t startUs);
+
+/********************Bridge pipeline *****************************/
+
+/**
+ * decode a packet received from local into a frame
+ * param data the packet, must be readable up to the full packet length
+ * param length number of bytes received
+ * param pFrame [out] the decoded frame
+ * return true if the packet was long enough to be decoded
+ */
+static bool _decodeFrame(uint8_t *data, size_t length, BridgeFrame_t *pFrame);
+
+/**
+ * fill in the thing registry and create the delta mailbox, which must
+ * exist before connecting because a resumed session delivers the deltas
+ * queued by the broker right after the connection is established
+ */
+static int _prepareBridge(BridgeContext_t *pBridge,
+                          const char *pThingName,
+                          size_t thingNameLength);
+
+/**
+ * create the queues and the pinned tasks of the bridge pipeline
+ * return EXIT_SUCCESS if every task was started
+ */
+static int _startBridgePipeline(BridgeContext_t *pBridge);
+
+/**
+ * reads packets from uart, decodes them and queues them for the publisher
+ */
+static void _uartIngressTask(void *pArgument);
+
+/**
+ * decode a packet and queue it for the publisher, runs on the task that
+ * produces the frame lanes
+ * param data the packet, followed by a '\0'
+ */
+static void _ingestPacket(BridgeContext_t *pBridge, uint8_t *data, size_t length, uint32_t startUs);
+
+/**
+ * ingest every whole frame at the start of the bytes read from the uart
+ * return number of bytes ingested, the rest is the start of the next frame
+ */
+static size_t _ingestFrames(BridgeContext_t *pBridge, const uint8_t *data, size_t length, uint32_t startUs);
+
+/**
+ * answer a query packet with the desired state of the device in its device
+ * block, or of all devices of the thing for "*", read from the shadow mirror.
+ * The answer goes to the mesh like a delta, without a cloud round trip.
+ * param data the packet, followed by a '\0'
+ */
+static void _answerQuery(BridgeContext_t *pBridge, const uint8_t *data, size_t length, uint32_t startUs);
+
+/**
+ * forwards the deltas posted to the mailbox into the uart port
+ */
+static void _meshTxTask(void *pArgument);
+
+/**
+ * write the diff of every thing to the mesh after deltas were dropped on a
+ * full mailbox
+ */
+static void _meshResync(BridgeContext_t *pBridge);
+
+/**
+ * mqtt callback of the delta subscription taken over from a previous session,
+ * does the same as _shadowDeltaCallback
+ */
+static void _mqttDeltaCallback(void *pCallbackContext, IotMqttCallbackParam_t *pCallbackParam);
+
+/**
+ * forward the "state" of a delta document of a thing into the uart port
+ * return number of bytes written to the uart
+ */
+static size_t _forwardDelta(uint8_t thing, const char *pDocument, size_t documentLength);
+
+/**
+ * the thing a packet is for, from the digits after ':' in its device block
+ */
+static uint8_t _frameThing(const uint8_t *data);
+
+/**
+ * the thing of a packet that may be shorter than a frame, 0 if it is too
+ * short to have a device block
+ */
+static uint8_t _packetThing(const uint8_t *data, size_t length);
+
+/**
+ * publishes queued frames to the thing shadow
+ */
+static void _shadowPublisherTask(void *pArgument);
+
+/**
+ * log the utilization of every pipeline stage since the previous report
+ * param elapsedUs time since the previous report
+ */
+static void _reportStageUtilization(BridgeContext_t *pBridge, uint32_t elapsedUs);
+
+/**
+ * record the first time a start-up milestone is reached, returns false if it
+ * was reached before
+ */
+static bool _bootMark(BridgeContext_t *pBridge, BootMilestone_t milestone);
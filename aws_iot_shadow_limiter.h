@@ -0,0 +1,150 @@
+/**
+ * rate limiter of the shadow updates of one thing. It only does integer
+ * arithmetic on a clock, the includer provides IotClock_GetTimeMs and
+ * AwsIotShadowError_t, so the limiter is also built on the host by the tests
+ * in test/.
+ */
+
+#ifndef AWS_IOT_SHADOW_LIMITER_H
+#define AWS_IOT_SHADOW_LIMITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief Shadow update rate limits in updates per second.
+ *
+ * AWS IoT throttles shadow updates per thing, so every thing has its own
+ * limiter. A limiter starts at
+ * BRIDGE_RATE_INITIAL_PER_SEC, halves the rate whenever an update is throttled
+ * and adds BRIDGE_RATE_INCREASE_MILLI / 1000 updates per second after every
+ * accepted update, staying between the min and the max.
+ */
+#define BRIDGE_RATE_INITIAL_PER_SEC (10)
+#define BRIDGE_RATE_MIN_PER_SEC (1)
+#define BRIDGE_RATE_MAX_PER_SEC (20)
+#define BRIDGE_RATE_INCREASE_MILLI (100)
+
+/**
+ * @brief Burst size of the limiter, and the number of tokens below which the
+ * publisher merges waiting frames into each update.
+ */
+#define BRIDGE_RATE_BURST (5)
+#define BRIDGE_RATE_BATCH_THRESHOLD (2)
+
+/**
+ * token bucket in front of the shadow updates of one thing. The rate is
+ * lowered when the broker throttles us and slowly raised again after accepted
+ * updates. Only used by the shadow publisher, the stats reporter just reads it.
+ */
+typedef struct RateLimiter{
+    uint32_t rateMilli;//tokens per second * 1000
+    uint32_t tokensMilli;//tokens * 1000
+    uint64_t lastRefillMs;
+    uint32_t throttledCount;
+    uint32_t batchedFrames;//frames merged into the update of an earlier frame
+}RateLimiter_t;
+
+static void _rateLimiterInit(RateLimiter_t *pLimiter);
+
+/**
+ * take one token
+ * return 0 if a token was taken, otherwise the ms until one is available
+ */
+static uint32_t _rateLimiterAcquire(RateLimiter_t *pLimiter);
+
+/**
+ * give back a token that was taken for an update that was never sent
+ */
+static void _rateLimiterRelease(RateLimiter_t *pLimiter);
+
+/**
+ * true if fewer than BRIDGE_RATE_BATCH_THRESHOLD tokens are left, the
+ * publisher then merges more frames into each update
+ */
+static bool _rateLimiterNearLimit(RateLimiter_t *pLimiter);
+
+/**
+ * adapt the rate to the result of a shadow update
+ */
+static void _rateLimiterFeedback(RateLimiter_t *pLimiter, AwsIotShadowError_t updateResult);
+
+/*-----------------------------------------------------------*/
+
+static void _rateLimiterInit(RateLimiter_t *pLimiter)
+{
+    pLimiter->rateMilli = BRIDGE_RATE_INITIAL_PER_SEC * 1000;
+    pLimiter->tokensMilli = BRIDGE_RATE_BURST * 1000;
+    pLimiter->lastRefillMs = IotClock_GetTimeMs();
+    pLimiter->throttledCount = 0;
+    pLimiter->batchedFrames = 0;
+}
+
+static void _rateLimiterRefill(RateLimiter_t *pLimiter)
+{
+    uint64_t nowMs = IotClock_GetTimeMs();
+    uint64_t tokensMilli = pLimiter->tokensMilli + (nowMs - pLimiter->lastRefillMs) * pLimiter->rateMilli / 1000;
+
+    if(tokensMilli > BRIDGE_RATE_BURST * 1000)
+    {
+        tokensMilli = BRIDGE_RATE_BURST * 1000;
+    }
+    pLimiter->tokensMilli = (uint32_t) tokensMilli;
+    pLimiter->lastRefillMs = nowMs;
+}
+
+static uint32_t _rateLimiterAcquire(RateLimiter_t *pLimiter)
+{
+    _rateLimiterRefill(pLimiter);
+
+    if(pLimiter->tokensMilli >= 1000)
+    {
+        pLimiter->tokensMilli -= 1000;
+        return 0;
+    }
+    return (1000 - pLimiter->tokensMilli) * 1000 / pLimiter->rateMilli + 1;
+}
+
+static void _rateLimiterRelease(RateLimiter_t *pLimiter)
+{
+    pLimiter->tokensMilli += 1000;
+    if(pLimiter->tokensMilli > BRIDGE_RATE_BURST * 1000)
+    {
+        pLimiter->tokensMilli = BRIDGE_RATE_BURST * 1000;
+    }
+}
+
+static bool _rateLimiterNearLimit(RateLimiter_t *pLimiter)
+{
+    _rateLimiterRefill(pLimiter);
+
+    return pLimiter->tokensMilli < BRIDGE_RATE_BATCH_THRESHOLD * 1000;
+}
+
+/**
+ * additive increase, multiplicative decrease. A throttled update also empties
+ * the bucket so the next try waits for a full token at the lower rate.
+ */
+static void _rateLimiterFeedback(RateLimiter_t *pLimiter, AwsIotShadowError_t updateResult)
+{
+    if(updateResult == AWS_IOT_SHADOW_THROTTLED)
+    {
+        pLimiter->throttledCount++;
+        pLimiter->tokensMilli = 0;
+        pLimiter->rateMilli /= 2;
+        if(pLimiter->rateMilli < BRIDGE_RATE_MIN_PER_SEC * 1000)
+        {
+            pLimiter->rateMilli = BRIDGE_RATE_MIN_PER_SEC * 1000;
+        }
+    }
+    else if(updateResult == AWS_IOT_SHADOW_SUCCESS)
+    {
+        pLimiter->rateMilli += BRIDGE_RATE_INCREASE_MILLI;
+        if(pLimiter->rateMilli > BRIDGE_RATE_MAX_PER_SEC * 1000)
+        {
+            pLimiter->rateMilli = BRIDGE_RATE_MAX_PER_SEC * 1000;
+        }
+    }
+}
+
+#endif /* AWS_IOT_SHADOW_LIMITER_H */
@@ -0,0 +1,133 @@
+/**
+ * single producer single consumer ring of the bridge pipeline. It only needs
+ * memcpy and the gcc __atomic builtins, the includer provides TaskHandle_t and
+ * IotLogError, so the ring is also built on the host by the tests in test/.
+ */
+
+#ifndef AWS_IOT_SHADOW_RING_H
+#define AWS_IOT_SHADOW_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * cache line size of the esp32, the producer and the consumer index of a ring
+ * are kept on separate lines so the two cores don't share one
+ */
+#define BRIDGE_CACHE_LINE_SIZE (32)
+
+/**
+ * single producer single consumer ring buffer of fixed size elements, the
+ * standard hand-off between two pipeline tasks. The capacity is a power of two.
+ * Pushing never blocks or takes a lock so the producer may run in an isr,
+ * a push into a full ring fails and is counted in overflowCount.
+ */
+typedef struct SpscRing{
+    uint32_t head __attribute__((aligned(BRIDGE_CACHE_LINE_SIZE)));//written by the producer only
+    uint32_t overflowCount;//written by the producer only
+    uint32_t tail __attribute__((aligned(BRIDGE_CACHE_LINE_SIZE)));//written by the consumer only
+    uint32_t mask __attribute__((aligned(BRIDGE_CACHE_LINE_SIZE)));
+    size_t elementSize;
+    uint8_t *pStorage;
+    TaskHandle_t consumer;//task notified after a push, may be NULL
+}SpscRing_t;
+
+/**
+ * allocate the storage of a ring
+ * param capacity number of elements, must be a power of two
+ * param elementSize size of one element in bytes
+ * return false if the capacity is invalid or there is no memory
+ */
+static bool _ringInit(SpscRing_t *pRing, uint32_t capacity, size_t elementSize);
+
+/**
+ * copy an element into the ring, only to be called by the producer. Does not
+ * block and takes no lock, so it is safe to call from an isr.
+ * return false and count an overflow if the ring is full
+ */
+static bool _ringPush(SpscRing_t *pRing, const void *pElement);
+
+/**
+ * copy the oldest element out of the ring, only to be called by the consumer
+ * return false if the ring is empty
+ */
+static bool _ringPop(SpscRing_t *pRing, void *pElement);
+
+/**
+ * number of elements waiting in the ring
+ */
+static uint32_t _ringCount(SpscRing_t *pRing);
+
+/*-----------------------------------------------------------*/
+
+/**
+ * head and tail are free running counters, the slot of a counter is counter & mask.
+ * The producer publishes an element with a release store of head after copying
+ * it, the consumer frees the slot with a release store of tail after copying it out.
+ */
+static bool _ringInit(SpscRing_t *pRing, uint32_t capacity, size_t elementSize)
+{
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+    {
+        IotLogError("ring capacity %u is not a power of two",capacity);
+        return false;
+    }
+
+    pRing->pStorage = (uint8_t *) malloc(capacity * elementSize);
+    if(pRing->pStorage == NULL)
+    {
+        IotLogError("No memory for a ring of %u elements",capacity);
+        return false;
+    }
+
+    pRing->head = 0;
+    pRing->tail = 0;
+    pRing->overflowCount = 0;
+    pRing->mask = capacity - 1;
+    pRing->elementSize = elementSize;
+    pRing->consumer = NULL;
+
+    return true;
+}
+
+static bool _ringPush(SpscRing_t *pRing, const void *pElement)
+{
+    uint32_t head = pRing->head;
+    uint32_t tail = __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE);
+
+    if(head - tail > pRing->mask)
+    {
+        pRing->overflowCount++;
+        return false;
+    }
+
+    memcpy(pRing->pStorage + (head & pRing->mask) * pRing->elementSize, pElement, pRing->elementSize);
+    __atomic_store_n(&pRing->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static bool _ringPop(SpscRing_t *pRing, void *pElement)
+{
+    uint32_t tail = pRing->tail;
+    uint32_t head = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+
+    if(head == tail)
+    {
+        return false;
+    }
+
+    memcpy(pElement, pRing->pStorage + (tail & pRing->mask) * pRing->elementSize, pRing->elementSize);
+    __atomic_store_n(&pRing->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static uint32_t _ringCount(SpscRing_t *pRing)
+{
+    return __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&pRing->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* AWS_IOT_SHADOW_RING_H */
@@ -0,0 +1,91 @@
+/**
+ * micro-benchmark of the value codec. Reports the cost of parsing the value
+ * block of a frame, of writing a number with _formatNumber against snprintf,
+ * and of encoding a whole update document.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "host/bridge_host.h"
+#include "aws_iot_demo_shadow.c"
+
+#define CODEC_BENCH_ROUNDS (2000000u)
+
+static uint64_t _nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void _frame(uint8_t frame[BRIDGE_FRAME_SIZE + 1], const char *pDevice, const char *pAttribute, const char *pValue)
+{
+    memset(frame, 'x', BRIDGE_FRAME_SIZE);
+    frame[0] = '2';
+    memcpy(frame + operationTypeLength, pDevice, strlen(pDevice));
+    memcpy(frame + operationTypeLength + deviceNameLength, pAttribute, strlen(pAttribute));
+    memcpy(frame + operationTypeLength + deviceNameLength + attributeNameLength, pValue, strlen(pValue));
+    frame[BRIDGE_FRAME_SIZE] = '\0';
+}
+
+int main(void)
+{
+    uint8_t frames[4][BRIDGE_FRAME_SIZE + 1];
+    static const Device_t devices[4] = { LIGHT, LIGHT, LOCK, THERMOSTAT };
+    static const Attribute_t attributes[4] = { ON_OFF, TEMPERATURE, LOCK_UNLOCK, TEMPERATURE };
+    AttributeValue_t value;
+    char text[BRIDGE_NUMBER_TEXT_MAX];
+    uint32_t checksum = 0;
+
+    _frame(frames[0], "Lights", "ON_OFF", "OFF");
+    _frame(frames[1], "Lights", "TEMPERATURE", "6500");
+    _frame(frames[2], "Lock", "LOCK_UNLOCK", "UNLOCK");
+    _frame(frames[3], "Thermo", "TEMPERATURE", "21.5");
+
+    uint64_t startNs = _nowNs();
+    for(uint32_t i = 0; i < CODEC_BENCH_ROUNDS; i++)
+    {
+        uint32_t k = i & 3;
+        checksum += _getAttributeValue(devices[k], attributes[k], frames[k], BRIDGE_FRAME_SIZE, &value) ? (uint32_t) value.value : 0;
+    }
+    uint64_t elapsedNs = _nowNs() - startNs;
+    printf("parse: %.1f ns per value block\n", (double) elapsedNs / CODEC_BENCH_ROUNDS);
+
+    startNs = _nowNs();
+    for(uint32_t i = 0; i < CODEC_BENCH_ROUNDS; i++)
+    {
+        checksum += (uint32_t) _formatNumber((int32_t)(i % 3501), 1, text);
+    }
+    elapsedNs = _nowNs() - startNs;
+    printf("format: %.1f ns per number with _formatNumber\n", (double) elapsedNs / CODEC_BENCH_ROUNDS);
+
+    startNs = _nowNs();
+    for(uint32_t i = 0; i < CODEC_BENCH_ROUNDS; i++)
+    {
+        int32_t number = (int32_t)(i % 3501);
+        checksum += (uint32_t) snprintf(text, sizeof(text), "%d.%d", (int)(number / 10), (int)(number % 10));
+    }
+    elapsedNs = _nowNs() - startNs;
+    printf("format: %.1f ns per number with snprintf\n", (double) elapsedNs / CODEC_BENCH_ROUNDS);
+
+    const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { NULL };
+    AttributeValue_t parsed[4];
+    char document[SHADOW_UPDATE_DOCUMENT_SIZE];
+    for(uint32_t k = 0; k < 4; k++)
+    {
+        _getAttributeValue(devices[k], attributes[k], frames[k], BRIDGE_FRAME_SIZE, &parsed[k]);
+        values[_schemaIndex(devices[k], attributes[k])] = &parsed[k];
+    }
+
+    startNs = _nowNs();
+    for(uint32_t i = 0; i < CODEC_BENCH_ROUNDS / 10; i++)
+    {
+        checksum += (uint32_t) _encodeShadowDocument(values, true, document, sizeof(document));
+    }
+    elapsedNs = _nowNs() - startNs;
+    printf("encode: %.1f ns per document of 4 attributes in desired and reported, %u bytes (checksum %u)\n",
+           (double) elapsedNs / (CODEC_BENCH_ROUNDS / 10), (uint32_t) strlen(document), checksum);
+    return 0;
+}
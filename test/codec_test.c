@@ -0,0 +1,315 @@
+/**
+ * table driven test of the value codec of the bridge: _getAttributeValue on
+ * uart frames, _formatNumber and _encodeSection. The tables use the schema of
+ * aws_iot_shadow_schema.def.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include "host/bridge_host.h"
+#include "aws_iot_demo_shadow.c"
+
+#define WHOLE_FRAME (-1)
+
+typedef struct ParseCase{
+    Device_t device;
+    Attribute_t attribute;
+    const char *pValue;//text of the value block
+    int valueBytes;//bytes of the value block received, WHOLE_FRAME for all of it
+    bool accepted;
+    int32_t expected;//choice index or number * 10^decimals
+}ParseCase_t;
+
+static const ParseCase_t _parseCases[] = {
+    //enums match one choice exactly
+    { LIGHT, ON_OFF, "ON", WHOLE_FRAME, true, 0 },
+    { LIGHT, ON_OFF, "OFF", WHOLE_FRAME, true, 1 },
+    { LIGHT, ON_OFF, "on", WHOLE_FRAME, false, 0 },
+    { LIGHT, ON_OFF, "O", WHOLE_FRAME, false, 0 },
+    { LIGHT, ON_OFF, "ONN", WHOLE_FRAME, false, 0 },
+    { LIGHT, ON_OFF, "OFFF", WHOLE_FRAME, false, 0 },
+    { LIGHT, ON_OFF, "", WHOLE_FRAME, false, 0 },
+    { LOCK, LOCK_UNLOCK, "LOCK", WHOLE_FRAME, true, 0 },
+    { LOCK, LOCK_UNLOCK, "UNLOCK", WHOLE_FRAME, true, 1 },
+    { LOCK, LOCK_UNLOCK, "LOCKED", WHOLE_FRAME, false, 0 },
+    { LOCK, LOCK_UNLOCK, "ON", WHOLE_FRAME, false, 0 },
+    //a value block cut short is taken as far as it was received
+    { LIGHT, ON_OFF, "ON", 2, true, 0 },
+    { LIGHT, ON_OFF, "OFF", 2, false, 0 },
+    { LOCK, LOCK_UNLOCK, "UNLOCK", 4, false, 0 },
+    { LIGHT, POWER_LEVEL, "100", 2, true, 10 },
+    { THERMOSTAT, TEMPERATURE, "21.5", 2, true, 210 },
+    { LIGHT, POWER_LEVEL, "50", 0, false, 0 },
+    //edges of the ranges
+    { LIGHT, POWER_LEVEL, "0", WHOLE_FRAME, true, 0 },
+    { LIGHT, POWER_LEVEL, "100", WHOLE_FRAME, true, 100 },
+    { LIGHT, POWER_LEVEL, "101", WHOLE_FRAME, false, 0 },
+    { LIGHT, TEMPERATURE, "1000", WHOLE_FRAME, true, 1000 },
+    { LIGHT, TEMPERATURE, "999", WHOLE_FRAME, false, 0 },
+    { LIGHT, TEMPERATURE, "10000", WHOLE_FRAME, true, 10000 },
+    { LIGHT, TEMPERATURE, "10001", WHOLE_FRAME, false, 0 },
+    { THERMOSTAT, TEMPERATURE, "5", WHOLE_FRAME, true, 50 },
+    { THERMOSTAT, TEMPERATURE, "4.9", WHOLE_FRAME, false, 0 },
+    { THERMOSTAT, TEMPERATURE, "35.0", WHOLE_FRAME, true, 350 },
+    { THERMOSTAT, TEMPERATURE, "35.1", WHOLE_FRAME, false, 0 },
+    //at most 9 digits, leading zeros count
+    { LIGHT, TEMPERATURE, "000003000", WHOLE_FRAME, true, 3000 },
+    { LIGHT, TEMPERATURE, "0000003000", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, "000000050", WHOLE_FRAME, true, 50 },
+    { LIGHT, POWER_LEVEL, "0000000050", WHOLE_FRAME, false, 0 },
+    //decimals up to those of the schema
+    { THERMOSTAT, TEMPERATURE, "21.5", WHOLE_FRAME, true, 215 },
+    { THERMOSTAT, TEMPERATURE, "21", WHOLE_FRAME, true, 210 },
+    { THERMOSTAT, TEMPERATURE, "21.55", WHOLE_FRAME, false, 0 },
+    { THERMOSTAT, TEMPERATURE, "2.1.5", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, "2.5", WHOLE_FRAME, false, 0 },
+    //negative values are parsed and then held against the range
+    { LIGHT, POWER_LEVEL, "-0", WHOLE_FRAME, true, 0 },
+    { LIGHT, POWER_LEVEL, "-1", WHOLE_FRAME, false, 0 },
+    { THERMOSTAT, TEMPERATURE, "-21.5", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, "-", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, "--5", WHOLE_FRAME, false, 0 },
+    //anything else in a number
+    { LIGHT, POWER_LEVEL, "5a", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, " 5", WHOLE_FRAME, false, 0 },
+    { LIGHT, POWER_LEVEL, "", WHOLE_FRAME, false, 0 },
+    //attributes the schema does not have
+    { SWITCH, POWER_LEVEL, "50", WHOLE_FRAME, false, 0 },
+    { LOCK, ON_OFF, "ON", WHOLE_FRAME, false, 0 },
+};
+
+typedef struct FormatCase{
+    int32_t value;
+    uint8_t decimals;
+    const char *pText;
+}FormatCase_t;
+
+static const FormatCase_t _formatCases[] = {
+    { 0, 0, "0" },
+    { 7, 0, "7" },
+    { -7, 0, "-7" },
+    { 3000, 0, "3000" },
+    { 215, 1, "21.5" },
+    { -215, 1, "-21.5" },
+    { 210, 1, "21.0" },
+    { 5, 1, "0.5" },
+    { -5, 1, "-0.5" },
+    { 0, 2, "0.00" },
+    { 5, 3, "0.005" },
+    { INT32_MAX, 0, "2147483647" },
+    { INT32_MIN, 0, "-2147483648" },
+    { INT32_MIN, 9, "-2.147483648" },
+    { 1, 12, "0.000000001" },//more than 9 decimals are written as 9
+};
+
+typedef struct EncodeValue{
+    Device_t device;
+    Attribute_t attribute;
+    int32_t value;
+}EncodeValue_t;
+
+typedef struct EncodeCase{
+    EncodeValue_t values[4];
+    size_t valueCount;
+    const char *pSection;
+}EncodeCase_t;
+
+static const EncodeCase_t _encodeCases[] = {
+    { { { 0 } }, 0, "{}" },
+    { { { LIGHT, ON_OFF, 0 } }, 1, "{\"Lights\":{\"ON_OFF\":\"ON\"}}" },
+    { { { LIGHT, TEMPERATURE, 3000 }, { LIGHT, ON_OFF, 1 } }, 2,
+      "{\"Lights\":{\"ON_OFF\":\"OFF\",\"colorTemperatureInKelvin\":3000}}" },
+    { { { THERMOSTAT, TEMPERATURE, 215 }, { LOCK, LOCK_UNLOCK, 1 } }, 2,
+      "{\"Lock\":{\"Lock value\":\"UNLOCK\"},\"Thermostat\":{\"targetTemperatureInCelsius\":21.5}}" },
+    { { { SWITCH, ON_OFF, 1 }, { LIGHT, POWER_LEVEL, 0 }, { THERMOSTAT, ON_OFF, 0 }, { THERMOSTAT, TEMPERATURE, 50 } }, 4,
+      "{\"Lights\":{\"brightness\":0},\"Switch\":{\"Switch value\":\"OFF\"},"
+      "\"Thermostat\":{\"ON_OFF\":\"ON\",\"targetTemperatureInCelsius\":5.0}}" },
+};
+
+/**
+ * the frame as the mesh sends it, every block ends with 'x' when it is
+ * shorter than the block
+ */
+static size_t _buildFrame(uint8_t frame[BRIDGE_FRAME_SIZE + 1], const ParseCase_t *pCase)
+{
+    const char *pDevice = NULL, *pAttribute = NULL;
+    size_t offset = operationTypeLength;
+
+    for(size_t i = 0; i < sizeof(_deviceNames) / sizeof(_deviceNames[0]); i++)
+    {
+        pDevice = (_deviceNames[i].device == pCase->device) ? _deviceNames[i].pName : pDevice;
+    }
+    for(size_t i = 0; i < sizeof(_attributeNames) / sizeof(_attributeNames[0]); i++)
+    {
+        pAttribute = (_attributeNames[i].attribute == pCase->attribute) ? _attributeNames[i].pName : pAttribute;
+    }
+
+    memset(frame, 'x', BRIDGE_FRAME_SIZE);
+    frame[0] = '2';
+    memcpy(frame + offset, pDevice, strlen(pDevice));
+    offset += deviceNameLength;
+    memcpy(frame + offset, pAttribute, strlen(pAttribute));
+    offset += attributeNameLength;
+    memcpy(frame + offset, pCase->pValue, strlen(pCase->pValue));
+    frame[BRIDGE_FRAME_SIZE] = '\0';
+
+    return (pCase->valueBytes == WHOLE_FRAME) ? BRIDGE_FRAME_SIZE : offset + (size_t)pCase->valueBytes;
+}
+
+static int _testParse(void)
+{
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(_parseCases) / sizeof(_parseCases[0]); i++)
+    {
+        const ParseCase_t *pCase = &_parseCases[i];
+        uint8_t frame[BRIDGE_FRAME_SIZE + 1];
+        AttributeValue_t value = { VALUE_ENUM, -1 };
+        size_t length = _buildFrame(frame, pCase);
+
+        bool accepted = _getAttributeValue(pCase->device, pCase->attribute, frame, length, &value);
+        if(accepted != pCase->accepted || (accepted && value.value != pCase->expected))
+        {
+            printf("FAIL: parse case %u \"%s\" of %d bytes: %s %d, expected %s %d\n",
+                   (unsigned) i, pCase->pValue, pCase->valueBytes,
+                   accepted ? "accepted" : "rejected", (int) value.value,
+                   pCase->accepted ? "accepted" : "rejected", (int) pCase->expected);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static int _testFormat(void)
+{
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(_formatCases) / sizeof(_formatCases[0]); i++)
+    {
+        const FormatCase_t *pCase = &_formatCases[i];
+        char text[BRIDGE_NUMBER_TEXT_MAX];
+        size_t length = _formatNumber(pCase->value, pCase->decimals, text);
+
+        if(strcmp(text, pCase->pText) != 0 || length != strlen(pCase->pText))
+        {
+            printf("FAIL: format case %u: \"%s\" of length %u, expected \"%s\"\n",
+                   (unsigned) i, text, (unsigned) length, pCase->pText);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+static int _testEncode(void)
+{
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(_encodeCases) / sizeof(_encodeCases[0]); i++)
+    {
+        const EncodeCase_t *pCase = &_encodeCases[i];
+        AttributeValue_t storage[4];
+        const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { NULL };
+        char section[SHADOW_UPDATE_DOCUMENT_SIZE];
+        size_t length = 0;
+
+        for(size_t k = 0; k < pCase->valueCount; k++)
+        {
+            int index = _schemaIndex(pCase->values[k].device, pCase->values[k].attribute);
+
+            storage[k].type = _schemaAttributes[index].valueType;
+            storage[k].value = pCase->values[k].value;
+            values[index] = &storage[k];
+        }
+        _encodeSection(values, section, sizeof(section), &length);
+
+        if(length != strlen(pCase->pSection) || strcmp(section, pCase->pSection) != 0)
+        {
+            printf("FAIL: encode case %u: %s, expected %s\n", (unsigned) i, section, pCase->pSection);
+            failed = 1;
+        }
+
+        //a buffer too short for the section is reported full, nothing is written past it
+        char small[24];
+        memset(small, '#', sizeof(small));
+        length = 0;
+        _encodeSection(values, small, sizeof(small) - 4, &length);
+        bool fits = strlen(pCase->pSection) < sizeof(small) - 4;
+        if((fits == false && length != sizeof(small) - 4) || memcmp(small + sizeof(small) - 4, "####", 4) != 0)
+        {
+            printf("FAIL: encode case %u into %u bytes: length %u\n",
+                   (unsigned) i, (unsigned)(sizeof(small) - 4), (unsigned) length);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+/**
+ * a frame of every parse case that is accepted ends up in the document as
+ * the value it stood for
+ */
+static int _testRoundTrip(void)
+{
+    int failed = 0;
+
+    for(size_t i = 0; i < sizeof(_parseCases) / sizeof(_parseCases[0]); i++)
+    {
+        const ParseCase_t *pCase = &_parseCases[i];
+        uint8_t frame[BRIDGE_FRAME_SIZE + 1];
+        BridgeFrame_t decoded;
+
+        if(pCase->accepted == false || pCase->valueBytes != WHOLE_FRAME)
+        {
+            continue;
+        }
+        _buildFrame(frame, pCase);
+        if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded) == false)
+        {
+            printf("FAIL: frame of parse case %u not decoded\n", (unsigned) i);
+            failed = 1;
+            continue;
+        }
+
+        int index = _schemaIndex(pCase->device, pCase->attribute);
+        const SchemaAttribute_t *pSchema = &_schemaAttributes[index];
+        const AttributeValue_t *values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { NULL };
+        char section[SHADOW_UPDATE_DOCUMENT_SIZE], expected[SHADOW_UPDATE_DOCUMENT_SIZE], text[BRIDGE_NUMBER_TEXT_MAX];
+        size_t length = 0;
+
+        values[index] = &decoded.value;
+        _encodeSection(values, section, sizeof(section), &length);
+        if(pSchema->valueType == VALUE_NUMBER)
+        {
+            _formatNumber(pCase->expected, pSchema->decimals, text);
+        }
+        else
+        {
+            snprintf(text, sizeof(text), "\"%s\"", pSchema->pChoices[pCase->expected]);
+        }
+        snprintf(expected, sizeof(expected), "{\"%s\":{\"%s\":%s}}", pSchema->pDevice, pSchema->pAttribute, text);
+
+        if(strcmp(section, expected) != 0)
+        {
+            printf("FAIL: parse case %u encoded as %s, expected %s\n", (unsigned) i, section, expected);
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int main(void)
+{
+    bridgeHostLogWarnings = 0;
+
+    int failed = _testParse();
+    failed |= _testFormat();
+    failed |= _testEncode();
+    failed |= _testRoundTrip();
+
+    printf("codec test %s, %u parse, %u format and %u encode cases\n",
+           failed ? "FAIL" : "passed",
+           (unsigned)(sizeof(_parseCases) / sizeof(_parseCases[0])),
+           (unsigned)(sizeof(_formatCases) / sizeof(_formatCases[0])),
+           (unsigned)(sizeof(_encodeCases) / sizeof(_encodeCases[0])));
+    return failed;
+}
@@ -0,0 +1,198 @@
+/**
+ * replays slider gestures from the app through the delta collapser. Every
+ * gesture sends a delta every few milliseconds, the mesh stand-in acks each
+ * command after a fixed time. Counts the commands written to the mesh and
+ * how long after the last delta of a gesture its final value was written,
+ * next to forwarding every delta in order, one per ack. Fails when the mesh
+ * does not end up with the final value of a gesture.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "host/bridge_host.h"
+#include "aws_iot_demo_shadow.c"
+
+#define COLLAPSE_BENCH_GESTURES (40)
+#define COLLAPSE_BENCH_GESTURE_MS (1500)//dragging, up to 210 ms longer
+#define COLLAPSE_BENCH_REST_MS (2000)//between gestures
+
+typedef struct CollapseScenario{
+    const char *pName;
+    uint32_t deltaIntervalMs;
+    uint32_t ackMs;
+    bool twoSliders;//brightness and colour temperature dragged together
+}CollapseScenario_t;
+
+static const CollapseScenario_t _scenarios[] =
+{
+    { "brightness, delta every 20 ms, mesh ack 80 ms", 20, 80, false },
+    { "brightness, delta every 20 ms, mesh ack 250 ms", 20, 250, false },
+    { "brightness, delta every 50 ms, mesh ack 250 ms", 50, 250, false },
+    { "two sliders, delta every 20 ms each, mesh ack 250 ms", 20, 250, true },
+};
+
+static BridgeContext_t _bench;
+static uint64_t _ackDueMs;
+static int32_t _meshBrightness;
+static int32_t _meshKelvin;
+static uint64_t _brightnessWrittenMs;
+static uint64_t _kelvinWrittenMs;
+
+static int32_t _commandValue(const char *pCommand, size_t commandLength, const char *pKey)
+{
+    char text[BRIDGE_HOST_COMMAND_MAX + 1];
+
+    memcpy(text, pCommand, commandLength);
+    text[commandLength] = '\0';
+    const char *pValue = strstr(text, pKey);
+    return (pValue == NULL) ? -1 : atoi(pValue + strlen(pKey));
+}
+
+/**
+ * the mesh takes the command and acks it after the time of the scenario
+ */
+static uint32_t _ackMs;
+static void _meshCommand(const char *pCommand, size_t commandLength)
+{
+    int32_t brightness = _commandValue(pCommand, commandLength, "\"brightness\":");
+    int32_t kelvin = _commandValue(pCommand, commandLength, "\"colorTemperatureInKelvin\":");
+
+    if(brightness >= 0)
+    {
+        _meshBrightness = brightness;
+        _brightnessWrittenMs = bridgeHostClockMs();
+    }
+    if(kelvin >= 0)
+    {
+        _meshKelvin = kelvin;
+        _kelvinWrittenMs = bridgeHostClockMs();
+    }
+    _ackDueMs = bridgeHostClockMs() + _ackMs;
+}
+
+static int32_t _sliderValue(uint32_t gesture, uint32_t elapsedMs, uint32_t gestureMs, int32_t from, int32_t to)
+{
+    //back and forth, every gesture ends somewhere else
+    int32_t end = from + (int32_t)((gesture * 37) % (uint32_t)(to - from + 1));
+    int32_t start = (gesture & 1) ? to : from;
+
+    return start + (end - start) * (int32_t)elapsedMs / (int32_t)gestureMs;
+}
+
+static bool _runScenario(const CollapseScenario_t *pScenario)
+{
+    DeltaCollapser_t *pCollapser = &_bench.deltaCollapser;
+    char document[256];
+    uint32_t version = 0, deltas = 0, wrong = 0;
+    uint64_t finalLatencyMs = 0, finalLatencyMaxMs = 0;
+    uint64_t rawLatencyMs = 0, rawLatencyMaxMs = 0, rawFreeMs = 0;
+
+    memset(&_bench, 0, sizeof(_bench));
+    bridgeHostReset();
+    bridgeHostCommandHook = _meshCommand;
+    _ackMs = pScenario->ackMs;
+    _ackDueMs = UINT64_MAX;
+    _meshBrightness = -1;
+    _meshKelvin = -1;
+    bridgeHostClockSet(1000);
+
+    for(uint32_t gesture = 0; gesture < COLLAPSE_BENCH_GESTURES; gesture++)
+    {
+        uint64_t gestureStartMs = bridgeHostClockMs();
+        uint64_t lastDeltaMs = 0;
+        uint32_t gestureMs = COLLAPSE_BENCH_GESTURE_MS + (gesture * 53) % 211;
+        uint32_t nextDeltaMs = 0;
+        int32_t brightness = 0, kelvin = 0;
+
+        for(uint32_t elapsedMs = 0; elapsedMs < gestureMs + COLLAPSE_BENCH_REST_MS; elapsedMs++)
+        {
+            uint64_t nowMs = gestureStartMs + elapsedMs;
+
+            bridgeHostClockSet(nowMs);
+            if(nowMs >= _ackDueMs)
+            {
+                //what uart ingress does for the cloud change frame of the mesh
+                __atomic_store_n(&pCollapser->acked, true, __ATOMIC_RELEASE);
+                _ackDueMs = UINT64_MAX;
+            }
+
+            if(elapsedMs == nextDeltaMs && elapsedMs <= gestureMs)
+            {
+                //the app does not send on a fixed beat
+                nextDeltaMs += pScenario->deltaIntervalMs + (deltas * 7) % (pScenario->deltaIntervalMs / 2 + 1);
+                brightness = _sliderValue(gesture, elapsedMs, gestureMs, 0, 100);
+                kelvin = _sliderValue(gesture + 7, elapsedMs, gestureMs, 2700, 6500);
+                int length = pScenario->twoSliders ?
+                    snprintf(document, sizeof(document),
+                             "{\"state\":{\"Lights\":{\"brightness\":%d,\"colorTemperatureInKelvin\":%d}},\"version\":%u}",
+                             brightness, kelvin, ++version) :
+                    snprintf(document, sizeof(document), "{\"state\":{\"Lights\":{\"brightness\":%d}},\"version\":%u}",
+                             brightness, ++version);
+                uint32_t receivedUs = (uint32_t) esp_timer_get_time();
+
+                if(_collapseDelta(pCollapser, 0, document, length, receivedUs) == false)
+                {
+                    printf("FAIL: delta not collapsed: %s\n", document);
+                    return false;
+                }
+                deltas++;
+                lastDeltaMs = nowMs;
+
+                //forwarded as they come, the mesh takes one per ack
+                uint64_t sentMs = (rawFreeMs > nowMs) ? rawFreeMs : nowMs;
+                rawFreeMs = sentMs + pScenario->ackMs;
+                if(nextDeltaMs > gestureMs)
+                {
+                    rawLatencyMs += sentMs - nowMs;
+                    rawLatencyMaxMs = (sentMs - nowMs > rawLatencyMaxMs) ? sentMs - nowMs : rawLatencyMaxMs;
+                }
+            }
+
+            if(_collapserWait(pCollapser) == 0)
+            {
+                _collapserRelease(&_bench);
+            }
+        }
+
+        uint64_t writtenMs = pScenario->twoSliders && _kelvinWrittenMs > _brightnessWrittenMs ?
+                             _kelvinWrittenMs : _brightnessWrittenMs;
+        if(_meshBrightness != brightness || (pScenario->twoSliders && _meshKelvin != kelvin) || writtenMs < lastDeltaMs)
+        {
+            wrong++;
+            continue;
+        }
+        finalLatencyMs += writtenMs - lastDeltaMs;
+        finalLatencyMaxMs = (writtenMs - lastDeltaMs > finalLatencyMaxMs) ? writtenMs - lastDeltaMs : finalLatencyMaxMs;
+    }
+
+    printf("%s:\n"
+           "  %u deltas, %u commands to the mesh (%u forwarding every delta), %llu uart bytes\n"
+           "  final value written %llu ms after the last delta on average, at most %llu ms"
+           " (%llu and %llu ms forwarding every delta, behind a backlog growing with every gesture)\n"
+           "  delta to write p50 %u ms p99 %u ms, %u collapsed, %u stale\n",
+           pScenario->pName, deltas, bridgeHostTraffic.uartCommands, deltas,
+           (unsigned long long) bridgeHostTraffic.uartBytes,
+           (unsigned long long)(finalLatencyMs / COLLAPSE_BENCH_GESTURES), (unsigned long long) finalLatencyMaxMs,
+           (unsigned long long)(rawLatencyMs / COLLAPSE_BENCH_GESTURES), (unsigned long long) rawLatencyMaxMs,
+           _latencyPercentileMs(&_bench.downlinkLatency[CLASS_CONTROL], 50),
+           _latencyPercentileMs(&_bench.downlinkLatency[CLASS_CONTROL], 99),
+           pCollapser->collapsedCount, pCollapser->staleCount);
+
+    if(wrong > 0)
+    {
+        printf("FAIL: the mesh missed the final value of %u gestures\n", wrong);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    bool passed = true;
+
+    for(size_t i = 0; i < sizeof(_scenarios) / sizeof(_scenarios[0]); i++)
+    {
+        passed &= _runScenario(&_scenarios[i]);
+    }
+    return passed ? 0 : 1;
+}
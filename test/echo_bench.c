@@ -0,0 +1,303 @@
+/**
+ * replays a mixed trace of local changes from the mesh and changes from the
+ * app through the shadow emulator, once with the echo filter and once
+ * without. Counts the commands written to the mesh and the shadow updates
+ * published over mqtt in both runs. The mesh stand-in applies every command
+ * and reports the state it took back, like the nodes do. Fails when the mesh
+ * is in another state with the filter than without at any event of the trace.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "host/bridge_host.h"
+#include "aws_iot_demo_shadow.c"
+
+#define ECHO_BENCH_EVENTS (3000)
+#define ECHO_BENCH_LOCAL_PERCENT (55)//the rest comes from the app
+#define ECHO_BENCH_MESH_ACK_MS (250)
+#define ECHO_BENCH_STEP_MS (10)
+
+typedef struct EchoBenchRun{
+    uint32_t deltas;//published by the shadow
+    uint32_t ownDeltas;//with the client token of a bridge update
+    uint32_t suppressed;
+    uint32_t uartCommands;
+    uint64_t uartBytes;
+    uint32_t shadowUpdates;
+    uint64_t shadowUpdateBytes;
+    uint32_t meshStates[ECHO_BENCH_EVENTS + 1];//hash of the state of the mesh before every event and at the end
+}EchoBenchRun_t;
+
+static char _meshValues[BRIDGE_SCHEMA_ATTRIBUTE_COUNT][BRIDGE_NUMBER_TEXT_MAX];//as the frames carry them
+static uint32_t _meshReportMask;
+static uint64_t _meshReportDueMs;
+static EncodeArena_t _arena;
+static uint32_t _random;
+
+static uint32_t _meshState(void)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < sizeof(_meshValues); i++)
+    {
+        hash = (hash ^ ((const uint8_t *) _meshValues)[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t _nextRandom(void)
+{
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+}
+
+static AwsIotShadowError_t _shadowUpdate(const char *pThingName, size_t thingNameLength,
+                                         const char *pDocument, size_t documentLength)
+{
+    (void) pThingName;
+    (void) thingNameLength;
+    return _shadowEmuUpdate(&_shadowEmulator, 0, pDocument, documentLength);
+}
+
+/**
+ * the frames a node sends for the attributes in the mask, with the values it
+ * holds
+ */
+static void _meshReport(UpdateOperation_t operation, uint32_t mask)
+{
+    FrameBatch_t batch = { .count = 0 };
+
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        const char *pDevice = NULL, *pAttribute = NULL;
+        uint8_t frame[BRIDGE_FRAME_SIZE + 1];
+        BridgeFrame_t decoded;
+
+        if((mask & (1u << i)) == 0)
+        {
+            continue;
+        }
+        for(size_t j = 0; j < sizeof(_deviceNames) / sizeof(_deviceNames[0]); j++)
+        {
+            pDevice = (_deviceNames[j].device == _schemaAttributes[i].device) ? _deviceNames[j].pName : pDevice;
+        }
+        for(size_t j = 0; j < sizeof(_attributeNames) / sizeof(_attributeNames[0]); j++)
+        {
+            pAttribute = (_attributeNames[j].attribute == _schemaAttributes[i].attribute) ? _attributeNames[j].pName : pAttribute;
+        }
+        memset(frame, 'x', BRIDGE_FRAME_SIZE);
+        frame[0] = (uint8_t)('0' + operation);
+        memcpy(frame + operationTypeLength, pDevice, strlen(pDevice));
+        memcpy(frame + operationTypeLength + deviceNameLength, pAttribute, strlen(pAttribute));
+        memcpy(frame + operationTypeLength + deviceNameLength + attributeNameLength, _meshValues[i], strlen(_meshValues[i]));
+        frame[BRIDGE_FRAME_SIZE] = '\0';
+        if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+        {
+            _batchAdd(&batch, &decoded);
+        }
+    }
+    if(batch.count > 0)
+    {
+        reportLocalChange(&batch, NULL, &_bridgeContext.things[0], &_arena, &_bridgeContext.echoFilter);
+    }
+}
+
+/**
+ * the node takes the values of the command and reports them back once it
+ * has applied them
+ */
+static void _meshCommand(const char *pCommand, size_t commandLength)
+{
+    SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+
+    //the state of the delta, there is only one thing so no thing prefix
+    if(_parseStateAttributes(pCommand, commandLength, values) == false)
+    {
+        return;
+    }
+    for(size_t i = 0; i < BRIDGE_SCHEMA_ATTRIBUTE_COUNT; i++)
+    {
+        if(values[i].pValue != NULL)
+        {
+            //enums are quoted in json, not in the frames
+            bool quoted = values[i].pValue[0] == '"';
+            size_t length = values[i].length - (quoted ? 2 : 0);
+
+            memcpy(_meshValues[i], values[i].pValue + (quoted ? 1 : 0), length);
+            _meshValues[i][length] = '\0';
+            _meshReportMask |= 1u << i;
+        }
+    }
+    _meshReportDueMs = bridgeHostClockMs() + ECHO_BENCH_MESH_ACK_MS;
+}
+
+/**
+ * the delta path of the mesh tx task
+ */
+static void _meshTxStep(bool echoFilter)
+{
+    DeltaCollapser_t *pCollapser = &_bridgeContext.deltaCollapser;
+    DeltaSlot_t *pSlot = NULL;
+
+    if(_meshReportMask != 0 && bridgeHostClockMs() >= _meshReportDueMs)
+    {
+        uint32_t mask = _meshReportMask;
+
+        _meshReportMask = 0;
+        __atomic_store_n(&pCollapser->acked, true, __ATOMIC_RELEASE);
+        _meshReport(CLOULD_CHANGE_ENDPOINT_STATE, mask);
+    }
+
+    while((pSlot = _mailboxTake(&_bridgeContext.deltaMailbox)) != NULL)
+    {
+        _mirrorApplyDelta(&_bridgeContext.shadowMirror, pSlot->thing, pSlot->document, pSlot->documentLength);
+        if(echoFilter == false ||
+           _echoMatch(&_bridgeContext.echoFilter, pSlot->thing, pSlot->document, pSlot->documentLength) == false)
+        {
+            if(_collapseDelta(pCollapser, pSlot->thing, pSlot->document, pSlot->documentLength,
+                              pSlot->receivedUs) == false)
+            {
+                pCollapser->uartBytes += _forwardDelta(pSlot->thing, pSlot->document, pSlot->documentLength);
+                _commandSent(&_bridgeContext);
+            }
+        }
+        _mailboxRelease(pSlot);
+    }
+
+    if(_collapserWait(pCollapser) == 0)
+    {
+        _collapserRelease(&_bridgeContext);
+    }
+}
+
+static void _advance(uint64_t ms, bool echoFilter)
+{
+    for(uint64_t elapsedMs = 0; elapsedMs < ms; elapsedMs += ECHO_BENCH_STEP_MS)
+    {
+        bridgeHostClockAdvance(ECHO_BENCH_STEP_MS);
+        _meshTxStep(echoFilter);
+    }
+}
+
+/**
+ * a value of the schema, as text of a frame
+ */
+static void _randomValue(size_t index, char text[BRIDGE_NUMBER_TEXT_MAX])
+{
+    const SchemaAttribute_t *pSchema = &_schemaAttributes[index];
+
+    if(pSchema->valueType == VALUE_NUMBER)
+    {
+        int32_t value = pSchema->minimum + (int32_t)(_nextRandom() % (uint32_t)(pSchema->maximum - pSchema->minimum + 1));
+        text[_formatNumber(value, pSchema->decimals, text)] = '\0';
+        return;
+    }
+    int choices = 0;
+    while(choices < SCHEMA_CHOICES_MAX && pSchema->pChoices[choices] != NULL)
+    {
+        choices++;
+    }
+    snprintf(text, BRIDGE_NUMBER_TEXT_MAX, "%s", pSchema->pChoices[_nextRandom() % choices]);
+}
+
+static bool _run(bool echoFilter, EchoBenchRun_t *pRun)
+{
+    char text[BRIDGE_NUMBER_TEXT_MAX];
+    char quoted[BRIDGE_NUMBER_TEXT_MAX + 2];
+    char document[BRIDGE_SCHEMA_ATTRIBUTE_COUNT * (BRIDGE_COMMAND_VALUE_SIZE + 64) + 64];
+
+    memset(&_bridgeContext, 0, sizeof(_bridgeContext));
+    memset(&_shadowEmulator, 0, sizeof(_shadowEmulator));
+    memset(_meshValues, 0, sizeof(_meshValues));
+    _meshReportMask = 0;
+    _random = 2463534242u;
+    bridgeHostReset();
+    bridgeHostClockSet(1000);
+    bridgeHostCommandHook = _meshCommand;
+    bridgeHostUpdateHook = _shadowUpdate;
+    _shadowEmulator.lock = xSemaphoreCreateMutex();
+    if(_prepareBridge(&_bridgeContext, "bench", 5) != EXIT_SUCCESS || _shadowEmulator.lock == NULL)
+    {
+        printf("FAIL: bridge not prepared\n");
+        return false;
+    }
+
+    for(uint32_t event = 0; event < ECHO_BENCH_EVENTS; event++)
+    {
+        size_t index;
+
+        //a change of the app often meets one from the mesh on its way
+        _advance(20 + _nextRandom() % 1980, echoFilter);
+        pRun->meshStates[event] = _meshState();
+        do
+        {
+            index = _nextRandom() % BRIDGE_SCHEMA_ATTRIBUTE_COUNT;
+        }while(_schemaAttributes[index].trafficClass == CLASS_TELEMETRY);
+        _randomValue(index, text);
+
+        if(_nextRandom() % 100 < ECHO_BENCH_LOCAL_PERCENT)
+        {
+            //someone pressed a switch, the node changed and reports it
+            strcpy(_meshValues[index], text);
+            _meshReport(LOCALLY_CHANGE_ENDPOINT_STATE, 1u << index);
+            continue;
+        }
+
+        //the app writes desired only, with its own client token
+        SyncValue_t values[BRIDGE_SCHEMA_ATTRIBUTE_COUNT] = { { NULL, 0 } };
+        values[index].length = snprintf(quoted, sizeof(quoted),
+                                        _schemaAttributes[index].valueType == VALUE_ENUM ? "\"%s\"" : "%s", text);
+        values[index].pValue = quoted;
+        size_t length = snprintf(document, sizeof(document), "{\"state\":{\"desired\":");
+        length += _writeStateObject(values, document + length, sizeof(document) - length);
+        length += snprintf(document + length, sizeof(document) - length, "},\"clientToken\":\"app-%u\"}", event);
+        _shadowEmuUpdate(&_shadowEmulator, 0, document, length);
+    }
+    _advance(10000, echoFilter);
+    pRun->meshStates[ECHO_BENCH_EVENTS] = _meshState();
+
+    pRun->deltas = _shadowEmulator.deltas;
+    pRun->ownDeltas = _shadowEmulator.ownDeltas;
+    pRun->suppressed = _bridgeContext.echoFilter.suppressedCount;
+    pRun->uartCommands = bridgeHostTraffic.uartCommands;
+    pRun->uartBytes = bridgeHostTraffic.uartBytes;
+    pRun->shadowUpdates = bridgeHostTraffic.shadowUpdates;
+    pRun->shadowUpdateBytes = bridgeHostTraffic.shadowUpdateBytes;
+
+    printf("echo filter %s: %u deltas, %u with the token of a bridge update, %u suppressed\n"
+           "  %u commands, %llu bytes to the mesh; %u shadow updates, %llu bytes over mqtt\n",
+           echoFilter ? "on" : "off", pRun->deltas, pRun->ownDeltas, pRun->suppressed,
+           pRun->uartCommands, (unsigned long long) pRun->uartBytes,
+           pRun->shadowUpdates, (unsigned long long) pRun->shadowUpdateBytes);
+    return true;
+}
+
+int main(void)
+{
+    static EchoBenchRun_t filtered, unfiltered;
+    uint32_t diverged = 0;
+
+    if(_run(false, &unfiltered) == false || _run(true, &filtered) == false)
+    {
+        return 1;
+    }
+
+    printf("removed by the filter: %d commands, %lld bytes to the mesh; %d shadow updates, %lld bytes over mqtt\n",
+           (int)(unfiltered.uartCommands - filtered.uartCommands),
+           (long long)(unfiltered.uartBytes - filtered.uartBytes),
+           (int)(unfiltered.shadowUpdates - filtered.shadowUpdates),
+           (long long)(unfiltered.shadowUpdateBytes - filtered.shadowUpdateBytes));
+
+    for(uint32_t event = 0; event <= ECHO_BENCH_EVENTS; event++)
+    {
+        diverged += (filtered.meshStates[event] != unfiltered.meshStates[event]);
+    }
+    if(diverged > 0)
+    {
+        printf("FAIL: the mesh is in another state with the echo filter at %u events\n", diverged);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+/**
+ * stress test of the encode path with several publisher threads, each with
+ * its own EncodeArena_t. Every thread decodes frames of its own values into
+ * batches and generates their shadow documents, which must equal the ones
+ * generated on one thread beforehand. Built with ThreadSanitizer by make test;
+ * make bench builds it without and reports how the documents per second scale
+ * with the number of threads.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "host/bridge_host.h"
+#include "aws_iot_demo_shadow.c"
+
+#ifndef ENCODE_STRESS_ROUNDS
+#define ENCODE_STRESS_ROUNDS (20000u)
+#endif
+#define ENCODE_STRESS_THREADS_MAX (8)
+#define ENCODE_STRESS_BATCHES (16)//distinct batches, every thread cycles through them
+
+typedef struct EncodeWorker{
+    pthread_t thread;
+    uint32_t index;
+    uint32_t rounds;
+    EncodeArena_t arena;
+    uint32_t documents;
+    uint32_t mismatches;
+}EncodeWorker_t;
+
+static char _expected[ENCODE_STRESS_THREADS_MAX][ENCODE_STRESS_BATCHES][SHADOW_UPDATE_DOCUMENT_SIZE];
+static EncodeWorker_t _workers[ENCODE_STRESS_THREADS_MAX];
+
+static uint64_t _nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void _frame(uint8_t frame[BRIDGE_FRAME_SIZE + 1], char operation, const char *pDevice,
+                   const char *pAttribute, const char *pValue)
+{
+    memset(frame, 'x', BRIDGE_FRAME_SIZE);
+    frame[0] = (uint8_t) operation;
+    memcpy(frame + operationTypeLength, pDevice, strlen(pDevice));
+    memcpy(frame + operationTypeLength + deviceNameLength, pAttribute, strlen(pAttribute));
+    memcpy(frame + operationTypeLength + deviceNameLength + attributeNameLength, pValue, strlen(pValue));
+    frame[BRIDGE_FRAME_SIZE] = '\0';
+}
+
+/**
+ * the frames of one batch, decoded the way the uart ingress does. The values
+ * depend on the worker and the batch, so a document written into the wrong
+ * arena shows up as a mismatch.
+ */
+static void _buildBatch(uint32_t worker, uint32_t batchIndex, FrameBatch_t *pBatch)
+{
+    uint8_t frame[BRIDGE_FRAME_SIZE + 1];
+    char brightness[8], kelvin[8], celsius[8];
+    BridgeFrame_t decoded;
+
+    snprintf(brightness, sizeof(brightness), "%u", (worker * 13 + batchIndex * 7) % 101);
+    snprintf(kelvin, sizeof(kelvin), "%u", 1000 + worker * 1000 + batchIndex * 100);
+    snprintf(celsius, sizeof(celsius), "%u.%u", 5 + worker + batchIndex, batchIndex % 10);
+
+    pBatch->count = 0;
+    _frame(frame, (batchIndex & 1) ? '2' : '1', "Lights", "ON_OFF", (batchIndex & 2) ? "ON" : "OFF");
+    if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+    {
+        _batchAdd(pBatch, &decoded);
+    }
+    _frame(frame, '1', "Lights", "POWER_LEVEL", brightness);
+    if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+    {
+        _batchAdd(pBatch, &decoded);
+    }
+    _frame(frame, '1', "Lights", "TEMPERATURE", kelvin);
+    if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+    {
+        _batchAdd(pBatch, &decoded);
+    }
+    _frame(frame, '1', "Lock", "LOCK_UNLOCK", (batchIndex & 4) ? "LOCK" : "UNLOCK");
+    if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+    {
+        _batchAdd(pBatch, &decoded);
+    }
+    _frame(frame, '1', "Thermo", "TEMPERATURE", celsius);
+    if(_decodeFrame(frame, BRIDGE_FRAME_SIZE, &decoded))
+    {
+        _batchAdd(pBatch, &decoded);
+    }
+}
+
+static void *_encodeWorker(void *pArgument)
+{
+    EncodeWorker_t *pWorker = pArgument;
+    FrameBatch_t batch;
+
+    for(uint32_t round = 0; round < pWorker->rounds; round++)
+    {
+        uint32_t batchIndex = round % ENCODE_STRESS_BATCHES;
+
+        _buildBatch(pWorker->index, batchIndex, &batch);
+        int length = generateBatchShadowDocument(&batch, 0, pWorker->arena.updateDocument,
+                                                 sizeof(pWorker->arena.updateDocument));
+        if(length <= 0 || strcmp(pWorker->arena.updateDocument, _expected[pWorker->index][batchIndex]) != 0)
+        {
+            pWorker->mismatches++;
+        }
+        pWorker->documents++;
+    }
+    return NULL;
+}
+
+/**
+ * documents per second with the given number of threads
+ */
+static double _run(uint32_t threads, uint32_t roundsPerThread, uint32_t *pMismatches)
+{
+    uint64_t startNs = _nowNs();
+
+    for(uint32_t i = 0; i < threads; i++)
+    {
+        _workers[i].index = i;
+        _workers[i].rounds = roundsPerThread;
+        _workers[i].documents = 0;
+        _workers[i].mismatches = 0;
+        pthread_create(&_workers[i].thread, NULL, _encodeWorker, &_workers[i]);
+    }
+
+    uint32_t documents = 0;
+    for(uint32_t i = 0; i < threads; i++)
+    {
+        pthread_join(_workers[i].thread, NULL);
+        documents += _workers[i].documents;
+        *pMismatches += _workers[i].mismatches;
+    }
+    return documents * 1e9 / (double)(_nowNs() - startNs);
+}
+
+int main(void)
+{
+    EncodeArena_t arena;
+    FrameBatch_t batch;
+    uint32_t mismatches = 0;
+
+    //the client token is taken from the clock, which stands still here
+    bridgeHostClockSet(123456);
+    for(uint32_t worker = 0; worker < ENCODE_STRESS_THREADS_MAX; worker++)
+    {
+        for(uint32_t batchIndex = 0; batchIndex < ENCODE_STRESS_BATCHES; batchIndex++)
+        {
+            _buildBatch(worker, batchIndex, &batch);
+            if(batch.count != 5 ||
+               generateBatchShadowDocument(&batch, 0, arena.updateDocument, sizeof(arena.updateDocument)) <= 0)
+            {
+                printf("FAIL: batch %u of worker %u has %u frames\n", batchIndex, worker, batch.count);
+                return 1;
+            }
+            strcpy(_expected[worker][batchIndex], arena.updateDocument);
+        }
+    }
+
+    double single = 0;
+    for(uint32_t threads = 1; threads <= ENCODE_STRESS_THREADS_MAX; threads *= 2)
+    {
+        double rate = _run(threads, ENCODE_STRESS_ROUNDS, &mismatches);
+
+        single = (threads == 1) ? rate : single;
+        printf("%u threads: %.0f documents/s, %.2fx one thread\n", threads, rate, rate / single);
+    }
+
+    if(mismatches > 0)
+    {
+        printf("FAIL: %u documents differ from the ones generated on one thread\n", mismatches);
+        return 1;
+    }
+    printf("encode stress test passed, %u distinct documents\n", ENCODE_STRESS_THREADS_MAX * ENCODE_STRESS_BATCHES);
+    return 0;
+}
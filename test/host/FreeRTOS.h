@@ -0,0 +1,25 @@
+/* host stand-in for the FreeRTOS types and macros the bridge uses, see bridge_host.h */
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdPASS (1)
+#define pdFAIL (0)
+#define pdTRUE (1)
+#define pdFALSE (0)
+#define portMAX_DELAY ((TickType_t) 0xffffffffu)
+#define portTICK_PERIOD_MS (1)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskIDLE_PRIORITY (0)
+#define configGENERATE_RUN_TIME_STATS (0)
+#define configUSE_TRACE_FACILITY (0)
+
+size_t xPortGetFreeHeapSize(void);
+
+#endif /* HOST_FREERTOS_H */
@@ -0,0 +1 @@
+/* host stand-in, the bridge takes nothing from the ip configuration */
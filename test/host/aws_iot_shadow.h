@@ -0,0 +1,73 @@
+/* host stand-in for the shadow library, updates are handed to the hook of
+ * bridge_host.h */
+#ifndef HOST_AWS_IOT_SHADOW_H
+#define HOST_AWS_IOT_SHADOW_H
+
+#include "iot_mqtt.h"
+
+typedef enum{
+    AWS_IOT_SHADOW_SUCCESS = 0,
+    AWS_IOT_SHADOW_STATUS_PENDING,
+    AWS_IOT_SHADOW_BAD_PARAMETER,
+    AWS_IOT_SHADOW_NOT_FOUND,
+    AWS_IOT_SHADOW_THROTTLED,
+    AWS_IOT_SHADOW_BAD_REQUEST,
+    AWS_IOT_SHADOW_TOO_LARGE,
+    AWS_IOT_SHADOW_NO_MEMORY,
+    AWS_IOT_SHADOW_TIMEOUT
+}AwsIotShadowError_t;
+
+typedef struct HostShadowOperation *AwsIotShadowOperation_t;
+
+typedef struct AwsIotShadowDocumentInfo{
+    const char *pThingName;
+    size_t thingNameLength;
+    IotMqttQos_t qos;
+    union{
+        struct{
+            void *(*mallocDocument)(size_t size);
+        }get;
+        struct{
+            const char *pUpdateDocument;
+            size_t updateDocumentLength;
+        }update;
+    }u;
+}AwsIotShadowDocumentInfo_t;
+#define AWS_IOT_SHADOW_DOCUMENT_INFO_INITIALIZER { 0 }
+
+typedef struct AwsIotShadowCallbackParam{
+    union{
+        struct{
+            const char *pDocument;
+            size_t documentLength;
+        }callback;
+    }u;
+}AwsIotShadowCallbackParam_t;
+
+typedef struct AwsIotShadowCallbackInfo{
+    void *pCallbackContext;
+    void (*function)(void *pContext, AwsIotShadowCallbackParam_t *pParam);
+}AwsIotShadowCallbackInfo_t;
+#define AWS_IOT_SHADOW_CALLBACK_INFO_INITIALIZER { 0 }
+
+#define AWS_IOT_SHADOW_FLAG_KEEP_SUBSCRIPTIONS (1)
+
+AwsIotShadowError_t AwsIotShadow_Init(uint32_t timeoutMs);
+void AwsIotShadow_Cleanup(void);
+const char *AwsIotShadow_strerror(AwsIotShadowError_t status);
+AwsIotShadowError_t AwsIotShadow_SetDeltaCallback(IotMqttConnection_t connection, const char *pThingName,
+                                                  size_t thingNameLength, uint32_t flags,
+                                                  const AwsIotShadowCallbackInfo_t *pCallbackInfo);
+AwsIotShadowError_t AwsIotShadow_SetUpdatedCallback(IotMqttConnection_t connection, const char *pThingName,
+                                                    size_t thingNameLength, uint32_t flags,
+                                                    const AwsIotShadowCallbackInfo_t *pCallbackInfo);
+AwsIotShadowError_t AwsIotShadow_TimedUpdate(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                             uint32_t flags, uint32_t timeoutMs);
+AwsIotShadowError_t AwsIotShadow_Update(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                        uint32_t flags, const AwsIotShadowCallbackInfo_t *pCallbackInfo,
+                                        AwsIotShadowOperation_t *pOperation);
+AwsIotShadowError_t AwsIotShadow_TimedGet(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                          uint32_t flags, uint32_t timeoutMs, const char **ppDocument,
+                                          size_t *pDocumentLength);
+
+#endif /* HOST_AWS_IOT_SHADOW_H */
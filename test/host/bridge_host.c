@@ -0,0 +1,514 @@
+/**
+ * the platform functions the bridge calls, implemented for the host tests,
+ * see bridge_host.h
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bridge_host.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "event_groups.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "driver/uart.h"
+#include "platform/iot_clock.h"
+#include "iot_json_utils.h"
+#include "iot_demo_logging.h"
+
+int bridgeHostLogWarnings = 1;
+BridgeHostTraffic_t bridgeHostTraffic;
+BridgeHostCommandHook_t bridgeHostCommandHook;
+BridgeHostUpdateHook_t bridgeHostUpdateHook;
+
+static uint64_t _clockMs = 1000;
+static uint32_t _randomState = 1;
+
+//the command being written, the bridge writes one in several pieces
+static char _command[BRIDGE_HOST_COMMAND_MAX];
+static size_t _commandLength;
+
+//any non-NULL handle, no task runs on the host
+static struct HostTask *const _hostTask = (struct HostTask *) &_hostTask;
+
+void bridgeHostReset(void)
+{
+    memset(&bridgeHostTraffic, 0, sizeof(bridgeHostTraffic));
+    bridgeHostCommandHook = NULL;
+    bridgeHostUpdateHook = NULL;
+    _commandLength = 0;
+}
+
+uint64_t bridgeHostClockMs(void)
+{
+    return __atomic_load_n(&_clockMs, __ATOMIC_RELAXED);
+}
+
+void bridgeHostClockSet(uint64_t nowMs)
+{
+    __atomic_store_n(&_clockMs, nowMs, __ATOMIC_RELAXED);
+}
+
+void bridgeHostClockAdvance(uint64_t ms)
+{
+    __atomic_fetch_add(&_clockMs, ms, __ATOMIC_RELAXED);
+}
+
+/*-----------------------------------------------------------*/
+
+uint64_t IotClock_GetTimeMs(void)
+{
+    return bridgeHostClockMs();
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)(bridgeHostClockMs() * 1000);
+}
+
+esp_reset_reason_t esp_reset_reason(void)
+{
+    return ESP_RST_POWERON;
+}
+
+void esp_restart(void)
+{
+    fprintf(stderr, "esp_restart called\n");
+    abort();
+}
+
+uint32_t esp_random(void)
+{
+    //xorshift, the same sequence on every run
+    uint32_t x = __atomic_load_n(&_randomState, __ATOMIC_RELAXED);
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    __atomic_store_n(&_randomState, x, __ATOMIC_RELAXED);
+    return x;
+}
+
+size_t xPortGetFreeHeapSize(void)
+{
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *pName, uint32_t stackDepth, void *pArgument,
+                                   UBaseType_t priority, TaskHandle_t *pTask, BaseType_t core)
+{
+    (void) function;
+    (void) pName;
+    (void) stackDepth;
+    (void) pArgument;
+    (void) priority;
+    (void) core;
+    if(pTask != NULL)
+    {
+        *pTask = _hostTask;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    (void) task;
+}
+
+/**
+ * nothing else runs while a task waits, so the wait only moves the clock
+ */
+void vTaskDelay(TickType_t ticks)
+{
+    bridgeHostClockAdvance((uint64_t) ticks * portTICK_PERIOD_MS);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return _hostTask;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    (void) task;
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *pHigherPriorityTaskWoken)
+{
+    (void) task;
+    if(pHigherPriorityTaskWoken != NULL)
+    {
+        *pHigherPriorityTaskWoken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+    (void) clearOnExit;
+    (void) ticks;
+    return 0;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    return 0;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *pStatus, UBaseType_t count, uint32_t *pTotalRunTime)
+{
+    (void) pStatus;
+    (void) count;
+    if(pTotalRunTime != NULL)
+    {
+        *pTotalRunTime = 0;
+    }
+    return 0;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    (void) task;
+    return 0;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    pthread_mutex_t *pMutex = malloc(sizeof(pthread_mutex_t));
+
+    if(pMutex != NULL)
+    {
+        pthread_mutex_init(pMutex, NULL);
+    }
+    return (SemaphoreHandle_t) pMutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    (void) ticks;
+    return pthread_mutex_lock((pthread_mutex_t *) semaphore) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return pthread_mutex_unlock((pthread_mutex_t *) semaphore) == 0 ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    pthread_mutex_destroy((pthread_mutex_t *) semaphore);
+    free(semaphore);
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    return calloc(1, sizeof(EventBits_t));
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    return __atomic_or_fetch((EventBits_t *) group, bits, __ATOMIC_ACQ_REL);
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clearOnExit,
+                                BaseType_t waitForAll, TickType_t ticks)
+{
+    (void) waitForAll;
+    (void) ticks;
+    if(clearOnExit)
+    {
+        return __atomic_fetch_and((EventBits_t *) group, ~bits, __ATOMIC_ACQ_REL);
+    }
+    return __atomic_load_n((EventBits_t *) group, __ATOMIC_ACQUIRE);
+}
+
+/*-----------------------------------------------------------*/
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *pConfig)
+{
+    (void) port;
+    (void) pConfig;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+    (void) port;
+    (void) tx;
+    (void) rx;
+    (void) rts;
+    (void) cts;
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rxSize, int txSize, int queueSize, void *pQueue, int flags)
+{
+    (void) port;
+    (void) rxSize;
+    (void) txSize;
+    (void) queueSize;
+    (void) pQueue;
+    (void) flags;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *pLength)
+{
+    (void) port;
+    *pLength = 0;
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t port, uint8_t *pBuffer, uint32_t length, TickType_t ticks)
+{
+    (void) port;
+    (void) pBuffer;
+    (void) length;
+    (void) ticks;
+    return 0;
+}
+
+/**
+ * a command ends with '\n', the hook gets it once it is complete
+ */
+int uart_write_bytes(uart_port_t port, const char *pData, size_t length)
+{
+    (void) port;
+    bridgeHostTraffic.uartBytes += length;
+    for(size_t i = 0; i < length; i++)
+    {
+        if(pData[i] != '\n')
+        {
+            if(_commandLength < sizeof(_command))
+            {
+                _command[_commandLength++] = pData[i];
+            }
+            continue;
+        }
+        bridgeHostTraffic.uartCommands++;
+        if(bridgeHostCommandHook != NULL)
+        {
+            bridgeHostCommandHook(_command, _commandLength);
+        }
+        _commandLength = 0;
+    }
+    return (int) length;
+}
+
+/*-----------------------------------------------------------*/
+
+IotMqttError_t IotMqtt_Init(void)
+{
+    return IOT_MQTT_SUCCESS;
+}
+
+void IotMqtt_Cleanup(void)
+{
+}
+
+IotMqttError_t IotMqtt_Connect(const IotMqttNetworkInfo_t *pNetworkInfo, const IotMqttConnectInfo_t *pConnectInfo,
+                               uint32_t timeoutMs, IotMqttConnection_t *pConnection)
+{
+    (void) pNetworkInfo;
+    (void) pConnectInfo;
+    (void) timeoutMs;
+    (void) pConnection;
+    return IOT_MQTT_NETWORK_ERROR;
+}
+
+void IotMqtt_Disconnect(IotMqttConnection_t connection, uint32_t flags)
+{
+    (void) connection;
+    (void) flags;
+}
+
+const char *IotMqtt_strerror(IotMqttError_t status)
+{
+    return status == IOT_MQTT_SUCCESS ? "SUCCESS" : "FAILED";
+}
+
+AwsIotShadowError_t AwsIotShadow_Init(uint32_t timeoutMs)
+{
+    (void) timeoutMs;
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+void AwsIotShadow_Cleanup(void)
+{
+}
+
+const char *AwsIotShadow_strerror(AwsIotShadowError_t status)
+{
+    return status == AWS_IOT_SHADOW_SUCCESS ? "SUCCESS" : "FAILED";
+}
+
+AwsIotShadowError_t AwsIotShadow_SetDeltaCallback(IotMqttConnection_t connection, const char *pThingName,
+                                                  size_t thingNameLength, uint32_t flags,
+                                                  const AwsIotShadowCallbackInfo_t *pCallbackInfo)
+{
+    (void) connection;
+    (void) pThingName;
+    (void) thingNameLength;
+    (void) flags;
+    (void) pCallbackInfo;
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+AwsIotShadowError_t AwsIotShadow_SetUpdatedCallback(IotMqttConnection_t connection, const char *pThingName,
+                                                    size_t thingNameLength, uint32_t flags,
+                                                    const AwsIotShadowCallbackInfo_t *pCallbackInfo)
+{
+    (void) connection;
+    (void) pThingName;
+    (void) thingNameLength;
+    (void) flags;
+    (void) pCallbackInfo;
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+AwsIotShadowError_t AwsIotShadow_TimedUpdate(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                             uint32_t flags, uint32_t timeoutMs)
+{
+    (void) connection;
+    (void) flags;
+    (void) timeoutMs;
+    bridgeHostTraffic.shadowUpdates++;
+    bridgeHostTraffic.shadowUpdateBytes += pInfo->u.update.updateDocumentLength;
+    if(bridgeHostUpdateHook != NULL)
+    {
+        return bridgeHostUpdateHook(pInfo->pThingName, pInfo->thingNameLength,
+                                    pInfo->u.update.pUpdateDocument, pInfo->u.update.updateDocumentLength);
+    }
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+AwsIotShadowError_t AwsIotShadow_Update(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                        uint32_t flags, const AwsIotShadowCallbackInfo_t *pCallbackInfo,
+                                        AwsIotShadowOperation_t *pOperation)
+{
+    (void) pCallbackInfo;
+    (void) pOperation;
+    AwsIotShadowError_t status = AwsIotShadow_TimedUpdate(connection, pInfo, flags, 0);
+    return status == AWS_IOT_SHADOW_SUCCESS ? AWS_IOT_SHADOW_STATUS_PENDING : status;
+}
+
+AwsIotShadowError_t AwsIotShadow_TimedGet(IotMqttConnection_t connection, const AwsIotShadowDocumentInfo_t *pInfo,
+                                          uint32_t flags, uint32_t timeoutMs, const char **ppDocument,
+                                          size_t *pDocumentLength)
+{
+    (void) connection;
+    (void) pInfo;
+    (void) flags;
+    (void) timeoutMs;
+    (void) ppDocument;
+    (void) pDocumentLength;
+    return AWS_IOT_SHADOW_NOT_FOUND;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t _skipSpace(const char *pText, size_t length, size_t position)
+{
+    while(position < length && (pText[position] == ' ' || pText[position] == '\t' ||
+                                pText[position] == '\r' || pText[position] == '\n'))
+    {
+        position++;
+    }
+    return position;
+}
+
+/**
+ * Like the iot libraries the first "key": anywhere in the document is taken,
+ * at any depth. A string value is returned with its quotes, an object or
+ * array with its brackets.
+ */
+bool IotJsonUtils_FindJsonValue(const char *pJsonDocument, size_t jsonDocumentLength, const char *pJsonKey,
+                                size_t jsonKeyLength, const char **pJsonValue, size_t *pJsonValueLength)
+{
+    for(size_t i = 0; i + jsonKeyLength + 2 <= jsonDocumentLength; i++)
+    {
+        if(pJsonDocument[i] != '"' ||
+           strncmp(pJsonDocument + i + 1, pJsonKey, jsonKeyLength) != 0 ||
+           pJsonDocument[i + 1 + jsonKeyLength] != '"')
+        {
+            continue;
+        }
+
+        size_t position = _skipSpace(pJsonDocument, jsonDocumentLength, i + jsonKeyLength + 2);
+        if(position >= jsonDocumentLength || pJsonDocument[position] != ':')
+        {
+            continue;
+        }
+        position = _skipSpace(pJsonDocument, jsonDocumentLength, position + 1);
+        if(position >= jsonDocumentLength)
+        {
+            return false;
+        }
+
+        size_t end = position;
+        char first = pJsonDocument[position];
+
+        if(first == '"')
+        {
+            for(end = position + 1; end < jsonDocumentLength && pJsonDocument[end] != '"'; end++)
+            {
+                end += (pJsonDocument[end] == '\\') ? 1 : 0;
+            }
+            if(end >= jsonDocumentLength)
+            {
+                return false;
+            }
+            end++;
+        }
+        else if(first == '{' || first == '[')
+        {
+            int nesting = 0;
+            bool inString = false;
+
+            for(; end < jsonDocumentLength; end++)
+            {
+                char c = pJsonDocument[end];
+
+                if(inString)
+                {
+                    end += (c == '\\') ? 1 : 0;
+                    inString = (c != '"');
+                }
+                else if(c == '"')
+                {
+                    inString = true;
+                }
+                else if(c == '{' || c == '[')
+                {
+                    nesting++;
+                }
+                else if((c == '}' || c == ']') && --nesting == 0)
+                {
+                    break;
+                }
+            }
+            if(end >= jsonDocumentLength)
+            {
+                return false;
+            }
+            end++;
+        }
+        else
+        {
+            while(end < jsonDocumentLength && pJsonDocument[end] != ',' && pJsonDocument[end] != '}' &&
+                  pJsonDocument[end] != ']' && pJsonDocument[end] != ' ' && pJsonDocument[end] != '\n')
+            {
+                end++;
+            }
+        }
+
+        *pJsonValue = pJsonDocument + position;
+        *pJsonValueLength = end - position;
+        return true;
+    }
+    return false;
+}
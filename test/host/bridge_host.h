@@ -0,0 +1,62 @@
+/**
+ * host platform the tests build the whole bridge against. The headers in
+ * this directory stand in for esp-idf, FreeRTOS and the iot libraries, and
+ * bridge_host.c implements them: tasks are never started, the clock only
+ * moves when a test or a vTaskDelay moves it, uart writes are captured as
+ * commands and shadow updates go to a hook. A test includes this header and
+ * then aws_iot_demo_shadow.c, so it reaches the static functions.
+ */
+
+#ifndef BRIDGE_HOST_H
+#define BRIDGE_HOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "aws_iot_shadow.h"
+
+/**
+ * longest command the uart capture keeps
+ */
+#define BRIDGE_HOST_COMMAND_MAX (2048)
+
+/**
+ * called with every command the bridge writes to the uart, without its '\n'
+ */
+typedef void (*BridgeHostCommandHook_t)(const char *pCommand, size_t commandLength);
+
+/**
+ * called with every shadow update the bridge publishes, returns the answer of
+ * the shadow service. Without a hook every update is accepted.
+ */
+typedef AwsIotShadowError_t (*BridgeHostUpdateHook_t)(const char *pThingName, size_t thingNameLength,
+                                                      const char *pDocument, size_t documentLength);
+
+/**
+ * what went over the uart and mqtt since the last bridgeHostReset
+ */
+typedef struct BridgeHostTraffic{
+    uint32_t uartCommands;
+    uint64_t uartBytes;
+    uint32_t shadowUpdates;
+    uint64_t shadowUpdateBytes;
+}BridgeHostTraffic_t;
+
+extern BridgeHostTraffic_t bridgeHostTraffic;
+extern BridgeHostCommandHook_t bridgeHostCommandHook;
+extern BridgeHostUpdateHook_t bridgeHostUpdateHook;
+
+/**
+ * clear the traffic counters and the hooks, the clock is left alone
+ */
+void bridgeHostReset(void);
+
+/**
+ * the clock of IotClock_GetTimeMs and esp_timer_get_time, safe to read from
+ * any thread
+ */
+uint64_t bridgeHostClockMs(void);
+void bridgeHostClockSet(uint64_t nowMs);
+void bridgeHostClockAdvance(uint64_t ms);
+
+#endif /* BRIDGE_HOST_H */
@@ -0,0 +1,38 @@
+/* host stand-in for the esp uart driver, writes are captured by bridge_host.c */
+#ifndef HOST_DRIVER_UART_H
+#define HOST_DRIVER_UART_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "FreeRTOS.h"
+
+typedef int esp_err_t;
+#define ESP_OK (0)
+#define ESP_ERROR_CHECK(x) ((void)(x))
+
+typedef enum{ UART_NUM_1 = 1 }uart_port_t;
+typedef enum{ UART_DATA_8_BITS }uart_word_length_t;
+typedef enum{ UART_PARITY_DISABLE }uart_parity_t;
+typedef enum{ UART_STOP_BITS_1 }uart_stop_bits_t;
+typedef enum{ UART_HW_FLOWCTRL_DISABLE }uart_hw_flowcontrol_t;
+
+typedef struct{
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+}uart_config_t;
+
+#define GPIO_NUM_16 (16)
+#define GPIO_NUM_17 (17)
+#define UART_PIN_NO_CHANGE (-1)
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *pConfig);
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts);
+esp_err_t uart_driver_install(uart_port_t port, int rxSize, int txSize, int queueSize, void *pQueue, int flags);
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *pLength);
+int uart_read_bytes(uart_port_t port, uint8_t *pBuffer, uint32_t length, TickType_t ticks);
+int uart_write_bytes(uart_port_t port, const char *pData, size_t length);
+
+#endif /* HOST_DRIVER_UART_H */
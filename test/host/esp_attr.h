@@ -0,0 +1,7 @@
+/* host stand-in for the esp-idf attributes */
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+#define RTC_NOINIT_ATTR
+
+#endif /* HOST_ESP_ATTR_H */
@@ -0,0 +1,18 @@
+/* host stand-in for the esp system api */
+#ifndef HOST_ESP_SYSTEM_H
+#define HOST_ESP_SYSTEM_H
+
+#include <stdint.h>
+
+typedef enum{
+    ESP_RST_UNKNOWN,
+    ESP_RST_POWERON,
+    ESP_RST_BROWNOUT,
+    ESP_RST_SW
+}esp_reset_reason_t;
+
+esp_reset_reason_t esp_reset_reason(void);
+void esp_restart(void);
+uint32_t esp_random(void);
+
+#endif /* HOST_ESP_SYSTEM_H */
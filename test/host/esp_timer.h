@@ -0,0 +1,9 @@
+/* host stand-in for the esp timer, it follows the clock of bridge_host.h */
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif /* HOST_ESP_TIMER_H */
@@ -0,0 +1,9 @@
+/* host stand-in for the demo configuration */
+#ifndef HOST_IOT_CONFIG_H
+#define HOST_IOT_CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#endif /* HOST_IOT_CONFIG_H */
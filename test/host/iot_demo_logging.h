@@ -0,0 +1,16 @@
+/* host logging, warnings and errors go to stderr, info and debug are
+ * compiled but not printed */
+#ifndef HOST_IOT_DEMO_LOGGING_H
+#define HOST_IOT_DEMO_LOGGING_H
+
+#include <stdio.h>
+
+#define IotLogError(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while(0)
+#define IotLogWarn(...) do { if(bridgeHostLogWarnings) { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } } while(0)
+#define IotLogInfo(...) do { if(0) { printf(__VA_ARGS__); } } while(0)
+#define IotLogDebug(...) do { if(0) { printf(__VA_ARGS__); } } while(0)
+
+/* tests that feed invalid input on purpose turn warnings off */
+extern int bridgeHostLogWarnings;
+
+#endif /* HOST_IOT_DEMO_LOGGING_H */
@@ -0,0 +1,11 @@
+/* the json lookup of the iot libraries, implemented in bridge_host.c */
+#ifndef HOST_IOT_JSON_UTILS_H
+#define HOST_IOT_JSON_UTILS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool IotJsonUtils_FindJsonValue(const char *pJsonDocument, size_t jsonDocumentLength, const char *pJsonKey,
+                                size_t jsonKeyLength, const char **pJsonValue, size_t *pJsonValueLength);
+
+#endif /* HOST_IOT_JSON_UTILS_H */
@@ -0,0 +1,90 @@
+/* host stand-in for the mqtt library types the bridge uses, no broker is
+ * reached on the host */
+#ifndef HOST_IOT_MQTT_H
+#define HOST_IOT_MQTT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum{
+    IOT_NETWORK_SUCCESS = 0,
+    IOT_NETWORK_FAILURE
+}IotNetworkError_t;
+
+typedef struct IotNetworkInterface{
+    IotNetworkError_t (*create)(void *pServerInfo, void *pCredentialInfo, void **pConnection);
+    IotNetworkError_t (*close)(void *pConnection);
+    IotNetworkError_t (*destroy)(void *pConnection);
+}IotNetworkInterface_t;
+
+typedef struct HostMqttConnection *IotMqttConnection_t;
+#define IOT_MQTT_CONNECTION_INITIALIZER NULL
+
+typedef enum{
+    IOT_MQTT_SUCCESS = 0,
+    IOT_MQTT_STATUS_PENDING,
+    IOT_MQTT_TIMEOUT,
+    IOT_MQTT_NETWORK_ERROR
+}IotMqttError_t;
+
+typedef enum{
+    IOT_MQTT_QOS_0 = 0,
+    IOT_MQTT_QOS_1
+}IotMqttQos_t;
+
+typedef struct IotMqttCallbackParam{
+    union{
+        struct{
+            struct{
+                const void *pPayload;
+                size_t payloadLength;
+            }info;
+        }message;
+    }u;
+}IotMqttCallbackParam_t;
+
+typedef struct IotMqttCallbackInfo{
+    void *pCallbackContext;
+    void (*function)(void *pContext, IotMqttCallbackParam_t *pParam);
+}IotMqttCallbackInfo_t;
+
+typedef struct IotMqttSubscription{
+    IotMqttQos_t qos;
+    const char *pTopicFilter;
+    uint16_t topicFilterLength;
+    IotMqttCallbackInfo_t callback;
+}IotMqttSubscription_t;
+
+typedef struct IotMqttNetworkInfo{
+    bool createNetworkConnection;
+    union{
+        void *pNetworkConnection;
+        struct{
+            void *pNetworkServerInfo;
+            void *pNetworkCredentialInfo;
+        }setup;
+    }u;
+    const IotNetworkInterface_t *pNetworkInterface;
+}IotMqttNetworkInfo_t;
+#define IOT_MQTT_NETWORK_INFO_INITIALIZER { 0 }
+
+typedef struct IotMqttConnectInfo{
+    bool awsIotMqttMode;
+    bool cleanSession;
+    const IotMqttSubscription_t *pPreviousSubscriptions;
+    size_t previousSubscriptionCount;
+    uint16_t keepAliveSeconds;
+    const char *pClientIdentifier;
+    uint16_t clientIdentifierLength;
+}IotMqttConnectInfo_t;
+#define IOT_MQTT_CONNECT_INFO_INITIALIZER { 0 }
+
+IotMqttError_t IotMqtt_Init(void);
+void IotMqtt_Cleanup(void);
+IotMqttError_t IotMqtt_Connect(const IotMqttNetworkInfo_t *pNetworkInfo, const IotMqttConnectInfo_t *pConnectInfo,
+                               uint32_t timeoutMs, IotMqttConnection_t *pConnection);
+void IotMqtt_Disconnect(IotMqttConnection_t connection, uint32_t flags);
+const char *IotMqtt_strerror(IotMqttError_t status);
+
+#endif /* HOST_IOT_MQTT_H */
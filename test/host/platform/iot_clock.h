@@ -0,0 +1,9 @@
+/* host stand-in for the iot clock, it follows the clock of bridge_host.h */
+#ifndef HOST_IOT_CLOCK_H
+#define HOST_IOT_CLOCK_H
+
+#include <stdint.h>
+
+uint64_t IotClock_GetTimeMs(void);
+
+#endif /* HOST_IOT_CLOCK_H */
@@ -0,0 +1,8 @@
+/* host stand-in for the iot threads api, only the types are used */
+#ifndef HOST_IOT_THREADS_H
+#define HOST_IOT_THREADS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#endif /* HOST_IOT_THREADS_H */
@@ -0,0 +1,9 @@
+/* host stand-in for the FreeRTOS queue api, only the handle type is used */
+#ifndef HOST_QUEUE_H
+#define HOST_QUEUE_H
+
+#include "task.h"
+
+typedef struct HostQueue *QueueHandle_t;
+
+#endif /* HOST_QUEUE_H */
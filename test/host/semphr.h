@@ -0,0 +1,14 @@
+/* host stand-in for the FreeRTOS mutexes, backed by pthread mutexes */
+#ifndef HOST_SEMPHR_H
+#define HOST_SEMPHR_H
+
+#include "queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+#endif /* HOST_SEMPHR_H */
@@ -0,0 +1,27 @@
+/**
+ * the few definitions aws_iot_shadow_limiter.h takes from the shadow library
+ * and the iot clock, so the limiter builds on the host. The clock is a
+ * variable the test advances.
+ */
+
+#ifndef LIMITER_HOST_H
+#define LIMITER_HOST_H
+
+#include <stdint.h>
+
+typedef enum AwsIotShadowError{
+    AWS_IOT_SHADOW_SUCCESS = 0,
+    AWS_IOT_SHADOW_STATUS_PENDING,
+    AWS_IOT_SHADOW_THROTTLED
+}AwsIotShadowError_t;
+
+static uint64_t _hostNowMs;
+
+static inline uint64_t IotClock_GetTimeMs(void)
+{
+    return _hostNowMs;
+}
+
+#include "aws_iot_shadow_limiter.h"
+
+#endif /* LIMITER_HOST_H */
@@ -0,0 +1,230 @@
+/**
+ * test of the shadow update limiter against a stand-in for the shadow service
+ * that throttles a thing above a fixed number of updates per second. A slider
+ * changes one value every few ms for a while; the publisher loop is the one of
+ * _shadowPublisherTask on a simulated clock: a changed value waits in the
+ * batch until the limiter gives a token, a throttled update keeps it there.
+ * The test checks that the last value always reaches the shadow, that no
+ * change waits longer than a bound, and that throttling stays rare.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "limiter_host.h"
+
+#define STANDIN_WINDOW_MS (1000)
+#define STANDIN_MAX_UPDATES (64)
+
+#define LIMITER_TEST_MAX_LATENCY_MS (2000)
+#define LIMITER_TEST_MAX_THROTTLED_PERMILLE (200)
+
+/**
+ * the shadow of one thing, accepting at most limitPerSec updates in any
+ * window of a second
+ */
+typedef struct ShadowStandIn{
+    uint32_t limitPerSec;
+    uint64_t acceptedMs[STANDIN_MAX_UPDATES];//ring of the times of accepted updates
+    uint32_t acceptedCount;
+    int32_t value;
+    uint32_t accepted;
+    uint32_t throttled;
+}ShadowStandIn_t;
+
+typedef struct LimiterScenario{
+    const char *pName;
+    uint32_t limitPerSec;//of the stand-in
+    uint32_t changeEveryMs;//of the slider
+    uint32_t changes;
+    uint32_t pauseEveryChanges;//the slider rests this often, 0 for never
+    uint32_t pauseMs;
+}LimiterScenario_t;
+
+static const LimiterScenario_t _scenarios[] = {
+    { "steady slider, 5 updates/s allowed", 5, 20, 2000, 0, 0 },
+    { "steady slider, 2 updates/s allowed", 2, 20, 2000, 0, 0 },
+    { "bursts with rests, 5 updates/s allowed", 5, 10, 3000, 100, 3000 },
+    { "slow changes under the limit", 5, 400, 100, 0, 0 },
+};
+
+static AwsIotShadowError_t _standInUpdate(ShadowStandIn_t *pShadow, int32_t value)
+{
+    uint32_t recent = 0;
+
+    for(uint32_t i = 0; i < pShadow->acceptedCount && i < STANDIN_MAX_UPDATES; i++)
+    {
+        if(_hostNowMs - pShadow->acceptedMs[i] < STANDIN_WINDOW_MS)
+        {
+            recent++;
+        }
+    }
+    if(recent >= pShadow->limitPerSec)
+    {
+        pShadow->throttled++;
+        return AWS_IOT_SHADOW_THROTTLED;
+    }
+
+    pShadow->acceptedMs[pShadow->acceptedCount % STANDIN_MAX_UPDATES] = _hostNowMs;
+    pShadow->acceptedCount++;
+    pShadow->value = value;
+    pShadow->accepted++;
+    return AWS_IOT_SHADOW_SUCCESS;
+}
+
+static int _runScenario(const LimiterScenario_t *pScenario)
+{
+    ShadowStandIn_t shadow = { .limitPerSec = pScenario->limitPerSec, .value = -1 };
+    RateLimiter_t limiter;
+    uint32_t sent = 0, maxLatencyMs = 0;
+    uint64_t latencySumMs = 0;
+    uint32_t latencyCount = 0;
+
+    _hostNowMs = 1000;
+    _rateLimiterInit(&limiter);
+
+    //the value waiting in the batch and the time of the oldest change it holds
+    bool pending = false;
+    int32_t pendingValue = 0;
+    uint64_t pendingSinceMs = 0;
+
+    uint32_t changed = 0;
+    uint64_t nextChangeMs = _hostNowMs;
+    uint64_t waitUntilMs = 0;
+
+    while(changed < pScenario->changes || pending)
+    {
+        if(changed < pScenario->changes && _hostNowMs >= nextChangeMs)
+        {
+            if(pending == false)
+            {
+                pendingSinceMs = _hostNowMs;
+            }
+            pending = true;
+            pendingValue = (int32_t) changed;
+            changed++;
+            nextChangeMs = _hostNowMs + pScenario->changeEveryMs;
+            if(pScenario->pauseEveryChanges > 0 && changed % pScenario->pauseEveryChanges == 0)
+            {
+                nextChangeMs += pScenario->pauseMs;
+            }
+        }
+
+        if(pending && _hostNowMs >= waitUntilMs)
+        {
+            uint32_t waitMs = _rateLimiterAcquire(&limiter);
+
+            if(waitMs > 0)
+            {
+                waitUntilMs = _hostNowMs + waitMs;
+            }
+            else
+            {
+                AwsIotShadowError_t result = _standInUpdate(&shadow, pendingValue);
+
+                sent++;
+                _rateLimiterFeedback(&limiter, result);
+                if(result == AWS_IOT_SHADOW_SUCCESS)
+                {
+                    uint32_t latencyMs = (uint32_t)(_hostNowMs - pendingSinceMs);
+
+                    maxLatencyMs = (latencyMs > maxLatencyMs) ? latencyMs : maxLatencyMs;
+                    latencySumMs += latencyMs;
+                    latencyCount++;
+                    pending = false;
+                }
+            }
+        }
+
+        _hostNowMs++;
+    }
+
+    uint32_t throttledPermille = (sent > 0) ? shadow.throttled * 1000 / sent : 0;
+
+    printf("%s: %u changes, %u updates sent, %u accepted, %u throttled, final rate %u.%u/s, latency avg %u ms max %u ms\n",
+           pScenario->pName,
+           pScenario->changes,
+           sent,
+           shadow.accepted,
+           shadow.throttled,
+           limiter.rateMilli / 1000,
+           (limiter.rateMilli % 1000) / 100,
+           latencyCount > 0 ? (uint32_t)(latencySumMs / latencyCount) : 0,
+           maxLatencyMs);
+
+    if(shadow.value != (int32_t)(pScenario->changes - 1))
+    {
+        printf("FAIL: the shadow holds %d, the last value was %u\n", shadow.value, pScenario->changes - 1);
+        return 1;
+    }
+    if(maxLatencyMs > LIMITER_TEST_MAX_LATENCY_MS)
+    {
+        printf("FAIL: a change waited %u ms, more than %u ms\n", maxLatencyMs, LIMITER_TEST_MAX_LATENCY_MS);
+        return 1;
+    }
+    if(throttledPermille > LIMITER_TEST_MAX_THROTTLED_PERMILLE)
+    {
+        printf("FAIL: %u.%u%% of the updates were throttled\n", throttledPermille / 10, throttledPermille % 10);
+        return 1;
+    }
+    if(limiter.throttledCount != shadow.throttled)
+    {
+        printf("FAIL: the limiter counted %u throttled updates, the shadow %u\n", limiter.throttledCount, shadow.throttled);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * a token given back is usable at once and the bucket never holds more than
+ * the burst
+ */
+static int _testRelease(void)
+{
+    RateLimiter_t limiter;
+
+    _hostNowMs = 0;
+    _rateLimiterInit(&limiter);
+    for(int i = 0; i < BRIDGE_RATE_BURST; i++)
+    {
+        if(_rateLimiterAcquire(&limiter) != 0)
+        {
+            printf("FAIL: token %d of the burst was not available\n", i);
+            return 1;
+        }
+    }
+    if(_rateLimiterAcquire(&limiter) == 0 || _rateLimiterNearLimit(&limiter) == false)
+    {
+        printf("FAIL: an empty bucket gave a token\n");
+        return 1;
+    }
+    _rateLimiterRelease(&limiter);
+    if(_rateLimiterAcquire(&limiter) != 0)
+    {
+        printf("FAIL: a released token was not available\n");
+        return 1;
+    }
+    for(int i = 0; i < 2 * BRIDGE_RATE_BURST; i++)
+    {
+        _rateLimiterRelease(&limiter);
+    }
+    if(limiter.tokensMilli != BRIDGE_RATE_BURST * 1000)
+    {
+        printf("FAIL: the bucket holds %u tokens * 1000 after releases\n", limiter.tokensMilli);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int failed = _testRelease();
+
+    for(size_t i = 0; i < sizeof(_scenarios) / sizeof(_scenarios[0]); i++)
+    {
+        failed |= _runScenario(&_scenarios[i]);
+    }
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
@@ -0,0 +1,87 @@
+/**
+ * micro-benchmark of the spsc ring with the element size of the bridge
+ * frames. Reports the cost of a push and pop pair on one thread, and the
+ * throughput with the producer and the consumer on two threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "ring_host.h"
+
+#define RING_BENCH_CAPACITY (64)
+#define RING_BENCH_ELEMENTS (20000000u)
+#define RING_BENCH_ELEMENT_SIZE (28)//sizeof(BridgeFrame_t) on the esp32
+
+typedef struct RingBenchElement{
+    uint8_t bytes[RING_BENCH_ELEMENT_SIZE];
+}RingBenchElement_t;
+
+static SpscRing_t _ring;
+
+static uint64_t _nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static void *_producer(void *pArgument)
+{
+    RingBenchElement_t element = { { 0 } };
+
+    (void) pArgument;
+    for(uint32_t i = 0; i < RING_BENCH_ELEMENTS; i++)
+    {
+        element.bytes[0] = (uint8_t) i;
+        while(_ringPush(&_ring, &element) == false)
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    RingBenchElement_t element = { { 0 } };
+    pthread_t producer;
+    uint32_t checksum = 0;
+
+    if(_ringInit(&_ring, RING_BENCH_CAPACITY, sizeof(RingBenchElement_t)) == false)
+    {
+        return 1;
+    }
+
+    uint64_t startNs = _nowNs();
+    for(uint32_t i = 0; i < RING_BENCH_ELEMENTS; i++)
+    {
+        element.bytes[0] = (uint8_t) i;
+        _ringPush(&_ring, &element);
+        _ringPop(&_ring, &element);
+        checksum += element.bytes[0];
+    }
+    uint64_t elapsedNs = _nowNs() - startNs;
+    printf("one thread: %.1f ns per push and pop\n", (double) elapsedNs / RING_BENCH_ELEMENTS);
+
+    startNs = _nowNs();
+    pthread_create(&producer, NULL, _producer, NULL);
+    for(uint32_t i = 0; i < RING_BENCH_ELEMENTS; i++)
+    {
+        while(_ringPop(&_ring, &element) == false)
+        {
+            sched_yield();
+        }
+        checksum += element.bytes[0];
+    }
+    pthread_join(producer, NULL);
+    elapsedNs = _nowNs() - startNs;
+    printf("two threads: %.1f M elements/s, %u pushes into a full ring, %u left (checksum %u)\n",
+           RING_BENCH_ELEMENTS * 1000.0 / elapsedNs, _ring.overflowCount, _ringCount(&_ring), checksum);
+
+    free(_ring.pStorage);
+    return 0;
+}
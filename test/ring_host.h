@@ -0,0 +1,17 @@
+/**
+ * the few definitions aws_iot_shadow_ring.h takes from FreeRTOS and the iot
+ * logging, so the ring builds on the host
+ */
+
+#ifndef RING_HOST_H
+#define RING_HOST_H
+
+#include <stdio.h>
+
+typedef void *TaskHandle_t;
+
+#define IotLogError(...) do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while(0)
+
+#include "aws_iot_shadow_ring.h"
+
+#endif /* RING_HOST_H */
@@ -0,0 +1,153 @@
+/**
+ * concurrency test of the spsc ring, run under ThreadSanitizer. One thread
+ * pushes numbered elements as fast as it can while another pops them, the
+ * consumer checks every element arrives once, in order and not torn.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "ring_host.h"
+
+#define RING_TEST_CAPACITY (64)
+#define RING_TEST_ELEMENTS (1000000u)
+#define RING_TEST_WORDS (11)//an odd size that is not a multiple of the cache line
+
+typedef struct RingTestElement{
+    uint32_t sequence;
+    uint32_t words[RING_TEST_WORDS];
+}RingTestElement_t;
+
+static SpscRing_t _ring;
+
+static void *_producer(void *pArgument)
+{
+    RingTestElement_t element;
+    uint32_t *pOverflows = pArgument;
+
+    for(uint32_t sequence = 0; sequence < RING_TEST_ELEMENTS; sequence++)
+    {
+        element.sequence = sequence;
+        for(int i = 0; i < RING_TEST_WORDS; i++)
+        {
+            element.words[i] = sequence * 31u + (uint32_t) i;
+        }
+        while(_ringPush(&_ring, &element) == false)
+        {
+            sched_yield();
+        }
+    }
+    *pOverflows = _ring.overflowCount;
+    return NULL;
+}
+
+static int _ringTestInit(void)
+{
+    SpscRing_t ring;
+
+    if(_ringInit(&ring, 48, sizeof(RingTestElement_t)) == true)
+    {
+        printf("FAIL: a capacity of 48 was accepted\n");
+        return 1;
+    }
+    if(_ringInit(&_ring, RING_TEST_CAPACITY, sizeof(RingTestElement_t)) == false)
+    {
+        printf("FAIL: ring init\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * fill the ring on one thread, a push into the full ring fails and is
+ * counted, and the free running counters wrap past UINT32_MAX
+ */
+static int _ringTestFull(void)
+{
+    SpscRing_t ring;
+    uint32_t value;
+
+    if(_ringInit(&ring, 4, sizeof(uint32_t)) == false)
+    {
+        printf("FAIL: ring init\n");
+        return 1;
+    }
+    ring.head = ring.tail = UINT32_MAX - 1;
+
+    for(uint32_t i = 0; i < 4; i++)
+    {
+        if(_ringPush(&ring, &i) == false)
+        {
+            printf("FAIL: push %u into a ring of 4\n", i);
+            return 1;
+        }
+    }
+    value = 4;
+    if(_ringPush(&ring, &value) == true || ring.overflowCount != 1 || _ringCount(&ring) != 4)
+    {
+        printf("FAIL: push into a full ring\n");
+        return 1;
+    }
+    for(uint32_t i = 0; i < 4; i++)
+    {
+        if(_ringPop(&ring, &value) == false || value != i)
+        {
+            printf("FAIL: pop %u after wrapping\n", i);
+            return 1;
+        }
+    }
+    if(_ringPop(&ring, &value) == true)
+    {
+        printf("FAIL: pop from an empty ring\n");
+        return 1;
+    }
+    free(ring.pStorage);
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t producer;
+    uint32_t overflows = 0;
+    RingTestElement_t element;
+
+    if(_ringTestFull() != 0 || _ringTestInit() != 0)
+    {
+        return 1;
+    }
+
+    pthread_create(&producer, NULL, _producer, &overflows);
+
+    for(uint32_t expected = 0; expected < RING_TEST_ELEMENTS; expected++)
+    {
+        while(_ringPop(&_ring, &element) == false)
+        {
+            sched_yield();
+        }
+        if(element.sequence != expected)
+        {
+            printf("FAIL: element %u arrived as %u\n", expected, element.sequence);
+            return 1;
+        }
+        for(int i = 0; i < RING_TEST_WORDS; i++)
+        {
+            if(element.words[i] != expected * 31u + (uint32_t) i)
+            {
+                printf("FAIL: element %u torn at word %d\n", expected, i);
+                return 1;
+            }
+        }
+    }
+
+    pthread_join(producer, NULL);
+    if(_ringCount(&_ring) != 0)
+    {
+        printf("FAIL: %u elements left in the ring\n", _ringCount(&_ring));
+        return 1;
+    }
+
+    printf("ring test passed, %u elements, %u pushes into a full ring\n", RING_TEST_ELEMENTS, overflows);
+    free(_ring.pStorage);
+    return 0;
+}